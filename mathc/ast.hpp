@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <node.hpp>
+#include <number.hpp>
+#include <stats.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// Flat, arena-backed alternative to the node variant tree. Nodes live contiguously in
+// ast::nodes and reference their children by 32-bit index, so building a tree does no
+// per-node allocation, clear() drops a whole tree at once and nodes are immutable once
+// created: "copying" a subtree inside the same ast is passing its index around.
+
+using node_index = std::uint32_t;
+
+constexpr static node_index null_index = std::numeric_limits<node_index>::max();
+
+enum class flat_node_type : std::uint8_t
+{
+    op,
+    constant,
+    symbol,
+    function_call
+};
+
+struct flat_node
+{
+    flat_node_type type;
+    operation_type operation{ operation_type::add };
+    std::uint32_t first{ 0 };           // op: left child, constant: index into ast::constants, symbol/function_call: name offset
+    std::uint32_t second{ 0 };          // op: right child, symbol/function_call: name length
+    std::uint32_t arguments{ 0 };       // function_call: offset into ast::arguments
+    std::uint32_t argument_count{ 0 };  // function_call
+    symbol_id symbol{ null_symbol };    // symbol: resolved id, if parsed against a symbol_table
+    function_id function{ null_function };  // function_call: resolved id
+};
+
+struct ast
+{
+    std::vector<flat_node> nodes{};
+    std::vector<node_index> arguments{};
+    std::vector<number> constants{};
+    std::string names{};
+
+    constexpr inline const flat_node& operator[](const node_index index) const { return nodes[index]; }
+    constexpr inline std::size_t size() const { return nodes.size(); }
+
+    constexpr inline node_index left(const flat_node& n) const { assert(n.type == flat_node_type::op); return n.first; }
+    constexpr inline node_index right(const flat_node& n) const { assert(n.type == flat_node_type::op); return n.second; }
+    constexpr inline const number& value(const flat_node& n) const { return constants[n.first]; }
+
+    constexpr inline std::string_view name(const flat_node& n) const
+    {
+        assert(n.type == flat_node_type::symbol || n.type == flat_node_type::function_call);
+        return std::string_view{ names }.substr(n.first, n.second);
+    }
+
+    constexpr inline std::span<const node_index> arguments_of(const flat_node& n) const
+    {
+        assert(n.type == flat_node_type::function_call);
+        return std::span{ arguments }.subspan(n.arguments, n.argument_count);
+    }
+
+    constexpr node_index make_constant(const number& value);
+    constexpr node_index make_symbol(const std::string_view symbol, symbol_id id = null_symbol);
+    constexpr node_index make_op(node_index left, node_index right, operation_type type);
+    constexpr node_index make_function_call(const std::string_view function_name, std::span<const node_index> function_arguments,
+                                            function_id id = null_function);
+
+    // Keeps the capacity around so the next tree built into this ast doesn't allocate.
+    constexpr void clear()
+    {
+        nodes.clear();
+        arguments.clear();
+        constants.clear();
+        names.clear();
+    }
+
+private:
+    constexpr node_index push(const flat_node& n)
+    {
+        nodes.emplace_back(n);
+        return static_cast<node_index>(nodes.size() - 1);
+    }
+
+    constexpr std::uint32_t push_name(const std::string_view name)
+    {
+        const auto offset = static_cast<std::uint32_t>(names.size());
+        names.append(name);
+        return offset;
+    }
+};
+
+constexpr inline node_index ast::make_constant(const number& value)
+{
+    constants.emplace_back(value);
+    return push({ .type = flat_node_type::constant,
+                  .first = static_cast<std::uint32_t>(constants.size() - 1) });
+}
+
+constexpr inline node_index ast::make_symbol(const std::string_view symbol, const symbol_id id)
+{
+    return push({ .type = flat_node_type::symbol,
+                  .first = push_name(symbol),
+                  .second = static_cast<std::uint32_t>(symbol.size()),
+                  .symbol = id });
+}
+
+constexpr inline node_index ast::make_op(const node_index left, const node_index right, const operation_type type)
+{
+    assert(left < nodes.size() && right < nodes.size());
+    return push({ .type = flat_node_type::op,
+                  .operation = type,
+                  .first = left,
+                  .second = right });
+}
+
+constexpr inline node_index ast::make_function_call(const std::string_view function_name,
+                                                    const std::span<const node_index> function_arguments,
+                                                    const function_id id)
+{
+    const auto offset = static_cast<std::uint32_t>(arguments.size());
+    arguments.insert(arguments.end(), function_arguments.begin(), function_arguments.end());
+
+    return push({ .type = flat_node_type::function_call,
+                  .first = push_name(function_name),
+                  .second = static_cast<std::uint32_t>(function_name.size()),
+                  .arguments = offset,
+                  .argument_count = static_cast<std::uint32_t>(function_arguments.size()),
+                  .function = id });
+}
+
+// Conversions between the tree and the arena
+
+constexpr static inline node_index copy_node(const node& n, ast& to)
+{
+    count_stat(&pipeline_stats::copies);
+    const struct
+    {
+        ast& to;
+
+        constexpr node_index operator()(const op_node& op) const
+        {
+            const auto left = copy_node(*op.left, to);
+            const auto right = copy_node(*op.right, to);
+            return to.make_op(left, right, op.type);
+        }
+        constexpr node_index operator()(const function_call_node& op) const
+        {
+            std::vector<node_index> function_arguments;
+            function_arguments.reserve(op.arguments.size());
+            for(const auto& argument : op.arguments)
+                function_arguments.emplace_back(copy_node(argument, to));
+
+            return to.make_function_call(op.function_name, function_arguments, op.id);
+        }
+        constexpr node_index operator()(const symbol_node& op) const { return to.make_symbol(op.value, op.id); }
+        constexpr node_index operator()(const constant_node& op) const { return to.make_constant(op.value); }
+    } flatten_visitor{ to };
+
+    return std::visit(flatten_visitor, n);
+}
+
+constexpr static inline node copy_node(const ast& from, const node_index index)
+{
+    count_stat(&pipeline_stats::copies);
+    const auto& n = from[index];
+    switch(n.type) {
+        case flat_node_type::op:
+            return make_node<op_node>(node_ptr{ copy_node(from, from.left(n)) },
+                                      node_ptr{ copy_node(from, from.right(n)) },
+                                      n.operation);
+        case flat_node_type::constant:
+            return make_node<constant_node>(from.value(n));
+        case flat_node_type::symbol:
+            return make_node<symbol_node>(std::string{ from.name(n) }, n.symbol);
+        case flat_node_type::function_call: {
+            std::vector<node> function_arguments;
+            function_arguments.reserve(n.argument_count);
+            for(const auto argument : from.arguments_of(n))
+                function_arguments.emplace_back(copy_node(from, argument));
+
+            return make_node<function_call_node>(std::string{ from.name(n) }, std::move(function_arguments), n.function);
+        }
+    }
+
+    std::unreachable();
+}
+
+// Deep copy between arenas. Within one ast, reuse the index instead.
+constexpr static inline node_index copy_node(const ast& from, const node_index index, ast& to)
+{
+    assert(&from != &to);
+    count_stat(&pipeline_stats::copies);
+    const auto& n = from[index];
+    switch(n.type) {
+        case flat_node_type::op: {
+            const auto left = copy_node(from, from.left(n), to);
+            const auto right = copy_node(from, from.right(n), to);
+            return to.make_op(left, right, n.operation);
+        }
+        case flat_node_type::constant:
+            return to.make_constant(from.value(n));
+        case flat_node_type::symbol:
+            return to.make_symbol(from.name(n), n.symbol);
+        case flat_node_type::function_call: {
+            std::vector<node_index> function_arguments;
+            function_arguments.reserve(n.argument_count);
+            for(const auto argument : from.arguments_of(n))
+                function_arguments.emplace_back(copy_node(from, argument, to));
+
+            return to.make_function_call(from.name(n), function_arguments, n.function);
+        }
+    }
+
+    std::unreachable();
+}
+
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <expected>
+#include <span>
+#include <vector>
+
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <simd.hpp>
+
+namespace mathc
+{
+
+// Evaluates one compiled program over columns of bindings. Rows are processed in blocks of
+// block_size: every instruction runs once per block over a whole register of rows, so
+// dispatch is paid per operator per block rather than per row.
+//
+// Columns are doubles and are given in program::symbols order. Integer semantics are not
+// kept: every value is promoted to double, which only differs from vm::execute for
+// integers beyond 2^53.
+struct batch_evaluator
+{
+    constexpr static std::size_t block_size = 256;
+
+    std::vector<double> registers{};
+
+    constexpr batch_result evaluate(const program& p,
+                                    std::span<const std::span<const double>> columns,
+                                    std::span<double> output);
+
+    constexpr static batch_result validate(const program& p,
+                                           std::span<const std::span<const double>> columns,
+                                           std::size_t rows);
+
+private:
+    constexpr inline std::span<double> block(const std::size_t r, const std::size_t rows)
+    {
+        return std::span{ registers }.subspan(r * block_size, rows);
+    }
+};
+
+// Implementation
+
+constexpr inline batch_result batch_evaluator::validate(const program& p,
+                                                        const std::span<const std::span<const double>> columns,
+                                                        const std::size_t rows)
+{
+    if (columns.size() != p.symbols.size())
+        return batch_result{ std::unexpect_t{},
+                             std::format("Expected {} columns, got {}.", p.symbols.size(), columns.size()) };
+
+    for(auto i = 0u; i < columns.size(); i++)
+        if (columns[i].size() < rows)
+            return batch_result{ std::unexpect_t{},
+                                 std::format("Column {} has {} rows, expected {}.", p.symbols[i], columns[i].size(), rows) };
+
+    for(const auto& i : p.instructions) {
+        if (i.code != opcode::call)
+            continue;
+
+        const auto& function = p.functions[i.operand];
+        if (!function.batch)
+            return batch_result{ std::unexpect_t{}, std::format("{} has no batch kernel.", function.name) };
+        if (i.argument_count != 1)
+            return batch_result{ std::unexpect_t{},
+                                 std::format("{} expects 1 argument, got {}", function.name, i.argument_count) };
+    }
+
+    return {};
+}
+
+constexpr inline batch_result batch_evaluator::evaluate(const program& p,
+                                                        const std::span<const std::span<const double>> columns,
+                                                        const std::span<double> output)
+{
+    if (const auto valid = validate(p, columns, output.size()); !valid.has_value())
+        return valid;
+
+    // Temporaries live in the registers past the stack.
+    const auto stack_registers = std::max<std::size_t>(p.max_stack_depth, 1);
+    registers.resize((stack_registers + p.temporaries) * block_size);
+    const auto& kernels = active_kernels();
+
+    for(auto start = std::size_t{ 0 }; start < output.size(); start += block_size) {
+        const auto rows = std::min(block_size, output.size() - start);
+        auto top = std::size_t{ 0 };
+
+        for(const auto& i : p.instructions) {
+            switch(i.code) {
+                case opcode::push_constant: {
+                    std::ranges::fill(block(top++, rows), p.constants[i.operand].promote_to_double());
+                    break;
+                }
+                case opcode::load_symbol: {
+                    std::ranges::copy(columns[i.operand].subspan(start, rows), block(top++, rows).begin());
+                    break;
+                }
+                case opcode::add:
+                case opcode::sub:
+                case opcode::mul:
+                case opcode::div:
+                case opcode::exp: {
+                    const auto right = block(--top, rows);
+                    const auto left = block(top - 1, rows);
+
+                    switch(i.code) {
+                        case opcode::add: kernels.add(left, right); break;
+                        case opcode::sub: kernels.sub(left, right); break;
+                        case opcode::mul: kernels.mul(left, right); break;
+                        case opcode::div: kernels.div(left, right); break;
+                        case opcode::exp: kernels.pow(left, right); break;
+                        case opcode::push_constant:
+                        case opcode::load_symbol:
+                        case opcode::call:
+                        case opcode::store_temp:
+                        case opcode::load_temp:
+                            std::unreachable();
+                    }
+                    break;
+                }
+                case opcode::call: {
+                    const auto& function = p.functions[i.operand];
+                    function.batch(block(top - 1, rows));
+                    break;
+                }
+                case opcode::store_temp: {
+                    std::ranges::copy(block(top - 1, rows), block(stack_registers + i.operand, rows).begin());
+                    break;
+                }
+                case opcode::load_temp: {
+                    std::ranges::copy(block(stack_registers + i.operand, rows), block(top++, rows).begin());
+                    break;
+                }
+            }
+        }
+
+        std::ranges::copy(block(0, rows), output.subspan(start, rows).begin());
+    }
+
+    return {};
+}
+
+}
@@ -0,0 +1,817 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <initializer_list>
+#include <limits>
+#include <new>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <ast.hpp>
+#include <bytecode.hpp>
+#include <dag.hpp>
+#include <functions.hpp>
+#include <image.hpp>
+#include <interpreter.hpp>
+#include <jit.hpp>
+#include <lexer.hpp>
+#include <parallel.hpp>
+#include <parser.hpp>
+#include <quaternion.hpp>
+#include <scan.hpp>
+#include <server.hpp>
+#include <simd.hpp>
+#include <typed.hpp>
+#include <workspace.hpp>
+
+// Times each stage of the front end and the tree interpreter on generated workloads and
+// prints one JSON object per (workload, size, stage) line, to diff between releases:
+//
+//   {"workload":"wide_sum","size":1000,"stage":"parse","iterations":...,"ns_per_op":...,
+//    "allocations_per_op":...,"bytes_per_op":...,"mb_per_s":...}
+//
+// mb_per_s is source bytes processed per second. Build like main.cpp, with optimizations
+// (clang++ @compile_flags.txt -O2 bench.cpp -o bench). Usage: bench [workload filter]
+//
+// bench --check-allocations [workload filter] instead counts what each stage of a warm
+// workspace allocates, one JSON object per (workload, size), and exits 1 if any did or if
+// an evaluation failed.
+//
+// bench --check-runtime runs what constant evaluation can't: native code and programs read
+// from an image against vm::execute, simplification on worker threads against
+// interpreter::simplify, and the vector kernel and rotation tables and the lexer's block
+// scans against their scalar forms, and a server over a loopback socket, one JSON object per
+// check, and exits 1 if any failed.
+
+using namespace mathc;
+
+namespace
+{
+
+constinit std::atomic<std::size_t> allocations{ 0 };
+constinit std::atomic<std::size_t> allocated_bytes{ 0 };
+constinit std::atomic<std::size_t> sink{ 0 };
+
+}
+
+void* operator new(const std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (auto* p = std::malloc(size == 0 ? 1 : size); p)
+        return p;
+
+    throw std::bad_alloc{};
+}
+
+void* operator new[](const std::size_t size) { return ::operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+
+struct workload
+{
+    std::string_view name;
+    std::string(*generate)(std::size_t size);
+};
+
+std::string symbol_name(std::size_t i)
+{
+    auto name = std::string{ "x" };
+    do { name += static_cast<char>('a' + i % 26); i /= 26; } while(i > 0);
+    return name;
+}
+
+constexpr auto workloads = std::array
+{
+    workload{ "deep_nesting", [](const std::size_t size) {
+        auto source = std::string(size, '(') + "1";
+        for(auto i = 0u; i < size; i++)
+            source += "+1)";
+        return source;
+    } },
+    workload{ "wide_sum", [](const std::size_t size) {
+        auto source = std::string{ "1" };
+        for(auto i = 1u; i < size; i++)
+            source += std::format(" + {}", i);
+        return source;
+    } },
+    workload{ "function_calls", [](const std::size_t size) {
+        auto source = std::string{ "sqrt(4)" };
+        for(auto i = 1u; i < size; i++)
+            source += std::format(" + {}({})", i % 3 == 0 ? "sqrt" : i % 3 == 1 ? "log2" : "ln", i + 1);
+        return source;
+    } },
+    workload{ "many_symbols", [](const std::size_t size) {
+        auto source = symbol_name(0);
+        for(auto i = 1u; i < size; i++)
+            source += std::format(" + 2{}", symbol_name(i));
+        return source;
+    } },
+    workload{ "long_decimals", [](const std::size_t size) {
+        auto source = std::string{};
+        for(auto i = 0u; i < size; i++) {
+            if (i > 0)
+                source += " * ";
+            source += "1.";
+            for(auto digit = 0u; digit < 40; digit++)
+                source += static_cast<char>('0' + (i + digit) % 10);
+        }
+        return source;
+    } },
+};
+
+constexpr auto sizes = std::array<std::size_t, 3>{ 10, 100, 1000 };
+
+// Repeats op until at least min_time has passed, with allocation counters taken around the
+// timed loop.
+void measure(const std::string_view workload_name, const std::size_t size, const std::string_view stage,
+             const std::size_t source_bytes, auto&& op)
+{
+    constexpr auto min_time = std::chrono::milliseconds{ 200 };
+
+    op();  // warm up
+
+    auto iterations = std::size_t{ 0 };
+    const auto allocations_before = allocations.load(std::memory_order_relaxed);
+    const auto bytes_before = allocated_bytes.load(std::memory_order_relaxed);
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration{};
+
+    do {
+        for(auto i = 0u; i < 16; i++)
+            op();
+        iterations += 16;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while(elapsed < min_time);
+
+    const auto ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    const auto n = static_cast<double>(iterations);
+    const auto allocations_per_op = static_cast<double>(allocations.load(std::memory_order_relaxed) - allocations_before) / n;
+    const auto bytes_per_op = static_cast<double>(allocated_bytes.load(std::memory_order_relaxed) - bytes_before) / n;
+    const auto mb_per_s = static_cast<double>(source_bytes) * n / (ns / 1e9) / 1e6;
+
+    std::println(R"({{"workload":"{}","size":{},"stage":"{}","iterations":{},"ns_per_op":{:.1f},"allocations_per_op":{:.2f},"bytes_per_op":{:.1f},"mb_per_s":{:.2f}}})",
+                 workload_name, size, stage, iterations, ns / n, allocations_per_op, bytes_per_op, mb_per_s);
+}
+
+// Allocations per workspace_stage, attributed by workspace::on_stage.
+struct stage_allocations
+{
+    std::array<std::size_t, 3> counts{};
+    std::size_t mark{ 0 };
+};
+
+// The first evaluation grows the workspace and the vm; the second must succeed without
+// allocating. Symbols are bound first, or their workloads would stop at the unbound error.
+bool check_allocations(const std::string_view workload_name, const std::size_t size, const std::string_view source)
+{
+    auto w = workspace{};
+    auto vm = mathc::vm{};
+    if (const auto parsed = parser::parse(source); parsed.has_value())
+        if (const auto compiled = compiler::compile(parsed.value()); compiled.has_value())
+            for(const auto& symbol : compiled.value().symbols)
+                vm.insert_symbol(symbol, make_node<constant_node>(number::from_int(1)));
+
+    const auto warm = w.evaluate(source, vm);
+
+    auto counted = stage_allocations{};
+    w.context = &counted;
+    w.on_stage = [](const workspace_stage stage, void* context) {
+        auto& c = *static_cast<stage_allocations*>(context);
+        const auto now = allocations.load(std::memory_order_relaxed);
+        c.counts[static_cast<std::size_t>(stage)] += now - c.mark;
+        c.mark = now;
+    };
+
+    counted.mark = allocations.load(std::memory_order_relaxed);
+    const auto steady = w.evaluate(source, vm);
+    sink.fetch_add(warm.has_value() + steady.has_value(), std::memory_order_relaxed);
+
+    const auto& [parse, compile, execute] = counted.counts;
+    std::println(R"({{"workload":"{}","size":{},"parse":{},"compile":{},"execute":{},"evaluated":{}}})",
+                 workload_name, size, parse, compile, execute, steady.has_value());
+    if (!steady.has_value())
+        std::println(stderr, "{} {}: {}", workload_name, size, steady.error().message());
+
+    return steady.has_value() && parse + compile + execute == 0;
+}
+
+
+void report(const std::string_view check, const std::string_view name, const bool passed)
+{
+    std::println(R"({{"check":"{}","name":"{}","passed":{}}})", check, name, passed);
+}
+
+execution_result user_hypot(const std::span<number> args)
+{
+    const auto x = args[0].promote_to_double();
+    const auto y = args[1].promote_to_double();
+    return make_execution_result<number>(std::sqrt(x * x + y * y));
+}
+
+// A server on a unix socket answers framed requests over a real connection, with each
+// request's bindings, and their names, gone by the next request.
+bool check_server()
+{
+    const auto path = std::format("/tmp/mathc-bench-{}.sock", ::getpid());
+    auto daemon = server{ server_settings{ .workers = 1 } };
+    if (const auto listening = daemon.listen(std::format("unix:{}", path)); !listening.has_value()) {
+        std::println(stderr, "{}", listening.error().error);
+        report("server", "listen", false);
+        return false;
+    }
+
+    auto running = std::jthread{ [&] { daemon.run(); } };
+
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+    auto address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    std::ranges::copy(path, &address.sun_path[0]);
+    const auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    auto connected = fd >= 0 && ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+
+    // One request out, its response back; empty if the connection failed.
+    const auto round_trip = [&](const std::uint32_t id, const std::string_view text) {
+        const auto header = encode_frame_header(static_cast<std::uint32_t>(text.size()), id);
+        auto frame = std::string{ header.data(), header.size() }.append(text);
+        for(auto sent = 0uz; connected && sent < frame.size();) {
+            const auto n = ::send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            connected = n > 0;
+            sent += connected ? static_cast<std::size_t>(n) : 0;
+        }
+
+        auto received = std::string{};
+        const auto receive = [&](const std::size_t size) {
+            while(connected && received.size() < size) {
+                auto chunk = std::array<char, 4096>{};
+                const auto n = ::recv(fd, chunk.data(), std::min(chunk.size(), size - received.size()), 0);
+                connected = n > 0;
+                received.append(chunk.data(), connected ? static_cast<std::size_t>(n) : 0);
+            }
+        };
+
+        receive(frame_header_size);
+        const auto response = connected ? decode_frame_header(received) : frame_header{ .length = 0, .id = 0 };
+        receive(frame_header_size + response.length);
+        return connected && response.id == id ? received.substr(frame_header_size) : std::string{};
+    };
+    #pragma GCC diagnostic pop
+
+    auto many = std::string{};
+    for(auto i = 0u; i < 1000; i++)
+        many += std::format("s{} = {}\n", i, i);
+    many += "s999 + 1\n";
+
+    const auto bound = round_trip(1, "x = 2\nx * 3\n");
+    const auto rebound = round_trip(2, "x = 5\ny = x + 1\ny * 3\nz\n");
+    const auto unbound = round_trip(3, "x * 3\n");
+    const auto names = round_trip(4, many);
+    if (fd >= 0)
+        ::close(fd);
+
+    daemon.stop();
+    running.join();
+    ::unlink(path.c_str());
+
+    const auto expect = [](const std::string_view name, const bool passed) {
+        report("server", name, passed);
+        return passed;
+    };
+
+    auto passed = expect("round_trip", bound == "6\n");
+    passed = expect("rebound", rebound.starts_with("18\n") && rebound.ends_with("z\n")) && passed;
+    passed = expect("bindings_scoped", !unbound.empty() && unbound != "6\n" && unbound != "15\n" && !unbound.starts_with("error")) && passed;
+    passed = expect("many_bindings", names == "1000\n") && passed;
+    return passed;
+}
+
+// Programs read back from an image run as they did when written, on a vm of their own;
+// images cut short or with bad fields are refused when opened.
+bool check_image()
+{
+    const auto bind = [](mathc::vm& vm, const bool with_hypot) {
+        if (with_hypot)
+            vm.define_function({ .name = "hypot", .func = user_hypot, .arity = 2 });
+        vm.insert_symbol("x", make_node<constant_node>(number{ 1.5 }));
+        vm.insert_symbol("y", make_node<constant_node>(number::from_int(3)));
+    };
+
+    auto writing = mathc::vm{};
+    bind(writing, true);
+
+    constexpr auto sources = std::array<std::string_view, 4>{
+        "x * 2 + sqrt(y)", "ln(x) - y ^ 2", "hypot(x, y) / 2", "(x + y) * (x + y) - sqrt(x + y)" };
+    auto programs = std::vector<program>{};
+    auto writer = image_writer{};
+    for(const auto source : sources) {
+        auto tree = ast{};
+        const auto root = arena_parser::parse(source, tree, writing.symbols, writing.functions).value();
+        const auto d = dag_builder::build(tree, root);
+        programs.emplace_back(compiler::compile(d.tree, d.root, writing.symbols, writing.functions).value());
+        writer.add(programs.back(), source);
+    }
+    const auto bytes = writer.finish();
+
+    // Copied into 8-byte aligned storage, as a mapping would be.
+    auto storage = std::vector<std::uint64_t>{};
+    const auto aligned = [&](const std::string_view contents) {
+        storage.assign((contents.size() + 7) / 8, 0);
+        std::memcpy(storage.data(), contents.data(), contents.size());
+        return std::string_view{ reinterpret_cast<const char*>(storage.data()), contents.size() };
+    };
+
+    auto reading = mathc::vm{};
+    bind(reading, true);
+    const auto opened = image::open(aligned(bytes), reading);
+    auto round_trip = opened.has_value() && opened->size() == programs.size() && programs.back().temporaries > 0;
+    for(auto i = 0uz; round_trip && i < programs.size(); i++) {
+        const auto expected = writing.execute(programs[i]);
+        const auto read = reading.execute((*opened)[i]);
+        round_trip = expected.has_value() && read.has_value() && read->bits == expected->bits &&
+                     opened->source(i) == sources[i];
+    }
+    report("image", "round_trip", round_trip);
+
+    auto header = image_header{};
+    std::memcpy(&header, bytes.data(), sizeof(header));
+
+    const auto refused = [&](const std::string_view name, const std::string& contents, const bool with_hypot = true) {
+        auto vm = mathc::vm{};
+        bind(vm, with_hypot);
+        const auto passed = !image::open(aligned(contents), vm).has_value();
+        report("image", name, passed);
+        return passed;
+    };
+    // A copy with one image_program field of the last program set to value.
+    const auto with_field = [&](const std::size_t field, const std::uint32_t value) {
+        auto contents = bytes;
+        const auto offset = header.programs + (programs.size() - 1) * sizeof(image_program) + field;
+        std::memcpy(std::span{ contents }.subspan(offset).data(), &value, sizeof(value));
+        return contents;
+    };
+
+    auto bad_magic = bytes;
+    bad_magic.front() = 'x';
+
+    auto passed = round_trip;
+    passed = refused("truncated_header", bytes.substr(0, sizeof(image_header) - 8)) && passed;
+    passed = refused("truncated_sections", bytes.substr(0, bytes.size() - 8)) && passed;
+    passed = refused("bad_magic", bad_magic) && passed;
+    passed = refused("undefined_function", bytes, false) && passed;
+    passed = refused("instructions_out_of_range", with_field(offsetof(image_program, instruction_count), 1u << 30)) && passed;
+    passed = refused("stack_depth_too_large", with_field(offsetof(image_program, max_stack_depth), 1u << 30)) && passed;
+    passed = refused("temporaries_too_large", with_field(offsetof(image_program, temporaries), 1u << 30)) && passed;
+    return passed;
+}
+
+// Above the threshold, on several threads, parallel_evaluator gives what interpreter::simplify
+// does: the same number, a residual of the same size, or the same first error.
+bool check_parallel()
+{
+    auto evaluator = parallel_evaluator{};
+    evaluator.threads = 4;
+
+    auto source = std::string{};
+    for(auto i = 0uz; i < 8192; i++)
+        source += "(x * 3 + sqrt(4) * (x - 1)) + ";
+
+    const auto agrees = [&](const std::string_view name, const std::string_view tail) {
+        auto tree = ast{};
+        auto vm = mathc::vm{};
+        vm.insert_symbol("x", make_node<constant_node>(number::from_int(2)));
+        const auto root = arena_parser::parse(source + std::string{ tail }, tree).value();
+        const auto above = tree.size() > evaluator.threshold;
+
+        auto sequential_tree = tree;
+        const auto sequential = interpreter::simplify(sequential_tree, root, vm);
+        const auto parallel = evaluator.simplify(tree, root, vm);
+
+        auto passed = above && evaluator.subtrees > evaluator.threads && sequential.has_value() == parallel.has_value();
+        if (passed && !sequential.has_value())
+            passed = sequential.error().error == parallel.error().error;
+        else if (passed && std::holds_alternative<number>(sequential.value()))
+            passed = std::holds_alternative<number>(parallel.value()) &&
+                     std::get<number>(parallel.value()).approx_equals(std::get<number>(sequential.value()));
+        else if (passed)
+            passed = std::holds_alternative<node_index>(parallel.value()) && tree.size() == sequential_tree.size();
+
+        report("parallel", name, passed);
+        return passed;
+    };
+
+    auto passed = agrees("number", "1");
+    passed = agrees("residual", "y") && passed;
+    passed = agrees("error_order", "nope(1) + missing(2)") && passed;
+    return passed;
+}
+
+// Doubles that agree within what the kernels promise: the same NaN-ness, infinities of the
+// same sign, otherwise a relative 1e-14, a few dozen ulp.
+bool nearly_equal(const double a, const double b)
+{
+    if (std::isnan(a) || std::isnan(b))
+        return std::isnan(a) && std::isnan(b);
+    if (std::isinf(a) || std::isinf(b))
+        return std::isinf(a) && std::isinf(b) && std::signbit(a) == std::signbit(b);
+
+    return std::abs(a - b) <= 1e-14 * std::max(std::abs(a), std::abs(b));
+}
+
+// Every kernel table this cpu can run gives what the scalar table does. No length is a
+// multiple of a vector's lanes, so each run ends in a tail; the inputs mix chunks of
+// positive normals, which take the vector paths, with subnormals, zeros, negatives,
+// infinities and NaN, which fall back lane by lane. pow's exponents are all small integers
+// in one set, for the square-and-multiply path, and include fractions in the other.
+bool check_kernels()
+{
+    constexpr auto infinity = std::numeric_limits<double>::infinity();
+    constexpr auto not_a_number = std::numeric_limits<double>::quiet_NaN();
+    constexpr auto lengths = std::array<std::size_t, 6>{ 1, 3, 7, 13, 31, 67 };
+    constexpr auto specials = std::array{ 0.5, 1.25, 3.0, 10.0, 1e300, 1e-310, 4.9e-324, -2.0, -0.0, 0.0,
+                                          0x1p-1022, 0.999, 7.5, infinity, -infinity, not_a_number };
+    constexpr auto integral_exponents = std::array{ 0.0, 1.0, 2.0, 3.0, -1.0, -2.0, 8.0, -8.0, 5.0 };
+    constexpr auto exponents = std::array{ 2.0, -3.0, 0.5, 1.5, 8.0, -8.0, 2.5, -0.25, 9.0, infinity, not_a_number };
+
+    using unary = void(*kernel_table::*)(std::span<double>);
+    using binary = void(*kernel_table::*)(std::span<double>, std::span<const double>);
+    constexpr auto unaries = std::array<std::pair<std::string_view, unary>, 3>{ {
+        { "sqrt", &kernel_table::sqrt }, { "log2", &kernel_table::log2 }, { "ln", &kernel_table::ln } } };
+    constexpr auto binaries = std::array<std::pair<std::string_view, binary>, 5>{ {
+        { "add", &kernel_table::add }, { "sub", &kernel_table::sub }, { "mul", &kernel_table::mul },
+        { "div", &kernel_table::div }, { "pow", &kernel_table::pow } } };
+
+    const auto column = [](const std::size_t length, auto&& value) {
+        auto c = std::vector<double>(length);
+        for(auto i = 0uz; i < length; i++)
+            c[i] = value(i);
+        return c;
+    };
+    const auto cycle = [](const auto& values) { return [&values](const std::size_t i) { return values[i % values.size()]; }; };
+    const auto ramp = [](const std::size_t i) { return 0.1 + 0.37 * static_cast<double>(i); };
+
+    auto passed = true;
+    for(const auto* table : available_kernels()) {
+        if (table == &scalar_kernel_table)
+            continue;
+
+        const auto agrees = [&](const std::span<const double> expected, const std::span<const double> got) {
+            return std::ranges::equal(expected, got, nearly_equal);
+        };
+
+        for(const auto& [name, kernel] : unaries) {
+            auto table_passed = true;
+            for(const auto length : lengths) {
+                for(const auto& input : { column(length, ramp), column(length, cycle(specials)) }) {
+                    auto expected = input, got = input;
+                    (scalar_kernel_table.*kernel)(expected);
+                    (table->*kernel)(got);
+                    table_passed = agrees(expected, got) && table_passed;
+                }
+            }
+
+            report("kernels", std::format("{}_{}", table->name, name), table_passed);
+            passed = table_passed && passed;
+        }
+
+        for(const auto& [name, kernel] : binaries) {
+            auto table_passed = true;
+            for(const auto length : lengths) {
+                const auto lefts = { column(length, ramp), column(length, cycle(specials)) };
+                const auto rights = { column(length, cycle(integral_exponents)), column(length, cycle(exponents)),
+                                      column(length, [&](const std::size_t i) { return specials[(i * 7) % specials.size()]; }) };
+                for(const auto& left : lefts) {
+                    for(const auto& right : rights) {
+                        auto expected = left, got = left;
+                        (scalar_kernel_table.*kernel)(expected, right);
+                        (table->*kernel)(got, right);
+                        table_passed = agrees(expected, got) && table_passed;
+                    }
+                }
+            }
+
+            report("kernels", std::format("{}_{}", table->name, name), table_passed);
+            passed = table_passed && passed;
+        }
+    }
+
+    return passed;
+}
+
+// Every rotation kernel table this cpu can run rotates and multiplies as the scalar table
+// does, over sizes that leave a tail after the widest register.
+bool check_rotation_kernels()
+{
+    constexpr auto sizes = std::array<std::size_t, 5>{ 1, 5, 9, 17, 67 };
+
+    // Unit quaternions and points under 20 in magnitude: absolute, to a few dozen ulp of 20.
+    const auto near = [](const std::span<const double> expected, const std::span<const double> got) {
+        return std::ranges::equal(expected, got, [](const double a, const double b) { return std::abs(a - b) <= 1e-12; });
+    };
+
+    auto passed = true;
+    for(const auto* table : available_rotation_kernels()) {
+        if (table == &scalar_rotation_kernel_table)
+            continue;
+
+        auto rotate_passed = true;
+        auto multiply_passed = true;
+        for(const auto size : sizes) {
+            auto q = std::array<std::vector<double>, 4>{};
+            auto r = std::array<std::vector<double>, 4>{};
+            auto p = std::array<std::vector<double>, 3>{};
+            for(auto i = 0uz; i < size; i++) {
+                const auto t = static_cast<double>(i);
+                const auto a = quaternion{ 1.0, 0.1 * t, 0.5 - 0.03 * t, -0.25 }.normalized();
+                const auto b = quaternion{ std::cos(t), std::sin(t), 0.3, -0.7 * std::cos(2.0 * t) }.normalized();
+                for(const auto& [columns, value] : { std::pair{ &q, a }, std::pair{ &r, b } })
+                    for(auto c = 0uz; const auto component : { value.w, value.x, value.y, value.z })
+                        (*columns)[c++].emplace_back(component);
+
+                p[0].emplace_back(t * 0.25 - 4.0);
+                p[1].emplace_back(1.0 + t * 0.1);
+                p[2].emplace_back(-2.0 * std::sin(t));
+            }
+
+            const auto rotations = const_quaternion_columns{ q[0], q[1], q[2], q[3] };
+            auto expected = p, got = p;
+            scalar_rotation_kernel_table.rotate(rotations, { expected[0], expected[1], expected[2] });
+            table->rotate(rotations, { got[0], got[1], got[2] });
+            for(auto c = 0uz; c < p.size(); c++)
+                rotate_passed = near(expected[c], got[c]) && rotate_passed;
+
+            auto expected_product = q, got_product = q;
+            const auto right = const_quaternion_columns{ r[0], r[1], r[2], r[3] };
+            scalar_rotation_kernel_table.multiply({ expected_product[0], expected_product[1], expected_product[2], expected_product[3] }, right);
+            table->multiply({ got_product[0], got_product[1], got_product[2], got_product[3] }, right);
+            for(auto c = 0uz; c < q.size(); c++)
+                multiply_passed = near(expected_product[c], got_product[c]) && multiply_passed;
+        }
+
+        report("rotation_kernels", std::format("{}_rotate", table->name), rotate_passed);
+        report("rotation_kernels", std::format("{}_multiply", table->name), multiply_passed);
+        passed = rotate_passed && multiply_passed && passed;
+    }
+
+    return passed;
+}
+
+// The lexer's block scans stop where a byte loop does: runs of every length up to 40 from
+// four starting offsets, so their ends fall before, on and after 16-byte block boundaries,
+// ended by every byte value, bytes >= 0x80 included, or by the end of the buffer.
+bool check_scan()
+{
+    struct scan
+    {
+        std::string_view name;
+        std::size_t(*find)(std::string_view s, std::size_t from);
+        bool(*in_run)(char c);
+        std::string_view run;  // bytes the scan passes over
+    };
+
+    const auto scans = std::array{
+        scan{ "skip_whitespace", skip_whitespace, is_whitespace, " \t\r\n" },
+        scan{ "skip_digits", skip_digits, is_number, "0123456789" },
+        scan{ "find_delimiter", find_delimiter, [](const char c) { return !is_delimiter(c); }, "ax_Z9.\x80\xc3\xa9\xff" },
+    };
+
+    auto passed = true;
+    for(const auto& [name, find, in_run, run] : scans) {
+        auto scan_passed = true;
+        for(auto offset = 0uz; offset < 4; offset++) {
+            for(auto length = 0uz; length <= 40; length++) {
+                for(auto end = 0; end <= 256; end++) {  // 256: the run reaches the end of the buffer
+                    auto source = std::string(offset, '#');
+                    for(auto i = 0uz; i < length; i++)
+                        source += run[i % run.size()];
+                    if (end < 256) {
+                        source += static_cast<char>(end);
+                        source.append(20, run.front());
+                    }
+
+                    auto expected = offset;
+                    while(expected < source.size() && in_run(source[expected]))
+                        expected++;
+
+                    scan_passed = find(source, offset) == expected && scan_passed;
+                }
+            }
+        }
+
+        report("scan", name, scan_passed);
+        passed = scan_passed && passed;
+    }
+
+    return passed;
+}
+
+// Every opcode compiled to native code agrees with vm::execute, with symbols bound to the
+// variables it is given; programs the backend can't take are refused rather than miscompiled,
+// and tiered_evaluator keeps interpreting them.
+bool check_jit()
+{
+#if defined(__x86_64__)
+    auto vm = mathc::vm{};
+    vm.define_function({ .name = "hypot", .func = user_hypot, .arity = 2 });
+    vm.define_function({ .name = "twice", .func = [](const std::span<number> args) {
+        return make_execution_result<number>(args[0] * number::from_int(2));
+    } });
+
+    const auto compile = [&](const std::string_view source, const bool shared) {
+        auto tree = ast{};
+        const auto root = arena_parser::parse(source, tree, vm.symbols, vm.functions).value();
+        if (!shared)
+            return compiler::compile(tree, root, vm.symbols, vm.functions).value();
+
+        const auto d = dag_builder::build(tree, root);
+        return compiler::compile(d.tree, d.root, vm.symbols, vm.functions).value();
+    };
+
+    const auto agrees = [&](const std::string_view name, const program& p) {
+        auto variables = std::vector<double>{};
+        for(const auto id : p.symbol_ids) {
+            variables.emplace_back(1.25 + 0.5 * static_cast<double>(variables.size()));
+            vm.insert_symbol(id, make_node<constant_node>(number::from_double(variables.back())));
+        }
+
+        const auto expected = vm.execute(p);
+        const auto native = jit_code::compile(p);
+        const auto passed = expected.has_value() && native.has_value() &&
+                            std::abs(native.value()(variables) - expected.value().promote_to_double()) <=
+                                1e-12 * std::abs(expected.value().promote_to_double());
+        report("jit", name, passed);
+        return passed;
+    };
+
+    const auto refused = [&](const std::string_view name, const program& p) {
+        const auto passed = !jit_code::compile(p).has_value();
+        report("jit", name, passed);
+        return passed;
+    };
+
+    auto deep = std::string{ "x" };
+    for(auto i = 0u; i <= x86_64_assembler::register_slots; i++)
+        deep = std::format("x + ({})", deep);
+
+    const auto temporaries = compile("sqrt(x * y + 1) * (x * y + 1) - (x * y + 1) / y", true);
+
+    auto tiered = tiered_program{ .bytecode = compile("x * y + sqrt(x) ^ 2", false) };
+    auto evaluator = tiered_evaluator{ .promote_after = 2 };
+    const auto variables = std::array{ 3.0, 0.5 };
+    const auto interpreted = evaluator.evaluate(tiered, variables);
+    const auto promoted = evaluator.evaluate(tiered, variables);
+    const auto tiered_passed = tiered.native.has_value() && interpreted.has_value() && promoted.has_value() &&
+                               std::abs(interpreted.value().promote_to_double() - promoted.value().promote_to_double()) <= 1e-12;
+    report("jit", "tiered", tiered_passed);
+
+    // Refused by the backend, so it stays on vm::execute past promote_after.
+    auto unsupported = tiered_program{ .bytecode = compile("twice(x) + hypot(x, y) + rotate_x(1, 0, 0, 0, x, y, 0)", false) };
+    const auto cold = evaluator.evaluate(unsupported, variables);
+    const auto warm = evaluator.evaluate(unsupported, variables);
+    const auto expected = 6.0 + std::sqrt(9.25) + 3.0;
+    const auto interpreted_passed = !unsupported.native.has_value() && unsupported.native_refused &&
+                                    cold.has_value() && warm.has_value() &&
+                                    std::abs(cold.value().promote_to_double() - expected) <= 1e-12 &&
+                                    std::abs(warm.value().promote_to_double() - expected) <= 1e-12;
+    report("jit", "tiered_refused", interpreted_passed);
+
+    auto passed = tiered_passed && interpreted_passed;
+    passed = agrees("arithmetic", compile("(x - y) / (x + y) * 3 - 2", false)) && passed;
+    passed = agrees("exp", compile("x ^ y + 2 ^ 0.5 - x ^ 2", false)) && passed;
+    passed = agrees("call_spills", compile("x + y * (x - sqrt(y) * ln(x + log2(y + 1)))", false)) && passed;
+    passed = temporaries.temporaries > 0 && agrees("temporaries", temporaries) && passed;
+    passed = refused("stack_depth", compile(deep, false)) && passed;
+    passed = refused("no_scalar_kernel", compile("twice(x) + 1", false)) && passed;
+    passed = refused("two_arguments", compile("hypot(x, y)", false)) && passed;
+    return passed;
+#else
+    report("jit", "unsupported_architecture", true);
+    return true;
+#endif
+}
+
+}
+
+int main(int argc, const char* argv[])
+{
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+    const auto arguments = std::span{ argv, static_cast<std::size_t>(argc) };
+    #pragma GCC diagnostic pop
+
+    if (arguments.size() > 1 && std::string_view{ arguments[1] } == "--check-runtime") {
+        const auto jit = check_jit();
+        const auto images = check_image();
+        const auto parallel = check_parallel();
+        const auto kernel_tables = check_kernels();
+        const auto rotation_tables = check_rotation_kernels();
+        const auto scans = check_scan();
+        const auto served = check_server();
+        return jit && images && parallel && kernel_tables && rotation_tables && scans && served ? 0 : 1;
+    }
+
+    const auto check = arguments.size() > 1 && std::string_view{ arguments[1] } == "--check-allocations";
+    const auto filter_at = check ? 2uz : 1uz;
+    const auto filter = arguments.size() > filter_at ? std::string_view{ arguments[filter_at] } : std::string_view{};
+
+    if (check) {
+        auto clean = true;
+        for(const auto& w : workloads)
+            if (w.name.contains(filter))
+                for(const auto size : sizes)
+                    clean = check_allocations(w.name, size, w.generate(size)) && clean;
+
+        return clean ? 0 : 1;
+    }
+
+    for(const auto& w : workloads) {
+        if (!w.name.contains(filter))
+            continue;
+
+        for(const auto size : sizes) {
+            const auto source = w.generate(size);
+            const auto tokens = lexer::lex(source);
+            const auto root = parser::parse(tokens);
+            if (!root.has_value()) {
+                std::println(stderr, "{} {}: {}", w.name, size, root.error().error);
+                return 1;
+            }
+
+            measure(w.name, size, "lex", source.size(), [&] {
+                sink.fetch_add(lexer::lex(source).size(), std::memory_order_relaxed);
+            });
+            measure(w.name, size, "parse", source.size(), [&] {
+                sink.fetch_add(parser::parse(tokens).has_value(), std::memory_order_relaxed);
+            });
+            measure(w.name, size, "parse_streaming", source.size(), [&] {
+                sink.fetch_add(parser::parse(source).has_value(), std::memory_order_relaxed);
+            });
+            measure(w.name, size, "simplify", source.size(), [&] {
+                auto vm = mathc::vm{};
+                sink.fetch_add(interpreter::simplify(root.value(), vm).has_value(), std::memory_order_relaxed);
+            });
+            // copy_node is shallow: the root is made anew and shares its operands.
+            measure(w.name, size, "share_node", source.size(), [&] {
+                sink.fetch_add(copy_node(root.value()).index(), std::memory_order_relaxed);
+            });
+            // Bound, so the stages that evaluate time evaluation rather than the unbound-symbol error.
+            const auto compiled = compiler::compile(root.value());
+            const auto bound_vm = [&] {
+                auto vm = mathc::vm{};
+                if (compiled.has_value())
+                    for(const auto& symbol : compiled.value().symbols)
+                        vm.insert_symbol(symbol, make_node<constant_node>(number::from_int(1)));
+                return vm;
+            };
+            if (compiled.has_value()) {
+                auto vm = bound_vm();
+                const auto typed = type_inference::specialize(compiled.value(), vm);
+                measure(w.name, size, "execute", source.size(), [&] {
+                    sink.fetch_add(vm.execute(compiled.value()).has_value(), std::memory_order_relaxed);
+                });
+                measure(w.name, size, "execute_typed", source.size(), [&, evaluator = typed_evaluator{}] mutable {
+                    sink.fetch_add(evaluator.execute(typed, vm).has_value(), std::memory_order_relaxed);
+                });
+                // Promoted during warm-up, so native code is what's timed when the backend takes it.
+                measure(w.name, size, "execute_jit", source.size(),
+                        [&, evaluator = tiered_evaluator{ .promote_after = 1 },
+                         tiered = tiered_program{ .bytecode = compiled.value() },
+                         variables = std::vector<double>(compiled.value().symbols.size(), 1.0)] mutable {
+                    sink.fetch_add(evaluator.evaluate(tiered, variables).has_value(), std::memory_order_relaxed);
+                });
+            }
+            measure(w.name, size, "workspace", source.size(), [&, space = workspace{}, vm = bound_vm()] mutable {
+                sink.fetch_add(space.evaluate(source, vm).has_value(), std::memory_order_relaxed);
+            });
+            measure(w.name, size, "end_to_end", source.size(), [&] {
+                auto vm = mathc::vm{};
+                const auto parsed = parser::parse(source);
+                sink.fetch_add(parsed.has_value() && interpreter::run(parsed.value(), vm).has_value(), std::memory_order_relaxed);
+            });
+        }
+    }
+
+    return 0;
+}
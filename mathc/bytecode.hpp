@@ -0,0 +1,504 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <expected>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <ast.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <node.hpp>
+#include <number.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+using namespace std::string_view_literals;
+
+enum class opcode : std::uint8_t
+{
+    push_constant,  // operand: index into program::constants
+    load_symbol,    // operand: index into program::symbols (and program::symbol_ids)
+    add,
+    sub,
+    mul,
+    div,
+    exp,
+    call,           // operand: index into program::functions, argument_count: arguments on the stack
+    store_temp,     // operand: temporary slot; copies the top of the stack, which stays in place
+    load_temp,      // operand: temporary slot
+};
+
+constexpr std::string_view opcode_str(const opcode o)
+{
+    switch(o) {
+        case opcode::push_constant: return "push_constant"sv;
+        case opcode::load_symbol:   return "load_symbol"sv;
+        case opcode::add:           return "add"sv;
+        case opcode::sub:           return "sub"sv;
+        case opcode::mul:           return "mul"sv;
+        case opcode::div:           return "div"sv;
+        case opcode::exp:           return "exp"sv;
+        case opcode::call:          return "call"sv;
+        case opcode::store_temp:    return "store_temp"sv;
+        case opcode::load_temp:     return "load_temp"sv;
+    }
+
+    std::unreachable();
+}
+
+constexpr static inline opcode opcode_from_operation(const operation_type type)
+{
+    switch(type) {
+        case operation_type::mul: return opcode::mul;
+        case operation_type::div: return opcode::div;
+        case operation_type::add: return opcode::add;
+        case operation_type::sub: return opcode::sub;
+        case operation_type::exp: return opcode::exp;
+    }
+
+    std::unreachable();
+}
+
+struct instruction
+{
+    opcode code;
+    std::uint16_t argument_count{ 0 };
+    std::uint32_t operand{ 0 };
+};
+
+struct program
+{
+    std::vector<instruction> instructions{};
+    std::vector<number> constants{};
+    std::vector<std::string> symbols{};
+    std::vector<symbol_id> symbol_ids{};  // parallel to symbols when compiled against a symbol_table
+    std::vector<function> functions{};    // every function called, resolved once at compile time
+    std::size_t max_stack_depth{ 0 };
+    std::size_t temporaries{ 0 };         // slots for subexpressions shared in a dag
+
+    // Keeps every vector's capacity for the next compile into this program.
+    constexpr void clear()
+    {
+        instructions.clear();
+        constants.clear();
+        symbols.clear();
+        symbol_ids.clear();
+        functions.clear();
+        max_stack_depth = 0;
+        temporaries = 0;
+    }
+};
+
+// A program whose storage lives elsewhere, such as a mapped image: vm::execute runs it as
+// it runs a program.
+struct program_view
+{
+    std::span<const instruction> instructions{};
+    std::span<const number> constants{};
+    std::span<const std::string_view> symbols{};
+    std::span<const symbol_id> symbol_ids{};
+    std::span<const function> functions{};
+    std::size_t max_stack_depth{ 0 };
+    std::size_t temporaries{ 0 };
+};
+
+struct compile_error
+{
+    std::string error;
+};
+
+using compile_result = std::expected<program, compile_error>;
+using emit_result = std::expected<void, compile_error>;
+
+// A node on the compiler's work stack, how many of its children are emitted and, for a
+// call, its program::functions slot.
+template<typename Index>
+struct emit_task
+{
+    Index at;
+    std::uint32_t stage{ 0 };
+    std::uint32_t slot{ 0 };
+};
+
+// The compiler's working storage, which a caller compiling repeatedly can keep.
+struct compile_scratch
+{
+    std::vector<std::uint32_t> slot_of_symbol{};
+    std::vector<std::uint32_t> slot_of_function{};
+    std::vector<std::uint32_t> uses{};          // ast compiles: parents referencing each node
+    std::vector<std::uint32_t> temporary_of{};  // ast compiles: slot holding a shared node's value
+    std::vector<node_index> pending{};
+    std::vector<emit_task<const node*>> tasks{};
+    std::vector<emit_task<node_index>> flat_tasks{};
+};
+
+struct [[nodiscard]] compiler
+{
+    program output{};
+    std::size_t stack_depth{ 0 };
+    symbol_table* symbols{ nullptr };
+    const function_table* functions{ nullptr };
+    compile_scratch scratch{};
+
+    constexpr static std::uint32_t null_slot = std::numeric_limits<std::uint32_t>::max();
+
+    constexpr static compile_result compile(const node& root_node);
+    constexpr static compile_result compile(const ast& tree, node_index root);
+
+    // Resolves every symbol to an id in the table once, so execution never looks names up.
+    constexpr static compile_result compile(const node& root_node, symbol_table& symbols);
+    constexpr static compile_result compile(const ast& tree, node_index root, symbol_table& symbols);
+
+    // As above, with calls resolved against functions rather than the builtins alone.
+    constexpr static compile_result compile(const node& root_node, symbol_table& symbols, const function_table& functions);
+    constexpr static compile_result compile(const ast& tree, node_index root, symbol_table& symbols,
+                                            const function_table& functions);
+
+    // As above, into a program and scratch kept by the caller: once both have grown to fit,
+    // compiling allocates nothing (symbol names longer than std::string's inline buffer aside).
+    constexpr static emit_result compile(const ast& tree, node_index root, symbol_table& symbols,
+                                         const function_table& functions, program& into, compile_scratch& scratch);
+
+    constexpr emit_result emit(const node& root_node);
+    constexpr emit_result emit(const ast& tree, node_index root);
+    constexpr std::expected<std::uint32_t, compile_error> function_slot(const std::string_view function_name, function_id id,
+                                                                        std::size_t argument_count);
+    constexpr void emit_instruction(instruction i, std::size_t pops, std::size_t pushes);
+    constexpr std::uint32_t constant_index(const number& n);
+    constexpr std::uint32_t symbol_index(const std::string_view symbol, symbol_id id);
+
+private:
+    compiler() = default;
+
+    constexpr void count_uses(const ast& tree, node_index root);
+};
+
+// Implementation
+
+constexpr inline compile_result compiler::compile(const node& root_node)
+{
+    compiler c;
+    if (const auto result = c.emit(root_node); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline compile_result compiler::compile(const ast& tree, const node_index root)
+{
+    compiler c;
+    c.count_uses(tree, root);
+    if (const auto result = c.emit(tree, root); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline compile_result compiler::compile(const node& root_node, symbol_table& symbols)
+{
+    compiler c;
+    c.symbols = &symbols;
+    if (const auto result = c.emit(root_node); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline compile_result compiler::compile(const ast& tree, const node_index root, symbol_table& symbols)
+{
+    compiler c;
+    c.symbols = &symbols;
+    c.count_uses(tree, root);
+    if (const auto result = c.emit(tree, root); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline compile_result compiler::compile(const node& root_node, symbol_table& symbols,
+                                                  const function_table& functions)
+{
+    compiler c;
+    c.symbols = &symbols;
+    c.functions = &functions;
+    if (const auto result = c.emit(root_node); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline compile_result compiler::compile(const ast& tree, const node_index root, symbol_table& symbols,
+                                                  const function_table& functions)
+{
+    compiler c;
+    c.symbols = &symbols;
+    c.functions = &functions;
+    c.count_uses(tree, root);
+    if (const auto result = c.emit(tree, root); !result.has_value()) [[unlikely]]
+        return compile_result{ std::unexpect_t{}, result.error() };
+
+    return std::move(c.output);
+}
+
+constexpr inline emit_result compiler::compile(const ast& tree, const node_index root, symbol_table& symbols,
+                                               const function_table& functions, program& into, compile_scratch& scratch)
+{
+    compiler c;
+    c.symbols = &symbols;
+    c.functions = &functions;
+    c.output = std::move(into);
+    c.output.clear();
+    c.scratch = std::move(scratch);
+    std::ranges::fill(c.scratch.slot_of_symbol, null_slot);
+    std::ranges::fill(c.scratch.slot_of_function, null_slot);
+
+    c.count_uses(tree, root);
+    const auto result = c.emit(tree, root);
+
+    into = std::move(c.output);
+    scratch = std::move(c.scratch);
+    return result;
+}
+
+constexpr inline void compiler::emit_instruction(const instruction i, const std::size_t pops, const std::size_t pushes)
+{
+    output.instructions.emplace_back(i);
+    stack_depth = stack_depth - pops + pushes;
+    output.max_stack_depth = std::max(output.max_stack_depth, stack_depth);
+}
+
+constexpr inline std::uint32_t compiler::constant_index(const number& n)
+{
+    output.constants.emplace_back(n);
+    return static_cast<std::uint32_t>(output.constants.size() - 1);
+}
+
+constexpr inline std::uint32_t compiler::symbol_index(const std::string_view symbol, const symbol_id id)
+{
+    if (symbols) {
+        const auto resolved = id != null_symbol ? id : symbols->intern(symbol);
+        if (resolved >= scratch.slot_of_symbol.size())
+            scratch.slot_of_symbol.resize(resolved + 1, null_slot);
+
+        if (scratch.slot_of_symbol[resolved] == null_slot) {
+            scratch.slot_of_symbol[resolved] = static_cast<std::uint32_t>(output.symbols.size());
+            output.symbols.emplace_back(symbol);
+            output.symbol_ids.emplace_back(resolved);
+        }
+
+        return scratch.slot_of_symbol[resolved];
+    }
+
+    for(auto i = 0u; i < output.symbols.size(); i++)
+        if (output.symbols[i] == symbol)
+            return i;
+
+    output.symbols.emplace_back(symbol);
+    return static_cast<std::uint32_t>(output.symbols.size() - 1);
+}
+
+// Iterative, so a deep tree can't overflow the stack: a node is revisited once per child
+// emitted and emits its own instruction after the last.
+constexpr inline emit_result compiler::emit(const node& root_node)
+{
+    auto& tasks = scratch.tasks;
+    tasks.clear();
+    tasks.emplace_back(&root_node);
+
+    while(!tasks.empty()) {
+        const auto current = tasks.back().at;
+        const auto stage = tasks.back().stage++;
+
+        if (const auto* op = std::get_if<op_node>(current); op) {
+            if (stage < 2) {
+                tasks.emplace_back(stage == 0 ? op->left.get() : op->right.get());
+                continue;
+            }
+
+            tasks.pop_back();
+            emit_instruction({ opcode_from_operation(op->type) }, 2, 1);
+            continue;
+        }
+
+        if (const auto* constant = std::get_if<constant_node>(current); constant) {
+            tasks.pop_back();
+            emit_instruction({ opcode::push_constant, 0, constant_index(constant->value) }, 0, 1);
+            continue;
+        }
+
+        if (const auto* symbol = std::get_if<symbol_node>(current); symbol) {
+            tasks.pop_back();
+            emit_instruction({ opcode::load_symbol, 0, symbol_index(symbol->value, symbol->id) }, 0, 1);
+            continue;
+        }
+
+        const auto& function_call = std::get<function_call_node>(*current);
+        const auto argument_count = function_call.arguments.size();
+        if (stage == 0) {
+            const auto resolved = function_slot(function_call.function_name, function_call.id, argument_count);
+            if (!resolved.has_value())
+                return emit_result{ std::unexpect_t{}, resolved.error() };
+
+            tasks.back().slot = resolved.value();
+        }
+
+        if (stage < argument_count) {
+            tasks.emplace_back(&function_call.arguments[stage]);
+            continue;
+        }
+
+        const auto called = tasks.back().slot;
+        tasks.pop_back();
+        emit_instruction({ opcode::call, static_cast<std::uint16_t>(argument_count), called }, argument_count, 1);
+    }
+
+    return {};
+}
+
+// A node with several parents (see dag.hpp) is computed the first time it is reached and
+// kept in a temporary; every later reference loads it. Constants are cheaper to push again.
+constexpr inline emit_result compiler::emit(const ast& tree, const node_index root)
+{
+    const auto shared = [&](const node_index index) {
+        return !scratch.uses.empty() && scratch.uses[index] >= 2 && tree[index].type != flat_node_type::constant;
+    };
+
+    auto& tasks = scratch.flat_tasks;
+    tasks.clear();
+    tasks.emplace_back(root);
+
+    // Pops the finished node, keeping its value when it is shared.
+    const auto finish = [&](const node_index index) {
+        tasks.pop_back();
+        if (!shared(index))
+            return;
+
+        scratch.temporary_of[index] = static_cast<std::uint32_t>(output.temporaries++);
+        emit_instruction({ opcode::store_temp, 0, scratch.temporary_of[index] }, 0, 0);
+    };
+
+    while(!tasks.empty()) {
+        const auto index = tasks.back().at;
+        const auto stage = tasks.back().stage++;
+
+        if (stage == 0 && shared(index) && scratch.temporary_of[index] != null_slot) {
+            tasks.pop_back();
+            emit_instruction({ opcode::load_temp, 0, scratch.temporary_of[index] }, 0, 1);
+            continue;
+        }
+
+        const auto& n = tree[index];
+        switch(n.type) {
+            case flat_node_type::op:
+                if (stage < 2) {
+                    tasks.emplace_back(stage == 0 ? tree.left(n) : tree.right(n));
+                    break;
+                }
+
+                emit_instruction({ opcode_from_operation(n.operation) }, 2, 1);
+                finish(index);
+                break;
+            case flat_node_type::constant:
+                emit_instruction({ opcode::push_constant, 0, constant_index(tree.value(n)) }, 0, 1);
+                finish(index);
+                break;
+            case flat_node_type::symbol:
+                emit_instruction({ opcode::load_symbol, 0, symbol_index(tree.name(n), n.symbol) }, 0, 1);
+                finish(index);
+                break;
+            case flat_node_type::function_call: {
+                if (stage == 0) {
+                    const auto resolved = function_slot(tree.name(n), n.function, n.argument_count);
+                    if (!resolved.has_value())
+                        return emit_result{ std::unexpect_t{}, resolved.error() };
+
+                    tasks.back().slot = resolved.value();
+                }
+
+                if (stage < n.argument_count) {
+                    tasks.emplace_back(tree.arguments_of(n)[stage]);
+                    break;
+                }
+
+                emit_instruction({ opcode::call, static_cast<std::uint16_t>(n.argument_count), tasks.back().slot }, n.argument_count, 1);
+                finish(index);
+                break;
+            }
+        }
+    }
+
+    return {};
+}
+
+constexpr inline void compiler::count_uses(const ast& tree, const node_index root)
+{
+    scratch.uses.assign(tree.size(), 0);
+    scratch.temporary_of.assign(tree.size(), null_slot);
+
+    auto& pending = scratch.pending;
+    pending.assign(1, root);
+    while(!pending.empty()) {
+        const auto index = pending.back();
+        pending.pop_back();
+        if (scratch.uses[index]++ > 0)
+            continue;
+
+        const auto& n = tree[index];
+        switch(n.type) {
+            case flat_node_type::op:
+                pending.emplace_back(tree.right(n));
+                pending.emplace_back(tree.left(n));
+                break;
+            case flat_node_type::function_call:
+                for(const auto argument : tree.arguments_of(n))
+                    pending.emplace_back(argument);
+                break;
+            case flat_node_type::constant:
+            case flat_node_type::symbol:
+                break;
+        }
+    }
+}
+
+// Calls parsed against a function_table carry their id; anything else is resolved by name
+// here, once per compile. Each function called gets one program::functions slot.
+constexpr inline std::expected<std::uint32_t, compile_error> compiler::function_slot(const std::string_view function_name,
+                                                                                    function_id id,
+                                                                                    const std::size_t argument_count)
+{
+    using slot_result = std::expected<std::uint32_t, compile_error>;
+
+    if (id == null_function)
+        id = resolve_function(functions, function_name);
+
+    const auto* function = id == null_function ? nullptr :
+                           functions ? (id < functions->size() ? &(*functions)[id] : nullptr) :
+                                       builtin_function(id);
+    if (!function)
+        return slot_result{ std::unexpect_t{}, std::format("Function {} not found.", function_name) };
+
+    if (argument_count != function->arity)
+        return slot_result{ std::unexpect_t{},
+                            std::format("{} expects {} arguments, got {}", function->name, function->arity, argument_count) };
+
+    if (id >= scratch.slot_of_function.size())
+        scratch.slot_of_function.resize(id + 1, null_slot);
+
+    if (scratch.slot_of_function[id] == null_slot) {
+        scratch.slot_of_function[id] = static_cast<std::uint32_t>(output.functions.size());
+        output.functions.emplace_back(*function);
+    }
+
+    return scratch.slot_of_function[id];
+}
+
+}
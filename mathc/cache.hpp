@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <ast.hpp>
+#include <bytecode.hpp>
+#include <lexer.hpp>
+#include <parser.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// Parsed and compiled expressions by source text, shared between threads. Entries are
+// immutable once cached; a hit hands out another reference to the same entry and costs one
+// hash of the normalized source. At capacity, the least recently used entry is evicted.
+//
+// Entries are parsed and compiled without a symbol_table or function_table, so they can be
+// executed on any vm (symbols are looked up by name) and only call builtins. simplify()
+// appends to its ast: simplify a copy of cached_expression::tree, not the entry itself.
+struct cached_expression
+{
+    ast tree{};
+    node_index root{ null_index };
+    program compiled{};
+};
+
+// A parse_error, or a compile failure (token is null) with its formatted message.
+struct cache_error
+{
+    token token;
+    std::string error;
+};
+
+using cache_entry = std::shared_ptr<const cached_expression>;
+using cache_result = std::expected<cache_entry, cache_error>;
+
+struct cache_stats
+{
+    std::size_t hits{ 0 };
+    std::size_t misses{ 0 };
+    std::size_t evictions{ 0 };
+    std::size_t size{ 0 };
+};
+
+struct expression_cache
+{
+    explicit expression_cache(const std::size_t c) : capacity(c) {}
+
+    // Parses and compiles on a miss, outside the lock; failures are not cached and their
+    // token points into source.
+    cache_result get(std::string_view source);
+    cache_stats stats() const;
+
+    // Whitespace only separates tokens between two characters of a symbol or number, so it is
+    // dropped everywhere else and collapsed to one space there: "2 * x" and "2*x" share an
+    // entry, "x y" and "xy" don't.
+    constexpr static std::string normalize(std::string_view source);
+
+private:
+    struct key_hash
+    {
+        using is_transparent = void;
+        std::size_t operator()(const std::string_view key) const { return static_cast<std::size_t>(hash_symbol(key)); }
+    };
+
+    using recency_list = std::list<std::pair<std::string, cache_entry>>;  // most recently used first
+
+    std::size_t capacity;
+    mutable std::mutex mutex{};
+    recency_list recency{};
+    std::unordered_map<std::string, recency_list::iterator, key_hash, std::equal_to<>> index{};
+    cache_stats counters{};
+};
+
+// Implementation
+
+constexpr inline std::string expression_cache::normalize(const std::string_view source)
+{
+    constexpr static auto is_word = [](const char c) {
+        return !is_whitespace(c) && !is_operation(c) && !is_paren(c) && !is_comma(c);
+    };
+
+    auto normalized = std::string{};
+    normalized.reserve(source.size());
+
+    auto pending_space = false;
+    for(const auto c : source) {
+        if (is_whitespace(c)) {
+            pending_space = !normalized.empty();
+            continue;
+        }
+
+        if (pending_space && is_word(c) && is_word(normalized.back()))
+            normalized += ' ';
+
+        pending_space = false;
+        normalized += c;
+    }
+
+    return normalized;
+}
+
+inline cache_result expression_cache::get(const std::string_view source)
+{
+    auto key = normalize(source);
+
+    {
+        const auto lock = std::scoped_lock{ mutex };
+        if (const auto found = index.find(std::string_view{ key }); found != index.end()) {
+            recency.splice(recency.begin(), recency, found->second);
+            counters.hits++;
+            return found->second->second;
+        }
+
+        counters.misses++;
+    }
+
+    auto entry = std::make_shared<cached_expression>();
+    const auto root = arena_parser::parse(source, entry->tree);
+    if (!root.has_value())
+        return cache_result{ std::unexpect_t{}, root.error().token, std::string{ root.error().error } };
+
+    auto compiled = compiler::compile(entry->tree, root.value());
+    if (!compiled.has_value())
+        return cache_result{ std::unexpect_t{}, token{}, std::move(compiled.error().error) };
+
+    entry->root = root.value();
+    entry->compiled = std::move(compiled.value());
+
+    const auto lock = std::scoped_lock{ mutex };
+
+    // Another thread may have cached the same source meanwhile: keep the first entry.
+    if (const auto found = index.find(std::string_view{ key }); found != index.end())
+        return found->second->second;
+
+    if (capacity == 0)
+        return entry;
+
+    if (recency.size() == capacity) {
+        index.erase(recency.back().first);
+        recency.pop_back();
+        counters.evictions++;
+    }
+
+    recency.emplace_front(key, entry);
+    index.emplace(std::move(key), recency.begin());
+    return entry;
+}
+
+inline cache_stats expression_cache::stats() const
+{
+    const auto lock = std::scoped_lock{ mutex };
+    auto s = counters;
+    s.size = recency.size();
+    return s;
+}
+
+}
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <expected>
 #include <string>
 
+#include <ast.hpp>
 #include <node.hpp>
 #include <number.hpp>
 #include <token.hpp>
@@ -27,7 +29,16 @@ struct execution_error
 };
 
 using simplify_result = std::variant<number, node>;
+
+// On interpreter::simplify's value stack: a finished subtree's number, its residual, or the
+// subtree itself when nothing in it changed, for the result to share instead of rebuild.
+using simplify_value = std::variant<number, node, const node*>;
 using execution_result = std::expected<simplify_result, execution_error>;
+using evaluation_result = std::expected<number, execution_error>;
+using batch_result = std::expected<void, execution_error>;  // errors of evaluations over whole columns
+
+using flat_simplify_result = std::variant<number, node_index>;
+using flat_execution_result = std::expected<flat_simplify_result, execution_error>;
 
 template<typename T, typename... Args>
     requires(node_type<T>)
@@ -55,10 +66,21 @@ constexpr static execution_result make_execution_error(Args&&... args)
                              std::forward<Args>(args)... };
 }
 
+template<typename... Args>
+constexpr static evaluation_result make_evaluation_error(Args&&... args)
+{
+    return evaluation_result{ std::unexpect_t{},
+                              std::forward<Args>(args)... };
+}
+
 struct function
 {
     std::string_view name;
-    execution_result(&func)(const std::span<number> numbers);
+    execution_result(*func)(const std::span<number> numbers);  // given exactly arity arguments
+    std::uint16_t arity{ 1 };
+    void(*batch)(std::span<double> block){ nullptr };  // single-argument column kernel, in place
+    double(*scalar)(double value){ nullptr };           // single-argument double kernel, called from native code
+    double(*derivative)(double value){ nullptr };       // single-argument: d/dx at value, for gradients
 };
 
 
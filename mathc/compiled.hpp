@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <ast.hpp>
+#include <functions.hpp>
+#include <math.hpp>
+#include <parser.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// mathc::compile<"x^2 + 1"> lexes, parses and lowers its source while the program using it
+// is compiled. The result is a callable taking one double per free symbol, in the order the
+// symbols first appear in the source, and returning double. Every node is its own template
+// instantiation, so after inlining the body is the expression as if written by hand: no
+// tree, no stack and no function lookup remain at runtime. Constant non-negative integer
+// exponents are expanded into multiplications; anything that doesn't parse, calls an
+// unknown function or calls one without a scalar kernel is a compile error.
+
+template<std::size_t N>
+struct fixed_string
+{
+    // Implicit, so compile<"..."> takes a string literal.
+    consteval fixed_string(const char (&s)[N]) { std::ranges::copy(s, value.begin()); }
+
+    constexpr std::string_view view() const { return std::string_view{ value.data(), N - 1 }; }
+
+    std::array<char, N> value{};
+};
+
+namespace detail
+{
+
+constexpr static double max_expanded_exponent = 16.0;
+
+struct static_node
+{
+    flat_node_type type{ flat_node_type::constant };
+    operation_type operation{ operation_type::add };
+    node_index first{ 0 };      // op: left child, symbol: argument position, function_call: offset into static_ast::arguments
+    node_index second{ 0 };     // op: right child
+    function_id function{ 0 };  // function_call: index into builtin_functions
+    double value{ 0.0 };        // constant
+    bool integral{ false };     // constant: parsed as an integer
+};
+
+template<std::size_t Nodes, std::size_t Arguments>
+struct static_ast
+{
+    std::array<static_node, Nodes> nodes{};
+    std::array<node_index, Arguments> arguments{};
+    node_index root{ 0 };
+    std::size_t arity{ 0 };
+};
+
+// What lowering needs to size static_ast, or why it can't. Usable as a static_assert
+// message.
+struct static_shape
+{
+    std::size_t nodes{ 0 };
+    std::size_t arguments{ 0 };
+    std::array<char, 128> error{};
+    std::size_t error_length{ 0 };
+
+    constexpr bool ok() const { return error_length == 0; }
+    constexpr const char* data() const { return error.data(); }
+    constexpr std::size_t size() const { return error_length; }
+};
+
+struct parsed_source
+{
+    ast tree{};
+    symbol_table symbols{};
+    basic_parse_result<node_index> root;
+};
+
+constexpr static inline parsed_source parse_source(const std::string_view source)
+{
+    auto parsed = parsed_source{ .root = node_index{ 0 } };
+    parsed.root = arena_parser::parse(source, parsed.tree, parsed.symbols);
+    return parsed;
+}
+
+constexpr static inline static_shape measure(const std::string_view source)
+{
+    const auto fail = [](const std::string& message) {
+        auto shape = static_shape{};
+        shape.error_length = std::min(message.size(), shape.error.size());
+        std::copy_n(message.begin(), shape.error_length, shape.error.begin());
+        return shape;
+    };
+
+    const auto parsed = parse_source(source);
+    if (!parsed.root.has_value())
+        return fail(std::string{ parsed.root.error().error } + " Near '" + std::string{ parsed.root.error().token.value } + "'.");
+
+    for(const auto& n : parsed.tree.nodes) {
+        if (n.type != flat_node_type::function_call)
+            continue;
+
+        const auto name = std::string{ parsed.tree.name(n) };
+        const auto* function = builtin_function(n.function);
+        if (!function)
+            return fail("Function " + name + " not found.");
+        if (n.argument_count != function->arity)
+            return fail("Function " + name + " called with the wrong number of arguments.");
+        if (n.argument_count != 1 || !function->scalar)
+            return fail("Function " + name + " has no single-argument scalar kernel.");
+    }
+
+    return static_shape{ .nodes = parsed.tree.size(), .arguments = parsed.tree.arguments.size() };
+}
+
+template<std::size_t Nodes, std::size_t Arguments>
+constexpr static inline static_ast<Nodes, Arguments> lower(const std::string_view source)
+{
+    auto lowered = static_ast<Nodes, Arguments>{};
+
+    const auto parsed = parse_source(source);
+    if (!parsed.root.has_value())
+        return lowered;
+
+    for(auto i = 0u; i < Nodes; i++) {
+        const auto& n = parsed.tree[i];
+        auto& out = lowered.nodes[i];
+        out.type = n.type;
+
+        switch(n.type) {
+            case flat_node_type::constant:
+                out.value = parsed.tree.value(n).promote_to_double();
+                out.integral = parsed.tree.value(n).is_int();
+                break;
+            case flat_node_type::symbol:
+                out.first = n.symbol;
+                break;
+            case flat_node_type::op:
+                out.operation = n.operation;
+                out.first = n.first;
+                out.second = n.second;
+                break;
+            case flat_node_type::function_call:
+                out.first = n.arguments;
+                out.function = n.function;
+                break;
+        }
+    }
+
+    std::ranges::copy(parsed.tree.arguments, lowered.arguments.begin());
+    lowered.root = parsed.root.value();
+    lowered.arity = parsed.symbols.size();
+    return lowered;
+}
+
+template<std::int64_t Exponent>
+constexpr static inline double power(const double base)
+{
+    if constexpr (Exponent == 0)
+        return 1.0;
+    else if constexpr (Exponent == 1)
+        return base;
+    else {
+        const auto half = power<Exponent / 2>(base);
+        if constexpr (Exponent % 2 == 0)
+            return half * half;
+        else
+            return half * half * base;
+    }
+}
+
+}
+
+template<fixed_string Source>
+struct compiled_expression
+{
+    constexpr static auto shape = detail::measure(Source.view());
+    static_assert(shape.ok(), shape);
+
+    constexpr static auto tree = detail::lower<shape.nodes, shape.arguments>(Source.view());
+    constexpr static auto arity = tree.arity;
+
+    template<typename... Args>
+        requires(sizeof...(Args) == arity && (std::convertible_to<Args, double> && ...))
+    constexpr double operator()(const Args... args) const
+    {
+        const auto values = std::array<double, arity>{ static_cast<double>(args)... };
+        return evaluate<tree.root>(values);
+    }
+
+private:
+    template<node_index I>
+    constexpr static double evaluate(const std::array<double, arity>& values);
+};
+
+template<fixed_string Source>
+constexpr inline compiled_expression<Source> compile{};
+
+// Implementation
+
+template<fixed_string Source>
+template<node_index I>
+constexpr inline double compiled_expression<Source>::evaluate(const std::array<double, arity>& values)
+{
+    constexpr auto n = tree.nodes[I];
+
+    if constexpr (n.type == flat_node_type::constant) {
+        return n.value;
+    } else if constexpr (n.type == flat_node_type::symbol) {
+        return values[n.first];
+    } else if constexpr (n.type == flat_node_type::function_call) {
+        constexpr auto scalar = builtin_function(n.function)->scalar;
+        return scalar(evaluate<tree.arguments[n.first]>(values));
+    } else {
+        constexpr auto exponent = tree.nodes[n.second];
+        const auto left = evaluate<n.first>(values);
+
+        if constexpr (n.operation == operation_type::exp &&
+                      exponent.type == flat_node_type::constant && exponent.integral &&
+                      exponent.value >= 0.0 && exponent.value <= detail::max_expanded_exponent) {
+            return detail::power<static_cast<std::int64_t>(exponent.value)>(left);
+        } else {
+            const auto right = evaluate<n.second>(values);
+
+            if constexpr (n.operation == operation_type::add)
+                return left + right;
+            else if constexpr (n.operation == operation_type::sub)
+                return left - right;
+            else if constexpr (n.operation == operation_type::mul)
+                return left * right;
+            else if constexpr (n.operation == operation_type::div)
+                return left / right;
+            else {
+                if !consteval {
+                    return std::pow(left, right);
+                }
+
+                return math::detail::pow(left, right);
+            }
+        }
+    }
+}
+
+}
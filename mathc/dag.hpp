@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <ast.hpp>
+#include <node.hpp>
+#include <number.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// Hash-consed form of an expression: structurally identical subtrees are a single node in
+// dag::tree, referenced by index from every parent. compiler::compile(ast, ...) and
+// interpreter::simplify(ast, ...) evaluate each shared node once.
+struct dag
+{
+    ast tree{};
+    node_index root{ null_index };
+    std::size_t deduplicated{ 0 };  // nodes in the input that were merged into an existing node
+};
+
+struct [[nodiscard]] dag_builder
+{
+    ast& tree;
+    std::vector<std::uint64_t> hashes{};  // parallel to tree.nodes
+    std::vector<node_index> slots{};
+    std::size_t deduplicated{ 0 };
+
+    constexpr static dag build(const node& root_node);
+    constexpr static dag build(const ast& from, node_index root);
+
+    constexpr node_index intern(const node& n);
+    constexpr node_index intern(const ast& from, node_index index);
+
+    constexpr node_index intern_constant(const number& value);
+    constexpr node_index intern_symbol(std::string_view symbol, symbol_id id);
+    constexpr node_index intern_op(node_index left, node_index right, operation_type type);
+    constexpr node_index intern_function_call(std::string_view function_name, function_id id, std::span<const node_index> arguments);
+
+private:
+    constexpr explicit dag_builder(ast& t) : tree(t) {}
+
+    constexpr std::optional<node_index> find(std::uint64_t hash, const auto& equals);
+    constexpr node_index insert(std::uint64_t hash, node_index index);
+    constexpr void place(node_index index);
+    constexpr void grow();
+
+    constexpr static std::uint64_t mix(std::uint64_t hash, std::uint64_t value)
+    {
+        // FNV-1a over 64-bit words
+        return (hash ^ value) * 1099511628211ull;
+    }
+};
+
+// Implementation
+
+constexpr inline dag dag_builder::build(const node& root_node)
+{
+    auto result = dag{};
+    auto builder = dag_builder{ result.tree };
+    result.root = builder.intern(root_node);
+    result.deduplicated = builder.deduplicated;
+    return result;
+}
+
+constexpr inline dag dag_builder::build(const ast& from, const node_index root)
+{
+    auto result = dag{};
+    auto builder = dag_builder{ result.tree };
+    result.root = builder.intern(from, root);
+    result.deduplicated = builder.deduplicated;
+    return result;
+}
+
+constexpr inline node_index dag_builder::intern(const node& n)
+{
+    const struct
+    {
+        dag_builder& builder;
+
+        constexpr node_index operator()(const op_node& op) const
+        {
+            const auto left = builder.intern(*op.left);
+            const auto right = builder.intern(*op.right);
+            return builder.intern_op(left, right, op.type);
+        }
+        constexpr node_index operator()(const function_call_node& op) const
+        {
+            std::vector<node_index> arguments;
+            arguments.reserve(op.arguments.size());
+            for(const auto& argument : op.arguments)
+                arguments.emplace_back(builder.intern(argument));
+
+            return builder.intern_function_call(op.function_name, op.id, arguments);
+        }
+        constexpr node_index operator()(const symbol_node& op) const { return builder.intern_symbol(op.value, op.id); }
+        constexpr node_index operator()(const constant_node& op) const { return builder.intern_constant(op.value); }
+    } intern_visitor{ *this };
+
+    return std::visit(intern_visitor, n);
+}
+
+constexpr inline node_index dag_builder::intern(const ast& from, const node_index index)
+{
+    const auto& n = from[index];
+    switch(n.type) {
+        case flat_node_type::op: {
+            const auto left = intern(from, from.left(n));
+            const auto right = intern(from, from.right(n));
+            return intern_op(left, right, n.operation);
+        }
+        case flat_node_type::constant:
+            return intern_constant(from.value(n));
+        case flat_node_type::symbol:
+            return intern_symbol(from.name(n), n.symbol);
+        case flat_node_type::function_call: {
+            std::vector<node_index> arguments;
+            arguments.reserve(n.argument_count);
+            for(const auto argument : from.arguments_of(n))
+                arguments.emplace_back(intern(from, argument));
+
+            return intern_function_call(from.name(n), n.function, arguments);
+        }
+    }
+
+    std::unreachable();
+}
+
+// Constants are merged by type and bit pattern, so 1 and 1.0 (or 0.0 and -0.0) stay apart.
+constexpr inline node_index dag_builder::intern_constant(const number& value)
+{
+    const auto bits = value.is_int() ? std::bit_cast<std::uint64_t>(value.as_int()) :
+                                       std::bit_cast<std::uint64_t>(value.as_double());
+    const auto hash = mix(mix(hash_symbol("constant"), value.is_int()), bits);
+
+    const auto existing = find(hash, [&](const flat_node& n) {
+        if (n.type != flat_node_type::constant)
+            return false;
+
+        const auto& other = tree.value(n);
+        return other.is_int() == value.is_int() &&
+               (value.is_int() ? other.as_int() == value.as_int() :
+                                 std::bit_cast<std::uint64_t>(other.as_double()) == bits);
+    });
+    if (existing.has_value())
+        return existing.value();
+
+    return insert(hash, tree.make_constant(value));
+}
+
+constexpr inline node_index dag_builder::intern_symbol(const std::string_view symbol, const symbol_id id)
+{
+    const auto hash = mix(hash_symbol(symbol), id);
+
+    const auto existing = find(hash, [&](const flat_node& n) {
+        return n.type == flat_node_type::symbol && n.symbol == id && tree.name(n) == symbol;
+    });
+    if (existing.has_value())
+        return existing.value();
+
+    return insert(hash, tree.make_symbol(symbol, id));
+}
+
+// Children are already interned, so structural equality is index equality.
+constexpr inline node_index dag_builder::intern_op(const node_index left, const node_index right, const operation_type type)
+{
+    const auto hash = mix(mix(mix(hash_symbol("op"), std::to_underlying(type)), left), right);
+
+    const auto existing = find(hash, [&](const flat_node& n) {
+        return n.type == flat_node_type::op && n.operation == type && n.first == left && n.second == right;
+    });
+    if (existing.has_value())
+        return existing.value();
+
+    return insert(hash, tree.make_op(left, right, type));
+}
+
+constexpr inline node_index dag_builder::intern_function_call(const std::string_view function_name,
+                                                              const function_id id,
+                                                              const std::span<const node_index> arguments)
+{
+    auto hash = hash_symbol(function_name);
+    for(const auto argument : arguments)
+        hash = mix(hash, argument);
+
+    const auto existing = find(hash, [&](const flat_node& n) {
+        return n.type == flat_node_type::function_call && tree.name(n) == function_name &&
+               std::ranges::equal(tree.arguments_of(n), arguments);
+    });
+    if (existing.has_value())
+        return existing.value();
+
+    return insert(hash, tree.make_function_call(function_name, arguments, id));
+}
+
+constexpr inline std::optional<node_index> dag_builder::find(const std::uint64_t hash, const auto& equals)
+{
+    if (slots.empty())
+        return {};
+
+    const auto mask = slots.size() - 1;
+    for(auto i = static_cast<std::size_t>(hash) & mask;; i = (i + 1) & mask) {
+        const auto index = slots[i];
+        if (index == null_index)
+            return {};
+        if (hashes[index] == hash && equals(tree[index])) {
+            deduplicated++;
+            return index;
+        }
+    }
+}
+
+constexpr inline node_index dag_builder::insert(const std::uint64_t hash, const node_index index)
+{
+    hashes.emplace_back(hash);
+    if (hashes.size() * 2 > slots.size())
+        grow();
+    else
+        place(index);
+
+    return index;
+}
+
+constexpr inline void dag_builder::place(const node_index index)
+{
+    const auto mask = slots.size() - 1;
+    auto i = static_cast<std::size_t>(hashes[index]) & mask;
+    while(slots[i] != null_index)
+        i = (i + 1) & mask;
+
+    slots[i] = index;
+}
+
+constexpr inline void dag_builder::grow()
+{
+    slots.assign(std::max<std::size_t>(16, slots.size() * 2), null_index);
+    for(auto index = node_index{ 0 }; index < hashes.size(); index++)
+        place(index);
+}
+
+}
@@ -1,56 +1,208 @@
 #pragma once
 
+#include <cmath>
+#include <iterator>
+#include <numbers>
+#include <optional>
 #include <span>
+#include <string_view>
+#include <vector>
 
 #include <common.hpp>
 #include <math.hpp>
 #include <number.hpp>
+#include <quaternion.hpp>
+#include <simd.hpp>
+#include <symbols.hpp>
 
 namespace mathc
 {
 
+// Callers check a call's argument count against function::arity before calling func, so
+// builtins read their arguments without checking.
+
 constexpr static inline execution_result vm_sqrt(const std::span<number> args)
 {
-    if (args.size() > 1 || args.size() < 1)
-        return make_execution_error(std::format("sqrt expects 1 argument, got {}", args.size()));
-
     const auto& arg = args[0];
     return make_execution_result<number>(math::sqrt(arg.promote_to_double()));
 }
 
 constexpr static inline execution_result vm_log2(const std::span<number> args)
 {
-    if (args.size() > 1 || args.size() < 1)
-        return make_execution_error(std::format("log2 expects 1 argument, got {}", args.size()));
-
     const auto& arg = args[0];
     return make_execution_result<number>(math::log2(arg.promote_to_double()));
 }
 
 constexpr static inline execution_result vm_ln(const std::span<number> args)
 {
-    if (args.size() > 1 || args.size() < 1)
-        return make_execution_error(std::format("ln expects 1 argument, got {}", args.size()));
-
     const auto& arg = args[0];
     return make_execution_result<number>(math::log(arg.promote_to_double()));
 }
 
-constexpr static const auto functions =
+// rotate_x(w, x, y, z, px, py, pz), and _y and _z: one component of the point p rotated by
+// the unit quaternion w + xi + yj + zk. Each call computes the whole rotation for its one
+// component, so an expression wanting all three pays three times: rotate whole points over
+// columns with rotation_formula_evaluator instead.
+template<char component>
+constexpr static inline execution_result vm_rotate(const std::span<number> args)
+{
+    const auto q = quaternion{ args[0].promote_to_double(), args[1].promote_to_double(),
+                               args[2].promote_to_double(), args[3].promote_to_double() };
+    const auto p = q.rotate(vec3{ args[4].promote_to_double(), args[5].promote_to_double(),
+                                  args[6].promote_to_double() });
+
+    if constexpr (component == 'x')
+        return make_execution_result<number>(p.x);
+    else if constexpr (component == 'y')
+        return make_execution_result<number>(p.y);
+    else
+        return make_execution_result<number>(p.z);
+}
+
+// qmul_w(aw, ax, ay, az, bw, bx, by, bz), and _x, _y and _z: one component of a * b, again
+// from the whole product; rotation_evaluator::multiply takes whole quaternion columns.
+template<char component>
+constexpr static inline execution_result vm_quaternion_multiply(const std::span<number> args)
 {
-    function{ "sqrt",  vm_sqrt },
-    function{ "log2",  vm_log2 },
-    function{ "ln",    vm_ln   },
+    const auto a = quaternion{ args[0].promote_to_double(), args[1].promote_to_double(),
+                               args[2].promote_to_double(), args[3].promote_to_double() };
+    const auto b = quaternion{ args[4].promote_to_double(), args[5].promote_to_double(),
+                               args[6].promote_to_double(), args[7].promote_to_double() };
+    const auto product = a * b;
+
+    if constexpr (component == 'w')
+        return make_execution_result<number>(product.w);
+    else if constexpr (component == 'x')
+        return make_execution_result<number>(product.x);
+    else if constexpr (component == 'y')
+        return make_execution_result<number>(product.y);
+    else
+        return make_execution_result<number>(product.z);
+}
+
+constexpr static inline void batch_sqrt(const std::span<double> block)
+{
+    active_kernels().sqrt(block);
+}
+
+constexpr static inline void batch_log2(const std::span<double> block)
+{
+    active_kernels().log2(block);
+}
+
+constexpr static inline void batch_ln(const std::span<double> block)
+{
+    active_kernels().ln(block);
+}
+
+constexpr static inline double scalar_sqrt(const double value)
+{
+    if !consteval {
+        return std::sqrt(value);
+    }
+
+    return math::sqrt(value).promote_to_double();
+}
+
+constexpr static inline double scalar_log2(const double value)
+{
+    if !consteval {
+        return std::log2(value);
+    }
+
+    return math::log2(value).promote_to_double();
+}
+
+constexpr static inline double scalar_ln(const double value)
+{
+    if !consteval {
+        return std::log(value);
+    }
+
+    return math::log(value).promote_to_double();
+}
+
+constexpr static inline double derivative_sqrt(const double value) { return 0.5 / scalar_sqrt(value); }
+constexpr static inline double derivative_log2(const double value) { return 1.0 / (value * std::numbers::ln2); }
+constexpr static inline double derivative_ln(const double value)   { return 1.0 / value; }
+
+constexpr static const auto builtin_functions =
+{
+    function{ "sqrt",  vm_sqrt,  1, batch_sqrt,  scalar_sqrt,  derivative_sqrt },
+    function{ "log2",  vm_log2,  1, batch_log2,  scalar_log2,  derivative_log2 },
+    function{ "ln",    vm_ln,    1, batch_ln,    scalar_ln,    derivative_ln   },
+    function{ "rotate_x", vm_rotate<'x'>, 7 },
+    function{ "rotate_y", vm_rotate<'y'>, 7 },
+    function{ "rotate_z", vm_rotate<'z'>, 7 },
+    function{ "qmul_w", vm_quaternion_multiply<'w'>, 8 },
+    function{ "qmul_x", vm_quaternion_multiply<'x'>, 8 },
+    function{ "qmul_y", vm_quaternion_multiply<'y'>, 8 },
+    function{ "qmul_z", vm_quaternion_multiply<'z'>, 8 },
 };
 
+// Builtins only, for trees and programs built without a function_table. A builtin's id is
+// its index in builtin_functions, in every function_table as well.
 [[nodiscard]]
 constexpr static inline const function* find_function(const std::string_view function)
 {
-    for(const auto& f : functions)
+    for(const auto& f : builtin_functions)
         if (f.name == function)
             return &f;
 
     return nullptr;
 }
 
+[[nodiscard]]
+constexpr static inline const function* builtin_function(const function_id id)
+{
+    return id < builtin_functions.size() ? std::next(std::begin(builtin_functions), id) : nullptr;
+}
+
+constexpr static inline function_id builtin_function_id(const function* f)
+{
+    return static_cast<function_id>(std::distance(std::begin(builtin_functions), f));
+}
+
+// Builtins followed by user functions, resolved by name once, when an expression is parsed
+// or compiled; calls then carry the function_id and index entries directly. Names are
+// borrowed, as with the builtins' literals, and must outlive the table.
+struct function_table
+{
+    constexpr function_table()
+    {
+        for(const auto& f : builtin_functions)
+            define(f);
+    }
+
+    constexpr inline std::size_t size() const { return entries.size(); }
+    constexpr inline const function& operator[](const function_id id) const { return entries[id]; }
+
+    constexpr std::optional<function_id> find(const std::string_view name) const { return names.find(name); }
+
+    // Redefining a name replaces its entry and keeps its id.
+    constexpr function_id define(const function& f)
+    {
+        const auto id = names.intern(f.name);
+        if (id == entries.size())
+            entries.emplace_back(f);
+        else
+            entries[id] = f;
+
+        return id;
+    }
+
+    std::vector<function> entries{};
+    symbol_table names{};
+};
+
+// Without a table only builtins resolve.
+constexpr static inline function_id resolve_function(const function_table* functions, const std::string_view name)
+{
+    if (functions)
+        return functions->find(name).value_or(null_function);
+
+    const auto* f = find_function(name);
+    return f ? builtin_function_id(f) : null_function;
+}
+
 }
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <limits>
+#include <span>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <math.hpp>
+#include <number.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Reverse-mode differentiation of a compiled program: one forward pass runs it in doubles
+// and records every intermediate value on the tape, one reverse pass carries the adjoint of
+// the result back to each symbol. The value and every partial derivative cost about two
+// evaluations, however many symbols there are.
+//
+// Symbols are read from the vm as for vm::execute and are the independent variables: a
+// symbol bound to an expression counts as one input, its expression isn't differentiated.
+// Calls need a function with a derivative kernel (the builtins have one). A derivative that
+// doesn't exist where it is taken, like that of x^y with respect to y for x < 0, is NaN.
+
+struct gradient_result
+{
+    double value{ 0.0 };
+    std::vector<double> partials{};  // d value / d symbol, indexed like program::symbols
+};
+
+using gradient_evaluation = std::expected<gradient_result, execution_error>;
+
+struct tape
+{
+    constexpr gradient_evaluation gradient(const program& p, vm& vm);
+
+private:
+    using entry_index = std::uint32_t;
+
+    struct entry
+    {
+        opcode code;
+        entry_index left{ 0 };     // op: left operand, call: argument
+        entry_index right{ 0 };    // op: right operand
+        std::uint32_t operand{ 0 };  // load_symbol: symbol slot, call: function slot
+        double value{ 0.0 };
+    };
+
+    constexpr entry_index record(const entry& e)
+    {
+        entries.emplace_back(e);
+        return static_cast<entry_index>(entries.size() - 1);
+    }
+
+    // Kept between gradients so the tape's storage is reused.
+    std::vector<entry> entries{};
+    std::vector<entry_index> stack{};
+    std::vector<entry_index> temporaries{};
+    std::vector<double> adjoints{};
+};
+
+// Implementation
+
+constexpr inline gradient_evaluation tape::gradient(const program& p, vm& vm)
+{
+    assert(!p.instructions.empty());
+
+    entries.clear();
+    stack.clear();
+    temporaries.assign(p.temporaries, 0);
+
+    const auto pop = [&] {
+        const auto top = stack.back();
+        stack.pop_back();
+        return top;
+    };
+
+    for(const auto& i : p.instructions) {
+        switch(i.code) {
+            case opcode::push_constant:
+                stack.emplace_back(record({ .code = i.code, .value = p.constants[i.operand].promote_to_double() }));
+                break;
+
+            case opcode::load_symbol: {
+                const auto id = p.symbol_ids.empty() ? null_symbol : p.symbol_ids[i.operand];
+                const auto value = vm.resolve_symbol(id, p.symbols[i.operand]);
+                if (!value.has_value()) [[unlikely]]
+                    return gradient_evaluation{ std::unexpect_t{}, value.error() };
+
+                stack.emplace_back(record({ .code = i.code, .operand = i.operand, .value = value->promote_to_double() }));
+                break;
+            }
+
+            case opcode::add:
+            case opcode::sub:
+            case opcode::mul:
+            case opcode::div:
+            case opcode::exp: {
+                const auto right = pop();
+                const auto left = pop();
+                const auto a = entries[left].value;
+                const auto b = entries[right].value;
+
+                auto value = 0.0;
+                switch(i.code) {
+                    case opcode::add: value = a + b; break;
+                    case opcode::sub: value = a - b; break;
+                    case opcode::mul: value = a * b; break;
+                    case opcode::div: value = a / b; break;
+                    case opcode::exp: value = math::pow(a, b).promote_to_double(); break;
+                    case opcode::push_constant:
+                    case opcode::load_symbol:
+                    case opcode::call:
+                    case opcode::store_temp:
+                    case opcode::load_temp:
+                        std::unreachable();
+                }
+
+                stack.emplace_back(record({ .code = i.code, .left = left, .right = right, .value = value }));
+                break;
+            }
+
+            case opcode::call: {
+                const auto& function = p.functions[i.operand];
+                if (!function.derivative || i.argument_count != 1) [[unlikely]]
+                    return gradient_evaluation{ std::unexpect_t{},
+                                                std::format("Function {} has no derivative.", function.name) };
+
+                const auto argument = pop();
+                auto input = number{ entries[argument].value };
+                const auto result = function.func(std::span{ &input, 1 });
+                if (!result.has_value()) [[unlikely]]
+                    return gradient_evaluation{ std::unexpect_t{}, result.error() };
+
+                if (!std::holds_alternative<number>(result.value())) [[unlikely]]
+                    return gradient_evaluation{ std::unexpect_t{},
+                                                std::format("Function {} did not return a number.", function.name) };
+
+                stack.emplace_back(record({ .code = i.code,
+                                            .left = argument,
+                                            .operand = i.operand,
+                                            .value = std::get<number>(result.value()).promote_to_double() }));
+                break;
+            }
+
+            // A shared subexpression is one entry: each use adds to its adjoint.
+            case opcode::store_temp:
+                temporaries[i.operand] = stack.back();
+                break;
+
+            case opcode::load_temp:
+                stack.emplace_back(temporaries[i.operand]);
+                break;
+        }
+    }
+
+    assert(stack.size() == 1);
+
+    auto result = gradient_result{ .value = entries[stack.back()].value,
+                                   .partials = std::vector<double>(p.symbols.size(), 0.0) };
+
+    adjoints.assign(entries.size(), 0.0);
+    adjoints[stack.back()] = 1.0;
+
+    // Entries are recorded after their operands, so reverse order visits every use of a
+    // value before the value itself.
+    for(auto index = entries.size(); index-- > 0;) {
+        const auto& e = entries[index];
+        const auto adjoint = adjoints[index];
+        if (adjoint == 0.0)
+            continue;
+
+        const auto a = entries[e.left].value;
+        const auto b = entries[e.right].value;
+
+        switch(e.code) {
+            case opcode::push_constant:
+                break;
+            case opcode::load_symbol:
+                result.partials[e.operand] += adjoint;
+                break;
+            case opcode::add:
+                adjoints[e.left] += adjoint;
+                adjoints[e.right] += adjoint;
+                break;
+            case opcode::sub:
+                adjoints[e.left] += adjoint;
+                adjoints[e.right] -= adjoint;
+                break;
+            case opcode::mul:
+                adjoints[e.left] += adjoint * b;
+                adjoints[e.right] += adjoint * a;
+                break;
+            case opcode::div:
+                adjoints[e.left] += adjoint / b;
+                adjoints[e.right] -= adjoint * e.value / b;
+                break;
+            case opcode::exp: {
+                // d(a^b)/da = b * a^(b - 1), d(a^b)/db = a^b * ln(a)
+                adjoints[e.left] += adjoint * b * math::pow(a, b - 1.0).promote_to_double();
+                if (a > 0.0)
+                    adjoints[e.right] += adjoint * e.value * math::log(a).promote_to_double();
+                else if (a < 0.0)
+                    adjoints[e.right] += std::numeric_limits<double>::quiet_NaN();
+                break;
+            }
+            case opcode::call:
+                adjoints[e.left] += adjoint * p.functions[e.operand].derivative(a);
+                break;
+            case opcode::store_temp:
+            case opcode::load_temp:
+                std::unreachable();
+        }
+    }
+
+    return result;
+}
+
+}
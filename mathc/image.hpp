@@ -0,0 +1,420 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <number.hpp>
+#include <symbols.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Compiled programs stored so that a file can be mapped and run where it lies. Opening an
+// image checks it in one pass and builds only its symbol and function tables; each program
+// is then a program_view into the mapping, with nothing parsed, copied or allocated for it.
+//
+// The layout is a header followed by 8-byte aligned sections, in the writing machine's byte
+// order: programs, instructions, constants, symbols, functions and the names' text. Symbol
+// and function operands index the image-wide tables, not a program's own. Opening an image
+// interns its symbols into a vm's symbol_table and looks its functions up by name in the
+// vm's function_table, so its programs run on that vm only, and user functions must be
+// defined before it is opened. Any change to the layout bumps image_version.
+
+constexpr static std::array<char, 8> image_magic{ 'm', 'a', 't', 'h', 'c', 'i', 'm', 'g' };
+constexpr static std::uint32_t image_version = 1;
+constexpr static std::uint32_t image_byte_order = 0x01020304;
+
+struct image_header
+{
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t byte_order;  // image_byte_order, as the writing machine stores it
+    std::uint32_t program_count;
+    std::uint32_t instruction_count;
+    std::uint32_t constant_count;
+    std::uint32_t symbol_count;
+    std::uint32_t function_count;
+    std::uint32_t names_size;
+
+    // Byte offsets of the sections from the start of the image.
+    std::uint64_t programs;
+    std::uint64_t instructions;
+    std::uint64_t constants;
+    std::uint64_t symbols;
+    std::uint64_t functions;
+    std::uint64_t names;
+};
+
+struct image_program
+{
+    std::uint32_t first_instruction;
+    std::uint32_t instruction_count;
+    std::uint32_t first_constant;  // push_constant operands are relative to it
+    std::uint32_t constant_count;
+    std::uint32_t max_stack_depth;
+    std::uint32_t temporaries;
+    std::uint32_t source;          // offset into names of the source text it was compiled from
+    std::uint32_t source_length;
+};
+
+struct image_name
+{
+    std::uint32_t offset;  // into names
+    std::uint32_t length;
+};
+
+struct image_function
+{
+    image_name name;
+    std::uint32_t arity;
+    std::uint32_t reserved{ 0 };
+};
+
+static_assert(sizeof(image_header) == 88 && sizeof(image_program) == 32 && sizeof(image_function) == 16);
+static_assert(sizeof(instruction) == 8 && sizeof(number) == 8);
+
+struct image_writer
+{
+    // The source is kept with the program, for callers that need its tree (a residual).
+    constexpr void add(const program& p, std::string_view source = {});
+    constexpr std::string finish() const;
+
+    constexpr std::size_t size() const { return programs.size(); }
+
+private:
+    constexpr image_name push_name(std::string_view name);
+
+    symbol_table symbol_ids{};
+    symbol_table function_ids{};
+
+    std::vector<image_program> programs{};
+    std::vector<instruction> instructions{};
+    std::vector<number> constants{};
+    std::vector<image_name> symbols{};
+    std::vector<image_function> functions{};
+    std::string names{};
+};
+
+struct image_error
+{
+    std::string error;
+};
+
+struct image;
+using image_result = std::expected<image, image_error>;
+
+struct image
+{
+    // contents must stay valid (mapped) while the image is used, and start 8-byte aligned,
+    // as a mapping does.
+    static image_result open(std::string_view contents, vm& vm);
+
+    std::size_t size() const { return programs.size(); }
+    program_view operator[](std::size_t index) const;
+    std::string_view source(std::size_t index) const;
+
+private:
+    std::span<const image_program> programs{};
+    std::span<const instruction> instructions{};
+    std::span<const number> constants{};
+    std::string_view names{};
+
+    // Image-wide tables, resolved against the vm on open.
+    std::vector<std::string_view> symbols{};
+    std::vector<symbol_id> symbol_ids{};
+    std::vector<function> functions{};
+};
+
+// Implementation
+
+constexpr inline image_name image_writer::push_name(const std::string_view name)
+{
+    const auto offset = static_cast<std::uint32_t>(names.size());
+    names.append(name);
+    return { .offset = offset, .length = static_cast<std::uint32_t>(name.size()) };
+}
+
+constexpr inline void image_writer::add(const program& p, const std::string_view source)
+{
+    const auto first_instruction = static_cast<std::uint32_t>(instructions.size());
+    const auto first_constant = static_cast<std::uint32_t>(constants.size());
+
+    for(auto i : p.instructions) {
+        if (i.code == opcode::load_symbol) {
+            const auto& name = p.symbols[i.operand];
+            i.operand = symbol_ids.intern(name);
+            if (i.operand == symbols.size())
+                symbols.emplace_back(push_name(name));
+        } else if (i.code == opcode::call) {
+            const auto& f = p.functions[i.operand];
+            i.operand = function_ids.intern(f.name);
+            if (i.operand == functions.size())
+                functions.emplace_back(image_function{ .name = push_name(f.name), .arity = f.arity });
+        }
+
+        instructions.emplace_back(i);
+    }
+
+    constants.insert(constants.end(), p.constants.begin(), p.constants.end());
+
+    const auto text = push_name(source);
+    programs.emplace_back(image_program{ .first_instruction = first_instruction,
+                                         .instruction_count = static_cast<std::uint32_t>(p.instructions.size()),
+                                         .first_constant = first_constant,
+                                         .constant_count = static_cast<std::uint32_t>(p.constants.size()),
+                                         .max_stack_depth = static_cast<std::uint32_t>(p.max_stack_depth),
+                                         .temporaries = static_cast<std::uint32_t>(p.temporaries),
+                                         .source = text.offset,
+                                         .source_length = text.length });
+}
+
+// Field by field, so no padding byte is ever written.
+constexpr inline std::string image_writer::finish() const
+{
+    auto out = std::string{};
+
+    const auto put = [&](const auto value) {
+        const auto bytes = std::bit_cast<std::array<char, sizeof(value)>>(value);
+        out.append(bytes.data(), bytes.size());
+    };
+
+    const auto align = [&] { out.resize((out.size() + 7) / 8 * 8, '\0'); };
+
+    constexpr auto header_size = sizeof(image_header);
+    const auto section = [](std::uint64_t& end, const std::size_t bytes) {
+        const auto start = end;
+        end = (end + bytes + 7) / 8 * 8;
+        return start;
+    };
+
+    auto offset = std::uint64_t{ header_size };
+    const auto programs_at = section(offset, programs.size() * sizeof(image_program));
+    const auto instructions_at = section(offset, instructions.size() * sizeof(instruction));
+    const auto constants_at = section(offset, constants.size() * sizeof(number));
+    const auto symbols_at = section(offset, symbols.size() * sizeof(image_name));
+    const auto functions_at = section(offset, functions.size() * sizeof(image_function));
+    const auto names_at = section(offset, names.size());
+    out.reserve(offset);
+
+    out.append(image_magic.data(), image_magic.size());
+    put(image_version);
+    put(image_byte_order);
+    put(static_cast<std::uint32_t>(programs.size()));
+    put(static_cast<std::uint32_t>(instructions.size()));
+    put(static_cast<std::uint32_t>(constants.size()));
+    put(static_cast<std::uint32_t>(symbols.size()));
+    put(static_cast<std::uint32_t>(functions.size()));
+    put(static_cast<std::uint32_t>(names.size()));
+    for(const auto at : { programs_at, instructions_at, constants_at, symbols_at, functions_at, names_at })
+        put(at);
+
+    for(const auto& p : programs) {
+        put(p.first_instruction);
+        put(p.instruction_count);
+        put(p.first_constant);
+        put(p.constant_count);
+        put(p.max_stack_depth);
+        put(p.temporaries);
+        put(p.source);
+        put(p.source_length);
+    }
+
+    align();
+    for(const auto& i : instructions) {
+        put(std::to_underlying(i.code));
+        put(std::uint8_t{ 0 });
+        put(i.argument_count);
+        put(i.operand);
+    }
+
+    align();
+    for(const auto& c : constants)
+        put(c.bits);
+
+    align();
+    for(const auto& s : symbols) {
+        put(s.offset);
+        put(s.length);
+    }
+
+    align();
+    for(const auto& f : functions) {
+        put(f.name.offset);
+        put(f.name.length);
+        put(f.arity);
+        put(f.reserved);
+    }
+
+    align();
+    out.append(names);
+    align();
+
+    assert(out.size() == offset);
+    return out;
+}
+
+// In-place access to the mapped sections.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+inline image_result image::open(const std::string_view contents, vm& vm)
+{
+    const auto fail = [](std::string error) { return image_result{ std::unexpect_t{}, std::move(error) }; };
+
+    const auto* base = contents.data();
+    if (contents.size() < sizeof(image_header) || reinterpret_cast<std::uintptr_t>(base) % 8 != 0) [[unlikely]]
+        return fail("Not a mathc image.");
+
+    const auto& header = *reinterpret_cast<const image_header*>(base);
+    if (header.magic != image_magic) [[unlikely]]
+        return fail("Not a mathc image.");
+    if (header.byte_order != image_byte_order) [[unlikely]]
+        return fail("Image was written with another byte order.");
+    if (header.version != image_version) [[unlikely]]
+        return fail(std::format("Image version {} is not supported, expected {}.", header.version, image_version));
+
+    const auto fits = [&](const std::uint64_t offset, const std::uint64_t bytes) {
+        return offset % 8 == 0 && offset <= contents.size() && bytes <= contents.size() - offset;
+    };
+
+    if (!fits(header.programs, std::uint64_t{ header.program_count } * sizeof(image_program)) ||
+        !fits(header.instructions, std::uint64_t{ header.instruction_count } * sizeof(instruction)) ||
+        !fits(header.constants, std::uint64_t{ header.constant_count } * sizeof(number)) ||
+        !fits(header.symbols, std::uint64_t{ header.symbol_count } * sizeof(image_name)) ||
+        !fits(header.functions, std::uint64_t{ header.function_count } * sizeof(image_function)) ||
+        !fits(header.names, header.names_size)) [[unlikely]]
+        return fail("Image is truncated.");
+
+    auto result = image{};
+    result.programs = { reinterpret_cast<const image_program*>(base + header.programs), header.program_count };
+    result.instructions = { reinterpret_cast<const instruction*>(base + header.instructions), header.instruction_count };
+    result.constants = { reinterpret_cast<const number*>(base + header.constants), header.constant_count };
+    result.names = contents.substr(header.names, header.names_size);
+
+    const auto name_of = [&](const image_name& n) -> std::optional<std::string_view> {
+        if (n.offset > result.names.size() || n.length > result.names.size() - n.offset) [[unlikely]]
+            return std::nullopt;
+        return result.names.substr(n.offset, n.length);
+    };
+
+    const auto symbols = std::span{ reinterpret_cast<const image_name*>(base + header.symbols), header.symbol_count };
+    result.symbols.reserve(symbols.size());
+    result.symbol_ids.reserve(symbols.size());
+    for(const auto& s : symbols) {
+        const auto name = name_of(s);
+        if (!name.has_value()) [[unlikely]]
+            return fail("Image is malformed.");
+
+        result.symbols.emplace_back(name.value());
+        result.symbol_ids.emplace_back(vm.symbols.intern(name.value()));
+    }
+
+    const auto functions = std::span{ reinterpret_cast<const image_function*>(base + header.functions), header.function_count };
+    result.functions.reserve(functions.size());
+    for(const auto& f : functions) {
+        const auto name = name_of(f.name);
+        if (!name.has_value()) [[unlikely]]
+            return fail("Image is malformed.");
+
+        const auto id = vm.functions.find(name.value());
+        if (!id.has_value()) [[unlikely]]
+            return fail(std::format("Function {} is not defined.", name.value()));
+        if (vm.functions[id.value()].arity != f.arity) [[unlikely]]
+            return fail(std::format("Function {} takes {} arguments, the image calls it with {}.",
+                                    name.value(), vm.functions[id.value()].arity, f.arity));
+
+        result.functions.emplace_back(vm.functions[id.value()]);
+    }
+
+    // Every operand is in range and the stack never underflows, so the vm can run the
+    // programs unchecked.
+    for(auto index = 0uz; index < result.programs.size(); index++) {
+        const auto& p = result.programs[index];
+        const auto malformed = [&] { return fail(std::format("Image program {} is malformed.", index)); };
+
+        if (p.instruction_count == 0 || p.first_instruction > result.instructions.size() ||
+            p.instruction_count > result.instructions.size() - p.first_instruction ||
+            p.first_constant > result.constants.size() || p.constant_count > result.constants.size() - p.first_constant ||
+            !name_of({ .offset = p.source, .length = p.source_length }).has_value()) [[unlikely]]
+            return malformed();
+
+        auto depth = 0uz;
+        auto peak = 0uz;
+        auto slots = 0uz;  // temporaries the instructions name
+        for(const auto& i : result.instructions.subspan(p.first_instruction, p.instruction_count)) {
+            if (std::to_underlying(i.code) > std::to_underlying(opcode::load_temp)) [[unlikely]]
+                return malformed();
+
+            auto valid = true;
+            switch(i.code) {
+                case opcode::push_constant: valid = i.operand < p.constant_count; depth++; break;
+                case opcode::load_symbol:   valid = i.operand < result.symbols.size(); depth++; break;
+                case opcode::load_temp:     valid = i.operand < p.temporaries; depth++; break;
+                case opcode::store_temp:    valid = i.operand < p.temporaries && depth >= 1; break;
+                case opcode::add:
+                case opcode::sub:
+                case opcode::mul:
+                case opcode::div:
+                case opcode::exp:
+                    valid = depth >= 2;
+                    depth--;
+                    break;
+                case opcode::call:
+                    valid = i.operand < result.functions.size() && i.argument_count == result.functions[i.operand].arity &&
+                            depth >= i.argument_count;
+                    depth = depth - i.argument_count + 1;
+                    break;
+            }
+
+            if (!valid) [[unlikely]]
+                return malformed();
+
+            peak = std::max(peak, depth);
+            if (i.code == opcode::load_temp || i.code == opcode::store_temp)
+                slots = std::max(slots, std::size_t{ i.operand } + 1);
+        }
+
+        // The vm sizes its stack and temporaries from these, so nothing larger than the
+        // instructions use is taken on trust.
+        if (depth != 1 || p.max_stack_depth > peak || p.temporaries > slots) [[unlikely]]
+            return malformed();
+    }
+
+    return result;
+}
+
+inline program_view image::operator[](const std::size_t index) const
+{
+    const auto& p = programs[index];
+    return program_view{ .instructions = instructions.subspan(p.first_instruction, p.instruction_count),
+                         .constants = constants.subspan(p.first_constant, p.constant_count),
+                         .symbols = symbols,
+                         .symbol_ids = symbol_ids,
+                         .functions = functions,
+                         .max_stack_depth = p.max_stack_depth,
+                         .temporaries = p.temporaries };
+}
+
+inline std::string_view image::source(const std::size_t index) const
+{
+    return names.substr(programs[index].source, programs[index].source_length);
+}
+
+#pragma GCC diagnostic pop
+
+}
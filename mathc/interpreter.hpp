@@ -1,118 +1,387 @@
 #pragma once
 
+#include <algorithm>
+#include <optional>
+#include <span>
 #include <utility>
 #include <variant>
+#include <vector>
 
+#include <ast.hpp>
+#include <bytecode.hpp>
 #include <common.hpp>
 #include <functions.hpp>
 #include <node.hpp>
 #include <number.hpp>
+#include <stats.hpp>
 #include <vm.hpp>
 
 namespace mathc
 {
 
+using flat_simplify_memo = std::vector<std::optional<flat_simplify_result>>;
+
 struct interpreter
 {
     constexpr static execution_result run(const node& root_node, vm& vm);
     constexpr static execution_result simplify(const node& root_node, vm& vm);
+
+    // Residuals are appended to the same ast; unchanged subtrees are returned by index.
+    constexpr static flat_execution_result run(ast& tree, node_index root, vm& vm);
+    constexpr static flat_execution_result simplify(ast& tree, node_index root, vm& vm);
+
+    // Indexed by node: nodes shared in a dag are simplified once per call. An entry the caller
+    // fills in beforehand is taken as that node's result without visiting it.
+    constexpr static flat_execution_result simplify(ast& tree, node_index root, vm& vm, flat_simplify_memo& memo);
+
+private:
+    constexpr static void truncate(auto& stack, const std::size_t size)
+    {
+        stack.erase(std::next(stack.begin(), static_cast<long>(size)), stack.end());
+    }
 };
 
 // Implementation
 
+// Numeric evaluation goes through the bytecode vm; anything it can't reduce to a
+// number (unbound symbols, errors) is retried on the symbolic path.
+constexpr inline execution_result interpreter::run(const node& root_node, vm& vm)
+{
+    const auto timer = stage_timer{ pipeline_stage::evaluate };
+    const auto program = compiler::compile(root_node, vm.symbols, vm.functions);
+    if (!program.has_value())
+        return make_execution_error(program.error().error);
+
+    const auto result = vm.execute(program.value());
+    if (!result.has_value())
+        return simplify(root_node, vm);
+
+    return make_execution_result<number>(result.value());
+}
+
+// Both simplify overloads walk the expression in post-order on the vm's explicit stacks
+// rather than the native one: a task is revisited once per finished child, and finished
+// subtrees leave their result on the value stack for their parent to pop.
+//
+// A residual shares every subtree that didn't change with root_node, so only the nodes on a
+// path to a change are made: unchanged subtrees are passed up by pointer.
 constexpr inline execution_result interpreter::simplify(const node& root_node, vm& vm)
 {
-    const struct
-    {
-        const node& root_node;
-        struct vm& vm;
-
-        constexpr auto operator()(const op_node& op) const
-        {
-            PROPAGATE_ERROR(left_result, interpreter::simplify(*op.left, vm));
-            PROPAGATE_ERROR(right_result, interpreter::simplify(*op.right, vm));
-
-            constexpr static struct {
-                constexpr static auto operator()(node&& n)
-                {
-                    return std::make_unique<node>(std::forward<node>(n));
-                }
-                constexpr static auto operator()(number&& n)
-                {
-                    return std::make_unique<node>(std::in_place_type_t<constant_node>{}, n);
-                }
-            } creator{};
+    const auto timer = stage_timer{ pipeline_stage::evaluate };
+    // original is the operand the value was simplified from.
+    constexpr static auto as_operand = [](simplify_value&& value, const node_ptr& original) {
+        if (const auto* n = std::get_if<number>(&value); n)
+            return node_ptr{ make_node<constant_node>(*n) };
+        if (const auto* unchanged = std::get_if<const node*>(&value); unchanged)
+            return *unchanged == original.get() ? original : node_ptr{ copy_node(**unchanged) };
+
+        return node_ptr{ std::move(std::get<node>(value)) };
+    };
+    constexpr static auto is_unchanged = [](const simplify_value& value, const node_ptr& original) {
+        const auto* unchanged = std::get_if<const node*>(&value);
+        return unchanged && *unchanged == original.get();
+    };
+
+    auto& tasks = vm.simplify_tasks;
+    auto& values = vm.simplify_values;
+    const auto tasks_base = tasks.size();
+    const auto values_base = values.size();
 
-            if (std::holds_alternative<node>(left_result) ||
-                std::holds_alternative<node>(right_result)) {
-                return make_execution_result<op_node>(std::visit(creator, std::move(left_result)),
-                                                      std::visit(creator, std::move(right_result)),
-                                                      op.type);
+    const auto fail = [&](auto&& error) {
+        truncate(tasks, tasks_base);
+        truncate(values, values_base);
+        return make_execution_error(std::forward<decltype(error)>(error));
+    };
+
+    tasks.emplace_back(&root_node);
+
+    while(tasks.size() > tasks_base) {
+        const auto [current, stage] = tasks.back();
+        tasks.back().stage++;
+
+        if (const auto* op = std::get_if<op_node>(current); op) {
+            if (stage < 2) {
+                tasks.emplace_back(stage == 0 ? op->left.get() : op->right.get());
+                continue;
             }
 
-            const auto& left_result_number = std::get<number>(left_result);
-            const auto& right_result_number = std::get<number>(right_result);
+            tasks.pop_back();
+            auto right = std::move(values.back());
+            values.pop_back();
+            auto& left = values.back();
 
-            switch(op.type) {
-                case operation_type::mul: return make_execution_result<number>(left_result_number * right_result_number);
-                case operation_type::div: return make_execution_result<number>(left_result_number / right_result_number);
-                case operation_type::add: return make_execution_result<number>(left_result_number + right_result_number);
-                case operation_type::sub: return make_execution_result<number>(left_result_number - right_result_number);
-                case operation_type::exp: return make_execution_result<number>(left_result_number ^ right_result_number);
+            if (std::holds_alternative<number>(left) && std::holds_alternative<number>(right))
+                left = apply_operation(op->type, std::get<number>(left), std::get<number>(right));
+            else if (is_unchanged(left, op->left) && is_unchanged(right, op->right))
+                left = current;
+            else
+                left = make_node<op_node>(as_operand(std::move(left), op->left),
+                                          as_operand(std::move(right), op->right),
+                                          op->type);
+            continue;
+        }
+
+        if (const auto* constant = std::get_if<constant_node>(current); constant) {
+            tasks.pop_back();
+            values.emplace_back(constant->value);
+            continue;
+        }
+
+        if (const auto* symbol = std::get_if<symbol_node>(current); symbol) {
+            const auto* bound = symbol->id != null_symbol ? vm.symbol_node(symbol->id) : vm.symbol_node(symbol->value);
+            if (bound) {
+                tasks.back() = { bound };  // the binding is simplified in place of the symbol
+            } else {
+                tasks.pop_back();
+                values.emplace_back(current);
             }
+            continue;
+        }
+
+        const auto& function_call = std::get<function_call_node>(*current);
+        const auto* function = vm.find_function(function_call.id, function_call.function_name);
+        if (!function)
+            return fail(std::format("Function {} not found.", function_call.function_name));
+
+        // Arguments are simplified in order until one doesn't reduce to a number; that one and
+        // the rest are kept as written.
+        const auto residual = stage > 0 && !std::holds_alternative<number>(values.back());
+        if (!residual && stage < function_call.arguments.size()) {
+            tasks.emplace_back(&function_call.arguments[stage]);
+            continue;
+        }
+
+        tasks.pop_back();
+
+        if (!residual) {
+            if (stage != function->arity)
+                return fail(std::format("{} expects {} arguments, got {}", function->name, function->arity, stage));
 
-            std::unreachable();
+            const auto stack_base = vm.stack.size();
+            for(auto& value : std::span{ values }.last(stage))
+                vm.stack.emplace_back(std::get<number>(value));
+
+            count_stat(&pipeline_stats::function_calls);
+            auto result = function->func(std::span{ vm.stack }.subspan(stack_base));
+            truncate(vm.stack, stack_base);
+            if (!result.has_value())
+                return fail(std::move(result.error()));
+
+            truncate(values, values.size() - stage);
+            if (std::holds_alternative<number>(result.value()))
+                values.emplace_back(std::get<number>(result.value()));
+            else
+                values.emplace_back(std::move(std::get<node>(result.value())));
+            continue;
         }
 
-        constexpr auto operator()(const constant_node& c) const
-        {
-            return execution_result{ c.value };
+        // No argument before the residual one reduced: the call is unchanged.
+        const auto results = stage - 1;
+        if (results == 0) {
+            truncate(values, values.size() - stage);
+            values.emplace_back(current);
+            continue;
         }
 
-        constexpr auto operator()(const symbol_node& symbol) const
-        {
-            auto symbol_node = vm.symbol_node(symbol.value);
-            if (symbol_node.has_value())
-                return simplify(symbol_node.value(), vm);
+        std::vector<node> new_arguments{};
+        new_arguments.reserve(function_call.arguments.size());
+        for(auto& value : std::span{ values }.last(stage).first(results))
+            new_arguments.emplace_back(make_node<constant_node>(std::get<number>(value)));
+        for(auto i = results; i < function_call.arguments.size(); i++)
+            new_arguments.emplace_back(copy_node(function_call.arguments[i]));
+
+        truncate(values, values.size() - stage);
+        values.emplace_back(make_node<function_call_node>(function_call.function_name, std::move(new_arguments),
+                                                          function_call.id));
+    }
+
+    auto result = std::move(values.back());
+    values.pop_back();
+    if (const auto* unchanged = std::get_if<const node*>(&result); unchanged)
+        return execution_result{ std::in_place_t{}, std::in_place_type_t<node>{}, copy_node(**unchanged) };
+    if (const auto* n = std::get_if<number>(&result); n)
+        return make_execution_result<number>(*n);
+
+    return execution_result{ std::in_place_t{}, std::in_place_type_t<node>{}, std::move(std::get<node>(result)) };
+}
+
+constexpr inline flat_execution_result interpreter::run(ast& tree, const node_index root, vm& vm)
+{
+    const auto timer = stage_timer{ pipeline_stage::evaluate };
+    const auto program = compiler::compile(tree, root, vm.symbols, vm.functions);
+    if (!program.has_value())
+        return flat_execution_result{ std::unexpect_t{}, program.error().error };
+
+    const auto result = vm.execute(program.value());
+    if (!result.has_value())
+        return simplify(tree, root, vm);
 
-            return make_execution_result<node>(copy_node(root_node));
+    return flat_simplify_result{ std::in_place_type_t<number>{}, result.value() };
+}
+
+constexpr inline flat_execution_result interpreter::simplify(ast& tree, const node_index root, vm& vm)
+{
+    auto memo = flat_simplify_memo(tree.size());
+    return simplify(tree, root, vm, memo);
+}
+
+constexpr inline flat_execution_result interpreter::simplify(ast& tree, const node_index root, vm& vm,
+                                                             flat_simplify_memo& memo)
+{
+    const auto timer = stage_timer{ pipeline_stage::evaluate };
+    // Constants that simplified to themselves are reused rather than re-appended.
+    constexpr static auto as_index = [](ast& t, const node_index original, const flat_simplify_result& result) {
+        if (std::holds_alternative<node_index>(result))
+            return std::get<node_index>(result);
+        if (t[original].type == flat_node_type::constant)
+            return original;
+
+        return t.make_constant(std::get<number>(result));
+    };
+
+    auto& tasks = vm.flat_simplify_tasks;
+    auto& values = vm.flat_simplify_values;
+    const auto tasks_base = tasks.size();
+    const auto values_base = values.size();
+
+    const auto fail = [&](auto&& error) {
+        truncate(tasks, tasks_base);
+        truncate(values, values_base);
+        return flat_execution_result{ std::unexpect_t{}, std::forward<decltype(error)>(error) };
+    };
+
+    // Every finished node is memoized, so a shared node is pushed once and then read back.
+    const auto finish = [&](const node_index index, flat_simplify_result&& result) {
+        tasks.pop_back();
+        memo[index] = result;
+        values.emplace_back(std::move(result));
+    };
+
+    constexpr static auto residual = [](const node_index index) {
+        return flat_simplify_result{ std::in_place_type_t<node_index>{}, index };
+    };
+
+    tasks.emplace_back(root);
+
+    while(tasks.size() > tasks_base) {
+        const auto [index, stage] = tasks.back();
+        tasks.back().stage++;
+
+        if (stage == 0 && memo[index].has_value()) {
+            tasks.pop_back();
+            values.emplace_back(memo[index].value());
+            continue;
         }
 
-        constexpr auto operator()(const function_call_node& function_call) const
-        {
-            const auto function = find_function(function_call.function_name);
-            if (!function)
-                return make_execution_error(std::format("Function {} not found.", function_call.function_name));
+        // Copied, not referenced: simplification may grow tree.nodes.
+        const auto n = tree[index];
 
-            std::vector<number> results{};
-            results.reserve(function_call.arguments.size());
+        switch(n.type) {
+            case flat_node_type::constant:
+                finish(index, tree.value(n));
+                break;
 
-            for(auto i = 0u; i < function_call.arguments.size(); i++) {
-                const auto& argument = function_call.arguments[i];
-                PROPAGATE_ERROR(simplified, simplify(argument, vm));
-                if (!std::holds_alternative<number>(simplified))
+            case flat_node_type::symbol: {
+                const auto* bound = n.symbol != null_symbol ? vm.symbol_node(n.symbol) : vm.symbol_node(tree.name(n));
+                if (!bound) {
+                    finish(index, residual(index));
                     break;
+                }
 
-                results.emplace_back(std::get<number>(simplified));
+                auto simplified = simplify(*bound, vm);
+                if (!simplified.has_value())
+                    return fail(std::move(simplified.error()));
+
+                if (std::holds_alternative<number>(simplified.value()))
+                    finish(index, std::get<number>(simplified.value()));
+                else
+                    finish(index, residual(copy_node(std::get<node>(simplified.value()), tree)));
+                break;
             }
 
-            if (results.size() == function_call.arguments.size())
-                return function->func(results);
+            case flat_node_type::op: {
+                if (stage < 2) {
+                    tasks.emplace_back(stage == 0 ? n.first : n.second);
+                    break;
+                }
 
-            std::vector<node> new_arguments{};
-            new_arguments.reserve(function_call.arguments.size());
-            for(auto i = 0u; i < function_call.arguments.size(); i++) {
-                if (i < results.size())
-                    new_arguments.emplace_back(make_node<constant_node>( results[i] ));
+                const auto right = std::move(values.back());
+                values.pop_back();
+                const auto left = std::move(values.back());
+                values.pop_back();
+
+                if (std::holds_alternative<number>(left) && std::holds_alternative<number>(right)) {
+                    finish(index, apply_operation(n.operation, std::get<number>(left), std::get<number>(right)));
+                    break;
+                }
+
+                const auto left_index = as_index(tree, n.first, left);
+                const auto right_index = as_index(tree, n.second, right);
+                if (left_index == n.first && right_index == n.second)
+                    finish(index, residual(index));
                 else
-                    new_arguments.emplace_back(copy_node(function_call.arguments[i]));
+                    finish(index, residual(tree.make_op(left_index, right_index, n.operation)));
+                break;
             }
 
-            return make_execution_result<function_call_node>(function_call.function_name, std::move(new_arguments));
+            case flat_node_type::function_call: {
+                const auto* function = vm.find_function(n.function, tree.name(n));
+                if (!function)
+                    return fail(std::format("Function {} not found.", tree.name(n)));
+
+                // As for node trees: the first argument that isn't a number ends simplification.
+                const auto is_residual = stage > 0 && std::holds_alternative<node_index>(values.back());
+                if (!is_residual && stage < n.argument_count) {
+                    tasks.emplace_back(tree.arguments_of(n)[stage]);
+                    break;
+                }
+
+                if (!is_residual) {
+                    if (stage != function->arity)
+                        return fail(std::format("{} expects {} arguments, got {}", function->name, function->arity, stage));
+
+                    const auto stack_base = vm.stack.size();
+                    for(const auto& value : std::span{ values }.last(stage))
+                        vm.stack.emplace_back(std::get<number>(value));
+
+                    count_stat(&pipeline_stats::function_calls);
+                    const auto result = function->func(std::span{ vm.stack }.subspan(stack_base));
+                    truncate(vm.stack, stack_base);
+                    if (!result.has_value())
+                        return fail(result.error());
+
+                    truncate(values, values.size() - stage);
+                    if (std::holds_alternative<number>(result.value()))
+                        finish(index, std::get<number>(result.value()));
+                    else
+                        finish(index, residual(copy_node(std::get<node>(result.value()), tree)));
+                    break;
+                }
+
+                const auto results = stage - 1;
+                std::vector<node_index> new_arguments{};
+                new_arguments.reserve(n.argument_count);
+                for(auto i = 0u; i < n.argument_count; i++) {
+                    const auto argument = tree.arguments_of(n)[i];
+                    if (i < results)
+                        new_arguments.emplace_back(as_index(tree, argument, values[values.size() - stage + i]));
+                    else
+                        new_arguments.emplace_back(argument);
+                }
+
+                truncate(values, values.size() - stage);
+                if (std::ranges::equal(new_arguments, tree.arguments_of(n)))
+                    finish(index, residual(index));
+                else
+                    finish(index, residual(tree.make_function_call(std::string{ tree.name(n) }, new_arguments, n.function)));
+                break;
+            }
         }
-    } simplify_visitor{ root_node, vm };
+    }
 
-    return std::visit(simplify_visitor, root_node);
+    auto result = std::move(values.back());
+    values.pop_back();
+    return flat_execution_result{ std::move(result) };
 }
 
 }
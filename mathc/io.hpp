@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <expected>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <number.hpp>
+
+namespace mathc
+{
+
+// Raw file and buffer access at the os boundary.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+struct io_error
+{
+    std::string error;
+};
+
+struct mapped_file;
+using map_result = std::expected<mapped_file, io_error>;
+
+// Collects output and hands it to stdio in capacity-sized writes, so a line costs a
+// to_chars into memory instead of a formatted stdio call. Without a file, everything
+// written stays in buffer for the owner to take.
+struct output_buffer
+{
+    constexpr static std::size_t capacity = 1 << 16;
+
+    explicit output_buffer(std::FILE* f) : file(f) { buffer.reserve(capacity); }
+    ~output_buffer() { flush(); }
+
+    output_buffer(const output_buffer&) = delete;
+    output_buffer& operator=(const output_buffer&) = delete;
+
+    void write(const std::string_view text)
+    {
+        if (file && text.size() >= capacity) {
+            flush();
+            std::fwrite(text.data(), 1, text.size(), file);
+            return;
+        }
+
+        buffer.append(text);
+        if (file && buffer.size() >= capacity)
+            flush();
+    }
+
+    void write(const char c) { write(std::string_view{ &c, 1 }); }
+
+    // Same text as std::format("{}", n): shortest round-trip for doubles.
+    void write(const number& n)
+    {
+        std::array<char, 32> digits{};
+        const auto result = n.visit([&](const auto value) {
+            return std::to_chars(digits.data(), digits.data() + digits.size(), value);
+        });
+        write(std::string_view{ digits.data(), result.ptr });
+    }
+
+    void flush()
+    {
+        if (!file)
+            return;
+
+        if (!buffer.empty())
+            std::fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+
+    std::FILE* file;
+    std::string buffer{};
+};
+
+// Read-only private mapping of a whole file.
+struct mapped_file
+{
+    static map_result open(const char* path);
+    static map_result open(int fd);
+
+    mapped_file(mapped_file&& other) noexcept
+        : data(std::exchange(other.data, nullptr)), size(std::exchange(other.size, 0)) {}
+    mapped_file& operator=(mapped_file&&) = delete;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if (data)
+            ::munmap(data, size);
+    }
+
+    std::string_view contents() const
+    {
+        return data ? std::string_view{ static_cast<const char*>(data), size } : std::string_view{};
+    }
+
+private:
+    mapped_file(void* d, std::size_t s) : data(d), size(s) {}
+
+    void* data;
+    std::size_t size;
+};
+
+// Replaces the file at path with contents.
+std::expected<void, io_error> write_file(const char* path, std::string_view contents);
+
+// Calls f for every newline-terminated line in contents (without the '\n' or a trailing
+// '\r') and returns how much of contents was consumed; an unterminated tail is left over.
+constexpr static inline std::size_t split_lines(const std::string_view contents, auto&& f)
+{
+    auto consumed = std::size_t{ 0 };
+    for(auto end = contents.find('\n'); end != std::string_view::npos; end = contents.find('\n', consumed)) {
+        auto line = contents.substr(consumed, end - consumed);
+        if (line.ends_with('\r'))
+            line.remove_suffix(1);
+
+        f(line);
+        consumed = end + 1;
+    }
+
+    return consumed;
+}
+
+constexpr static inline void for_each_line(const std::string_view contents, auto&& f)
+{
+    const auto consumed = split_lines(contents, f);
+    if (consumed < contents.size())
+        split_lines(std::string{ contents.substr(consumed) } + '\n', f);
+}
+
+// For pipes and terminals, which can't be mapped: reads in chunks and only keeps the
+// unfinished line between reads.
+static inline void for_each_line(std::FILE* file, auto&& f)
+{
+    auto buffer = std::string(output_buffer::capacity, '\0');
+    auto used = std::size_t{ 0 };
+
+    while(true) {
+        if (used == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+        const auto space = std::span{ buffer }.subspan(used);
+        const auto read = std::fread(space.data(), 1, space.size(), file);
+        if (read == 0)
+            break;
+
+        used += read;
+        const auto consumed = split_lines(std::string_view{ buffer }.substr(0, used), f);
+        std::ranges::copy(std::string_view{ buffer }.substr(consumed, used - consumed), buffer.begin());
+        used -= consumed;
+    }
+
+    for_each_line(std::string_view{ buffer }.substr(0, used), f);
+}
+
+// Implementation
+
+inline map_result mapped_file::open(const char* path)
+{
+    const auto fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return map_result{ std::unexpect_t{}, std::format("Cannot open {}.", path) };
+
+    auto result = open(fd);
+    ::close(fd);
+    return result;
+}
+
+inline map_result mapped_file::open(const int fd)
+{
+    struct stat status{};
+    if (::fstat(fd, &status) != 0 || !S_ISREG(status.st_mode))
+        return map_result{ std::unexpect_t{}, "Not a regular file." };
+
+    const auto size = static_cast<std::size_t>(status.st_size);
+    if (size == 0)
+        return mapped_file{ nullptr, 0 };
+
+    auto* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return map_result{ std::unexpect_t{}, "Cannot map file." };
+
+    ::madvise(data, size, MADV_SEQUENTIAL);
+    return mapped_file{ data, size };
+}
+
+inline std::expected<void, io_error> write_file(const char* path, const std::string_view contents)
+{
+    auto* file = std::fopen(path, "wb");
+    if (!file)
+        return std::expected<void, io_error>{ std::unexpect_t{}, std::format("Cannot open {}.", path) };
+
+    const auto written = std::fwrite(contents.data(), 1, contents.size(), file);
+    if (std::fclose(file) != 0 || written != contents.size())
+        return std::expected<void, io_error>{ std::unexpect_t{}, std::format("Cannot write {}.", path) };
+
+    return {};
+}
+
+#pragma GCC diagnostic pop
+
+}
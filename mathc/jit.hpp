@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <initializer_list>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <math.hpp>
+#include <node.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Native backend for hot programs. A program is lowered to a function taking its variables
+// as doubles in program::symbols order, the same contract as batch_evaluator for one row:
+// values are doubles throughout, so integer results only differ from vm::execute beyond 2^53.
+//
+// x86-64 only for now (System V). Stack slot k lives in xmm(k + 2); xmm0/xmm1 carry call
+// arguments. Programs deeper than register_slots, or calling functions without a scalar
+// kernel, are refused and stay on the interpreter.
+
+struct jit_code;
+using jit_result = std::expected<jit_code, compile_error>;
+
+struct jit_code
+{
+    using entry_point = double(*)(const double* variables);
+
+    static jit_result compile(const program& p);
+
+    jit_code(jit_code&& other) noexcept
+        : memory(std::exchange(other.memory, nullptr)), size(std::exchange(other.size, 0)) {}
+    jit_code& operator=(jit_code&&) = delete;
+    jit_code(const jit_code&) = delete;
+    jit_code& operator=(const jit_code&) = delete;
+
+    ~jit_code()
+    {
+        if (memory)
+            ::munmap(memory, size);
+    }
+
+    entry_point entry() const { return std::bit_cast<entry_point>(memory); }
+    double operator()(const std::span<const double> variables) const { return entry()(variables.data()); }
+
+private:
+    jit_code(void* m, std::size_t s) : memory(m), size(s) {}
+
+    void* memory;
+    std::size_t size;
+};
+
+// A program that starts on vm::execute and is compiled to native code once it has been
+// evaluated promote_after times. If jit_code::compile refuses it (user functions, calls of
+// more than one argument, deep stacks) it keeps interpreting, so every program evaluates.
+struct tiered_program
+{
+    program bytecode;
+    std::size_t evaluations{ 0 };
+    std::optional<jit_code> native{};
+    bool native_refused{ false };
+};
+
+struct tiered_evaluator
+{
+    std::size_t promote_after{ 1000 };
+    vm interpreted{};  // variables are bound into it as constants, by the program's symbol ids
+
+    evaluation_result evaluate(tiered_program& p, std::span<const double> variables);
+};
+
+#if defined(__x86_64__)
+
+// Code generation writes raw bytes into mapped memory.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+struct x86_64_assembler
+{
+    constexpr static unsigned register_slots = 14;
+
+    // Base registers for memory operands
+    constexpr static std::uint8_t rsp = 4;
+    constexpr static std::uint8_t rbx = 3;
+
+    // SSE2 scalar double opcodes (0F xx)
+    constexpr static std::uint8_t movsd_load = 0x10;
+    constexpr static std::uint8_t movsd_store = 0x11;
+    constexpr static std::uint8_t movapd = 0x28;
+    constexpr static std::uint8_t addsd = 0x58;
+    constexpr static std::uint8_t mulsd = 0x59;
+    constexpr static std::uint8_t subsd = 0x5C;
+    constexpr static std::uint8_t divsd = 0x5E;
+
+    std::vector<std::uint8_t> code{};
+
+    void bytes(const std::initializer_list<std::uint8_t> b) { code.insert(code.end(), b); }
+
+    void immediate(const std::uint64_t value, const unsigned width)
+    {
+        for(auto i = 0u; i < width; i++)
+            code.emplace_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+
+    // prefix [rex] 0F op modrm(11, dst, src)
+    void sse(const std::uint8_t prefix, const std::uint8_t op, const unsigned dst, const unsigned src)
+    {
+        code.emplace_back(prefix);
+        if (dst >= 8 || src >= 8)
+            code.emplace_back(static_cast<std::uint8_t>(0x40 | (dst >= 8 ? 4 : 0) | (src >= 8 ? 1 : 0)));
+        bytes({ 0x0F, op, static_cast<std::uint8_t>(0xC0 | (dst & 7) << 3 | (src & 7)) });
+    }
+
+    // F2 [rex] 0F op modrm(10, reg, base) [sib] disp32
+    void sse_memory(const std::uint8_t op, const unsigned reg, const std::uint8_t base, const std::uint32_t displacement)
+    {
+        code.emplace_back(0xF2);
+        if (reg >= 8)
+            code.emplace_back(0x44);
+        bytes({ 0x0F, op, static_cast<std::uint8_t>(0x80 | (reg & 7) << 3 | base) });
+        if (base == rsp)
+            code.emplace_back(0x24);
+        immediate(displacement, 4);
+    }
+
+    void load_immediate(const unsigned reg, const double value)
+    {
+        bytes({ 0x48, 0xB8 });  // mov rax, imm64
+        immediate(std::bit_cast<std::uint64_t>(value), 8);
+        // movq xmm, rax
+        bytes({ 0x66, static_cast<std::uint8_t>(0x48 | (reg >= 8 ? 4 : 0)), 0x0F, 0x6E,
+                static_cast<std::uint8_t>(0xC0 | (reg & 7) << 3) });
+    }
+
+    void call(const void* target)
+    {
+        bytes({ 0x48, 0xB8 });  // mov rax, imm64
+        immediate(std::bit_cast<std::uintptr_t>(target), 8);
+        bytes({ 0xFF, 0xD0 });  // call rax
+    }
+
+    void prologue(const std::uint32_t frame)
+    {
+        bytes({ 0x53 });              // push rbx
+        bytes({ 0x48, 0x89, 0xFB });  // mov rbx, rdi
+        bytes({ 0x48, 0x81, 0xEC });  // sub rsp, imm32
+        immediate(frame, 4);
+    }
+
+    void epilogue(const std::uint32_t frame)
+    {
+        bytes({ 0x48, 0x81, 0xC4 });  // add rsp, imm32
+        immediate(frame, 4);
+        bytes({ 0x5B, 0xC3 });        // pop rbx; ret
+    }
+};
+
+static inline double jit_pow(const double base, const double exponent)
+{
+    return math::pow(base, exponent).as_double();
+}
+
+inline jit_result jit_code::compile(const program& p)
+{
+    using as = x86_64_assembler;
+
+    if (p.max_stack_depth > as::register_slots)
+        return jit_result{ std::unexpect_t{}, std::format("Stack depth {} exceeds {} registers.", p.max_stack_depth, as::register_slots) };
+
+    constexpr static auto slot = [](const std::size_t k) { return static_cast<unsigned>(k + 2); };
+    constexpr static auto spill_offset = [](const std::size_t k) { return static_cast<std::uint32_t>(8 * k); };
+    constexpr static auto temporary_offset = [](const std::size_t t) {
+        return static_cast<std::uint32_t>(8 * (as::register_slots + t));
+    };
+
+    // push rbx leaves rsp 16-byte aligned, so the frame keeps it aligned for calls.
+    const auto frame = static_cast<std::uint32_t>((8 * (as::register_slots + p.temporaries) + 15) & ~std::size_t{ 15 });
+
+    auto a = as{};
+    a.prologue(frame);
+
+    // xmm registers are caller-saved: live slots below the call's arguments go to the frame.
+    const auto call = [&](const void* target, const std::size_t top, const std::size_t arguments) {
+        const auto live = top - arguments;
+        for(auto k = 0u; k < live; k++)
+            a.sse_memory(as::movsd_store, slot(k), as::rsp, spill_offset(k));
+        for(auto k = 0u; k < arguments; k++)
+            a.sse(0x66, as::movapd, k, slot(live + k));
+
+        a.call(target);
+
+        a.sse(0x66, as::movapd, slot(live), 0);
+        for(auto k = 0u; k < live; k++)
+            a.sse_memory(as::movsd_load, slot(k), as::rsp, spill_offset(k));
+    };
+
+    auto top = std::size_t{ 0 };
+    for(const auto& i : p.instructions) {
+        switch(i.code) {
+            case opcode::push_constant:
+                a.load_immediate(slot(top++), p.constants[i.operand].promote_to_double());
+                break;
+            case opcode::load_symbol:
+                a.sse_memory(as::movsd_load, slot(top++), as::rbx, static_cast<std::uint32_t>(8 * i.operand));
+                break;
+            case opcode::add: top--; a.sse(0xF2, as::addsd, slot(top - 1), slot(top)); break;
+            case opcode::sub: top--; a.sse(0xF2, as::subsd, slot(top - 1), slot(top)); break;
+            case opcode::mul: top--; a.sse(0xF2, as::mulsd, slot(top - 1), slot(top)); break;
+            case opcode::div: top--; a.sse(0xF2, as::divsd, slot(top - 1), slot(top)); break;
+            case opcode::exp:
+                call(std::bit_cast<const void*>(&jit_pow), top, 2);
+                top--;
+                break;
+            case opcode::call: {
+                const auto& function = p.functions[i.operand];
+                if (i.argument_count != 1 || !function.scalar)
+                    return jit_result{ std::unexpect_t{}, std::format("{} has no scalar kernel.", function.name) };
+
+                call(std::bit_cast<const void*>(function.scalar), top, 1);
+                break;
+            }
+            case opcode::store_temp:
+                a.sse_memory(as::movsd_store, slot(top - 1), as::rsp, temporary_offset(i.operand));
+                break;
+            case opcode::load_temp:
+                a.sse_memory(as::movsd_load, slot(top++), as::rsp, temporary_offset(i.operand));
+                break;
+        }
+    }
+
+    a.sse(0x66, as::movapd, 0, slot(0));
+    a.epilogue(frame);
+
+    // Written while writable, then flipped to executable: never both.
+    const auto size = a.code.size();
+    auto* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return jit_result{ std::unexpect_t{}, "Cannot map code." };
+
+    std::memcpy(memory, a.code.data(), size);
+    if (::mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        ::munmap(memory, size);
+        return jit_result{ std::unexpect_t{}, "Cannot make code executable." };
+    }
+
+    return jit_code{ memory, size };
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+inline jit_result jit_code::compile(const program&)
+{
+    return jit_result{ std::unexpect_t{}, "No native backend for this architecture." };
+}
+
+#endif
+
+inline evaluation_result tiered_evaluator::evaluate(tiered_program& p, const std::span<const double> variables)
+{
+    if (variables.size() != p.bytecode.symbols.size())
+        return make_evaluation_error(std::format("Expected {} variables, got {}.", p.bytecode.symbols.size(), variables.size()));
+
+    if (p.native.has_value())
+        return number{ p.native.value()(variables) };
+
+    if (++p.evaluations >= promote_after && !p.native_refused) {
+        auto native = jit_code::compile(p.bytecode);
+        if (native.has_value()) {
+            p.native.emplace(std::move(native.value()));
+            return number{ p.native.value()(variables) };
+        }
+
+        p.native_refused = true;
+    }
+
+    for(auto v = 0uz; v < variables.size(); v++) {
+        const auto value = make_node<constant_node>(number::from_double(variables[v]));
+        if (p.bytecode.symbol_ids.empty())
+            interpreted.insert_symbol(p.bytecode.symbols[v], value);
+        else
+            interpreted.insert_symbol(p.bytecode.symbol_ids[v], value);
+    }
+
+    return interpreted.execute(p.bytecode);
+}
+
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <cassert>
+#include <optional>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include <scan.hpp>
+#include <stats.hpp>
 #include <token.hpp>
 
 namespace mathc
@@ -12,12 +15,6 @@ namespace mathc
 
 using namespace std::string_view_literals;
 
-constexpr static bool is_number(const char c)      { return c >= '0' && c <= '9'; }
-constexpr static bool is_whitespace(const char c)  { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
-constexpr static bool is_operation(const char c)   { return c == '*' || c == '/' || c == '+' || c == '-' || c == '^'; }
-constexpr static bool is_paren(const char c)       { return c == '(' || c == ')'; }
-constexpr static bool is_comma(const char c)       { return c == ','; }
-
 struct lexer
 {
     std::string_view buffer{};
@@ -31,10 +28,7 @@ struct lexer
     [[nodiscard]] constexpr inline bool consume() { index++; return can_consume(); }
 
     [[nodiscard]] constexpr inline bool consume_whitespace() {
-        while(is_whitespace(current())) {
-            if (!consume())
-                return false;
-        }
+        index = skip_whitespace(buffer, index);
         return can_consume();
     }
 
@@ -46,14 +40,17 @@ struct lexer
     constexpr token parse_comma_token();
 
     constexpr void lex();
+    constexpr std::optional<token> next();
 
     constexpr static std::vector<token> lex(std::string_view buffer);
+    constexpr static lexer stream(std::string_view buffer);
 private:
     lexer() = default;
 };
 
 constexpr inline std::vector<token> lexer::lex(const std::string_view buffer)
 {
+    const auto timer = stage_timer{ pipeline_stage::lex };
     if (buffer.size() == 0)
         return {};
 
@@ -63,16 +60,28 @@ constexpr inline std::vector<token> lexer::lex(const std::string_view buffer)
     return l.tokens;
 }
 
+constexpr inline lexer lexer::stream(const std::string_view buffer)
+{
+    lexer l;
+    l.buffer = auto{ buffer };
+    return l;
+}
+
 constexpr inline void lexer::lex()
 {
-    while(true) {
-        if (!can_consume())
-            return;
-        if (!consume_whitespace())
-            return;
+    while(auto t = next())
+        tokens.emplace_back(t.value());
+}
 
-        tokens.emplace_back(parse_token());
-    }
+constexpr inline std::optional<token> lexer::next()
+{
+    if (!can_consume())
+        return {};
+    if (!consume_whitespace())
+        return {};
+
+    count_stat(&pipeline_stats::tokens);
+    return parse_token();
 }
 
 constexpr inline token lexer::parse_token()
@@ -104,23 +113,13 @@ constexpr inline token lexer::parse_operation_token()
     const auto current = current_iterator();
     const auto _ = consume();
 
-    return { token_type_from_char(*current), { current, 1 }, false, index };
+    return { token_type_from_char(*current), { current, std::next(current) }, false, index };
 }
 
 constexpr inline token lexer::parse_alpha_token()
 {
     const auto start = current_iterator();
-    if (!consume())
-        return { token_type::alpha, { start, current_iterator() }, false, index };
-
-    do {
-        const auto current_char = current();
-        if (is_whitespace(current_char) ||
-            is_paren(current_char) ||
-            is_operation(current_char) ||
-            is_comma(current_char))
-            return { token_type::alpha, { start, current_iterator() }, false, index };
-    } while(consume());
+    index = find_delimiter(buffer, index + 1);
 
     return { token_type::alpha, { start, current_iterator() }, false, index };
 }
@@ -129,13 +128,10 @@ constexpr inline token lexer::parse_number_literal_token()
 {
     const auto start = current_iterator();
 
-    bool has_seen_decimal = false;
-    while(is_number(current()) || (current() == '.' && !has_seen_decimal)) {
-        if (current() == '.')
-            has_seen_decimal = true;
-        if (!consume())
-            break;
-    }
+    index = skip_digits(buffer, index);
+    const auto has_seen_decimal = can_consume() && current() == '.';
+    if (has_seen_decimal)
+        index = skip_digits(buffer, index + 1);
 
     return { token_type::number_literal, { start, current_iterator() }, has_seen_decimal, index };
 }
@@ -147,8 +143,8 @@ constexpr inline token lexer::parse_paren_token()
     const auto _ = consume();
 
     switch(current_token) {
-        case '(': return { token_type::paren_open, { current, 1 }, false, index };
-        case ')': return { token_type::paren_close, { current, 1 }, false, index };
+        case '(': return { token_type::paren_open, { current, std::next(current) }, false, index };
+        case ')': return { token_type::paren_close, { current, std::next(current) }, false, index };
     }
 
     std::unreachable();
@@ -161,7 +157,7 @@ constexpr inline token lexer::parse_comma_token()
     const auto _ = consume();
 
     switch(current_token) {
-        case ',': return { token_type::comma, { current, 1 }, false, index };
+        case ',': return { token_type::comma, { current, std::next(current) }, false, index };
     }
 
     std::unreachable();
@@ -1,81 +1,656 @@
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <span>
+#include <string>
 #include <string_view>
 #include <utility>
 #include <variant>
 
+#include <ast.hpp>
+#include <batch.hpp>
+#include <cache.hpp>
+#include <compiled.hpp>
+#include <dag.hpp>
+#include <gradient.hpp>
+#include <image.hpp>
 #include <interpreter.hpp>
+#include <io.hpp>
+#include <jit.hpp>
 #include <lexer.hpp>
+#include <model.hpp>
+#include <parallel.hpp>
 #include <parser.hpp>
+#include <pipeline.hpp>
+#include <quaternion.hpp>
+#include <rotation.hpp>
+#include <rewrite.hpp>
+#include <server.hpp>
+#include <stats.hpp>
 #include <token.hpp>
+#include <typed.hpp>
+#include <workspace.hpp>
 
 using namespace mathc;
 
 static void print_tree(const node& root_node)
 {
-    if(std::holds_alternative<op_node>(root_node)) {
-        const auto& op = std::get<op_node>(root_node);
-        std::print(stderr, "(");
+    auto text = std::string{};
+    format_tree(text, root_node);
+    std::println(stderr, "{}", text);
+}
 
-        if (op.left.get())
-            print_tree(*op.left);
+[[maybe_unused]] constexpr static auto run_tree = [](const node& n, mathc::vm& vm) { return interpreter::run(n, vm); };
+[[maybe_unused]] constexpr static auto simplify_tree = [](const node& n, mathc::vm& vm) { return interpreter::simplify(n, vm); };
 
-        std::print(stderr, "{}", operation_type_to_string(op.type));
+[[maybe_unused]]
+consteval static auto evaluate(const std::string_view source, auto&& evaluator, mathc::vm vm = {})
+{
+    const auto vec = lexer::lex(source);
+    assert(vec.size() > 0);
 
-        if (op.right.get())
-            print_tree(*op.right);
+    const auto node_result = parser::parse(vec);
+    assert(node_result.has_value());
 
-        std::print(stderr, ")");
-        return;
-    }
+    const auto& node = node_result.value();
+    return evaluator(node, vm);
+}
 
-    else if (std::holds_alternative<constant_node>(root_node)) {
-        const auto& op = std::get<constant_node>(root_node);
-        std::print(stderr, "{}", op.value);
-        return;
-    }
+#ifndef NO_TEST
+consteval static bool test_arena_equals(const std::string_view source, auto v)
+{
+    auto tree = ast{};
+    auto vm = mathc::vm{};
+    const auto root = arena_parser::parse(source, tree).value();
 
-    else if(std::holds_alternative<symbol_node>(root_node)) {
-        const auto& op = std::get<symbol_node>(root_node);
-        std::print(stderr, "{}", op.value);
-        return;
-    }
+    const auto copied = copy_node(tree, root);
+    return std::get<number>(interpreter::run(tree, root, vm).value()).approx_equals(v) &&
+           std::get<number>(interpreter::simplify(tree, root, vm).value()).approx_equals(v) &&
+           std::get<number>(interpreter::simplify(copied, vm).value()).approx_equals(v);
+}
 
-    else if(std::holds_alternative<function_call_node>(root_node)) {
-        const auto& op = std::get<function_call_node>(root_node);
-        std::print(stderr, "{}(", op.function_name);
-        for(auto i = 0u; i < op.arguments.size(); i++) {
-            const auto& argument = op.arguments[i];
-            print_tree(argument);
-            if (i != op.arguments.size() - 1)
-                std::print(stderr, ", ");
-        }
-        std::print(stderr, ")");
-        return;
+consteval static bool test_equals(const std::string_view source, auto v)
+{
+    return std::get<number>(evaluate(source, run_tree).value()).approx_equals(v) &&
+           std::get<number>(evaluate(source, simplify_tree).value()).approx_equals(v) &&
+           test_arena_equals(source, v);
+}
+
+consteval static bool test_parse_error(const std::string_view source, const std::string_view token_value)
+{
+    const auto streamed = parser::parse(source);
+    const auto buffered = parser::parse(lexer::lex(source));
+    return !streamed.has_value() && streamed.error().token.value == token_value &&
+           !buffered.has_value() && buffered.error().token.value == token_value;
+}
+
+consteval static bool test_arena_residual_is_shared(const std::string_view source)
+{
+    auto tree = ast{};
+    auto vm = mathc::vm{};
+    const auto root = arena_parser::parse(lexer::lex(source), tree).value();
+    const auto size = tree.size();
+
+    const auto result = interpreter::simplify(tree, root, vm).value();
+    return std::get<node_index>(result) == root && tree.size() == size;
+}
+
+consteval static bool test_equals_with(const std::string_view source,
+                                       std::initializer_list<std::pair<std::string_view, number>> symbols,
+                                       auto v)
+{
+    auto vm = mathc::vm{};
+    for(const auto& [symbol, value] : symbols)
+        vm.insert_symbol(symbol, make_node<constant_node>(value));
+
+    const auto program = compiler::compile(parser::parse(lexer::lex(source)).value()).value();
+    return vm.execute(program).value().approx_equals(v) &&
+           std::get<number>(evaluate(source, simplify_tree, std::move(vm)).value()).approx_equals(v);
+}
+
+consteval static bool test_equals_interned(const std::string_view source,
+                                           std::initializer_list<std::pair<std::string_view, number>> symbols,
+                                           auto v)
+{
+    auto vm = mathc::vm{};
+    for(const auto& [symbol, value] : symbols)
+        vm.insert_symbol(symbol, make_node<constant_node>(value));
+
+    const auto root = parser::parse(source, vm.symbols).value();
+    return std::get<number>(interpreter::run(root, vm).value()).approx_equals(v) &&
+           std::get<number>(interpreter::simplify(root, vm).value()).approx_equals(v);
+}
+
+// A binding's program is compiled once and kept; it still reads the symbols it names as
+// they are now, and rebinding it or redefining a function compiles it again.
+consteval static bool test_binding_programs()
+{
+    auto vm = mathc::vm{};
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(3)));
+    vm.insert_symbol("y", parser::parse("x * 2", vm.symbols).value());
+    const auto program = compiler::compile(parser::parse("y + 1", vm.symbols).value(), vm.symbols).value();
+    const auto first = vm.execute(program);
+
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(5)));
+    const auto reread = vm.execute(program);
+
+    vm.insert_symbol("y", parser::parse("x - 1", vm.symbols).value());
+    const auto rebound = vm.execute(program);
+
+    vm.define_function({ .name = "step", .func = [](const std::span<number> args) {
+        return make_execution_result<number>(args[0] + number::from_int(1));
+    } });
+    vm.insert_symbol("y", parser::parse("step(x)", vm.symbols, vm.functions).value());
+    const auto called = vm.execute(program);
+
+    vm.define_function({ .name = "step", .func = [](const std::span<number> args) {
+        return make_execution_result<number>(args[0] + number::from_int(2));
+    } });
+    const auto redefined = vm.execute(program);
+
+    return first.value() == 7 && reread.value() == 11 && rebound.value() == 5 && called.value() == 7 &&
+           redefined.value() == 8 && !vm.execute(compiler::compile(parser::parse("z").value()).value()).has_value();
+}
+
+consteval static bool test_symbol_table(const std::size_t count)
+{
+    constexpr static auto name_of = [](std::size_t i) {
+        auto name = std::string{};
+        do { name += static_cast<char>('a' + i % 26); i /= 26; } while(i > 0);
+        return name;
+    };
+
+    auto symbols = symbol_table{};
+    for(auto i = 0u; i < count; i++)
+        if (symbols.intern(name_of(i)) != i)
+            return false;
+
+    for(auto i = 0u; i < count; i++)
+        if (symbols.find(name_of(i)) != i || symbols.intern(name_of(i)) != i)
+            return false;
+
+    return symbols.size() == count && !symbols.find("not a symbol").has_value();
+}
+
+consteval static bool test_batch(const std::size_t rows)
+{
+    const auto program = compiler::compile(parser::parse("2x^2 + 3y - sqrt(z)").value()).value();
+
+    std::vector<double> x, y, z, output(rows);
+    for(auto r = 0u; r < rows; r++) {
+        x.emplace_back(static_cast<double>(r) * 0.5);
+        y.emplace_back(static_cast<double>(r) * 2.0);
+        z.emplace_back(static_cast<double>(r * r));
     }
 
-    std::unreachable();
+    const auto columns = std::array<std::span<const double>, 3>{ x, y, z };
+    auto evaluator = batch_evaluator{};
+    if (!evaluator.evaluate(program, columns, output).has_value())
+        return false;
+
+    for(auto r = 0u; r < rows; r++)
+        if (!number::from_double(output[r]).approx_equals(2 * x[r] * x[r] + 3 * y[r] - static_cast<double>(r)))
+            return false;
+
+    return !evaluator.evaluate(program, std::span{ columns }.first(2), output).has_value();
 }
 
-[[maybe_unused]]
-consteval static auto evaluate(const std::string_view source)
+consteval static bool test_dag(const std::string_view source,
+                               std::initializer_list<std::pair<std::string_view, number>> symbols,
+                               const std::size_t deduplicated,
+                               auto v)
 {
-    const auto vec = lexer::lex(source);
-    assert(vec.size() > 0);
+    auto vm = mathc::vm{};
+    for(const auto& [symbol, value] : symbols)
+        vm.insert_symbol(symbol, make_node<constant_node>(value));
 
-    const auto node_result = parser::parse(vec);
-    assert(node_result.has_value());
+    const auto root = parser::parse(source).value();
+    auto shared = dag_builder::build(root);
+
+    const auto tree_program = compiler::compile(root).value();
+    const auto dag_program = compiler::compile(shared.tree, shared.root).value();
+
+    return shared.deduplicated == deduplicated &&
+           dag_program.temporaries > 0 &&
+           dag_program.instructions.size() < tree_program.instructions.size() &&
+           vm.execute(dag_program).value().approx_equals(v) &&
+           std::get<number>(interpreter::run(shared.tree, shared.root, vm).value()).approx_equals(v) &&
+           std::get<number>(interpreter::simplify(shared.tree, shared.root, vm).value()).approx_equals(v);
+}
+
+// Deeper than the constant evaluator's call depth limit, which a recursive parser would hit.
+consteval static bool test_deep_nesting(const std::size_t depth)
+{
+    auto source = std::string(depth, '(') + "1";
+    for(auto i = 0u; i < depth; i++)
+        source += "+sqrt(1))";
+
+    auto tree = ast{};
+    const auto root = arena_parser::parse(source, tree);
+    return root.has_value() && tree.size() == 1 + 3 * depth && tree[root.value()].type == flat_node_type::op;
+}
+
+// Both representations, bound (reduces to a number) and unbound (leaves a residual).
+consteval static bool test_deep_simplify(const std::size_t depth)
+{
+    auto source = std::string(depth, '(') + "x";
+    for(auto i = 0u; i < depth; i++)
+        source += "+sqrt(4))";
 
-    const auto& node = node_result.value();
     auto vm = mathc::vm{};
+    auto tree = ast{};
+    const auto root = arena_parser::parse(source, tree, vm.symbols).value();
+    const auto parsed = parser::parse(source, vm.symbols).value();
+
+    const auto residual = interpreter::simplify(tree, root, vm).value();
+    const auto residual_node = interpreter::simplify(parsed, vm).value();
+
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(1)));
+    const auto value = interpreter::simplify(tree, root, vm).value();
+    const auto value_node = interpreter::simplify(parsed, vm).value();
 
-    return interpreter::simplify(node, vm);
+    return std::get<node_index>(residual) == root && std::holds_alternative<node>(residual_node) &&
+           std::get<number>(value).approx_equals(1 + 2 * static_cast<int>(depth)) &&
+           std::get<number>(value_node).approx_equals(1 + 2 * static_cast<int>(depth)) &&
+           vm.simplify_tasks.empty() && vm.simplify_values.empty();
 }
 
-#ifndef NO_TEST
-consteval static bool test_equals(const std::string_view source, auto v)
+// Both representations compile at that depth too, to programs that give the same value.
+consteval static bool test_deep_compile(const std::size_t depth)
+{
+    auto source = std::string(depth, '(') + "x";
+    for(auto i = 0u; i < depth; i++)
+        source += "+sqrt(4))";
+
+    auto vm = mathc::vm{};
+    auto tree = ast{};
+    const auto root = arena_parser::parse(source, tree, vm.symbols).value();
+    const auto parsed = parser::parse(source, vm.symbols).value();
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(1)));
+
+    const auto flat = compiler::compile(tree, root, vm.symbols);
+    const auto nested = compiler::compile(parsed, vm.symbols);
+    return flat.has_value() && nested.has_value() &&
+           flat.value().instructions.size() == 1 + 3 * depth && nested.value().instructions.size() == 1 + 3 * depth &&
+           vm.execute(flat.value()).value().approx_equals(1 + 2 * static_cast<int>(depth)) &&
+           vm.execute(nested.value()).value().approx_equals(1 + 2 * static_cast<int>(depth));
+}
+
+// Integers keep their kind through int-only arithmetic; / always promotes, and integers
+// too wide for the boxed payload become doubles.
+consteval static bool test_number()
+{
+    const auto two = number::from_int(2);
+    const auto half = number::from_double(0.5);
+    const auto wide = number::from_int(number::max_int) + two;
+    // The NaN x86 produces for 0.0 / 0.0, which shares its bit pattern with the integer tag.
+    const auto nan = number::from_double(std::bit_cast<double>(std::uint64_t{ 0xfff8'0000'0000'0000 }));
+
+    return (two * two).is_int() && (two * two) == 4 && (two ^ two) == 4 &&
+           number::from_int(-7).as_int() == -7 && number::from_int(number::min_int).as_int() == number::min_int &&
+           (two / two).is_double() && (two / two) == 1.0 && (two + half).is_double() && (two ^ half).is_double() &&
+           wide.is_double() && wide.approx_equals(static_cast<double>(number::max_int) + 2) &&
+           nan.is_double() && !(nan == 0.0);
+}
+
+template<fixed_string source>
+consteval static bool test_compiled(const double x, const double y, const double v)
+{
+    return compile<source>.arity == 2 && number::from_double(compile<source>(x, y)).approx_equals(v) &&
+           test_equals_with(source.view(), { { "x", number::from_double(x) }, { "y", number::from_double(y) } }, v);
+}
+
+constexpr static execution_result user_hypot(const std::span<number> args)
+{
+    const auto x = args[0].promote_to_double();
+    const auto y = args[1].promote_to_double();
+    return make_execution_result<number>(math::sqrt(x * x + y * y));
+}
+
+// A function defined on the vm resolves at parse time and is called with its declared arity
+// by every evaluator; without the vm's table it isn't a function.
+consteval static bool test_user_function()
+{
+    auto vm = mathc::vm{};
+    const auto id = vm.define_function({ .name = "hypot", .func = user_hypot, .arity = 2 });
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(3)));
+
+    auto tree = ast{};
+    const auto root = arena_parser::parse("hypot(x, 4) + 1", tree, vm.symbols, vm.functions).value();
+    const auto parsed = parser::parse("hypot(x, 4) + 1", vm.symbols, vm.functions).value();
+    const auto wrong_arity = parser::parse("hypot(x)", vm.symbols, vm.functions).value();
+
+    return id == builtin_functions.size() && tree[tree[root].first].function == id &&
+           std::get<number>(interpreter::run(tree, root, vm).value()).approx_equals(6) &&
+           std::get<number>(interpreter::simplify(tree, root, vm).value()).approx_equals(6) &&
+           std::get<number>(interpreter::run(parsed, vm).value()).approx_equals(6) &&
+           std::get<number>(interpreter::simplify(parsed, vm).value()).approx_equals(6) &&
+           !interpreter::run(wrong_arity, vm).has_value() && !interpreter::simplify(wrong_arity, vm).has_value() &&
+           !parser::parse("hypot(x, 4)").has_value();
+}
+
+// Rebinding an input re-evaluates only its transitive dependents; cycles become errors.
+consteval static bool test_model()
+{
+    auto m = model{};
+    const auto define = [&](const std::string_view symbol, const std::string_view source) {
+        m.define(symbol, parser::parse(source, m.vm.symbols, m.vm.functions).value());
+    };
+    const auto value_of = [&](const std::string_view symbol) {
+        return std::get<number>(m.result(symbol)->value());
+    };
+
+    define("a", "1");
+    define("b", "a + 1");
+    define("c", "b * a + sqrt(a * a)");
+    define("d", "5");
+    define("e", "f");
+    if (m.update() != 5 || !value_of("c").approx_equals(3) || !std::holds_alternative<node>(m.result("e")->value()))
+        return false;
+
+    define("a", "2");
+    if (m.update() != 3 || !value_of("c").approx_equals(8) || !value_of("d").approx_equals(5))
+        return false;
+
+    define("f", "3");
+    if (m.update() != 2 || !value_of("e").approx_equals(3))
+        return false;
+
+    define("a", "c");
+    return m.update() == 3 && !m.result("a")->has_value() && !m.result("c")->has_value() && m.update() == 0;
+}
+
+consteval static bool test_normalize()
+{
+    return expression_cache::normalize("  2 * x +\tsqrt( y )  ") == "2*x+sqrt(y)" &&
+           expression_cache::normalize("x y + 1 2") == "x y+1 2" &&
+           expression_cache::normalize("") == "";
+}
+
+consteval static bool test_parallel(const std::size_t terms)
+{
+    auto source = std::string{};
+    for(auto i = 0uz; i < terms; i++)
+        source += "(x * 3 + sqrt(4) * (x - 1)) + ";
+
+    const auto agrees = [&](const std::string_view tail) {
+        auto tree = ast{};
+        auto vm = mathc::vm{};
+        vm.insert_symbol("x", make_node<constant_node>(number::from_int(2)));
+        const auto root = arena_parser::parse(source + std::string{ tail }, tree).value();
+
+        auto sequential_tree = tree;
+        const auto sequential = interpreter::simplify(sequential_tree, root, vm);
+
+        auto evaluator = parallel_evaluator{};
+        evaluator.threshold = 0;
+        evaluator.grain = 16;
+        evaluator.threads = 1;
+        const auto parallel = evaluator.simplify(tree, root, vm);
+        if (evaluator.subtrees < terms || sequential.has_value() != parallel.has_value())
+            return false;
+
+        if (!sequential.has_value())
+            return sequential.error().error == parallel.error().error;
+        if (std::holds_alternative<number>(sequential.value()))
+            return std::get<number>(parallel.value()).approx_equals(std::get<number>(sequential.value()));
+
+        return std::holds_alternative<node_index>(parallel.value()) && tree.size() == sequential_tree.size();
+    };
+
+    return agrees("1") && agrees("y") && agrees("nope(1) + missing(2)");
+}
+
+consteval static bool test_workspace()
+{
+    auto w = workspace{};
+    auto vm = mathc::vm{};
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(3)));
+
+    auto stages = 0uz;
+    w.context = &stages;
+    w.on_stage = [](workspace_stage, void* context) { (*static_cast<std::size_t*>(context))++; };
+
+    const auto first = w.evaluate("x * 2 + sqrt(16, 2)", vm);
+    const auto second = w.evaluate("(x - 1) * sqrt(x * 3)", vm);
+    const auto unbound = w.evaluate("x + y", vm);
+    const auto unparsed = w.evaluate("1 +", vm);
+
+    return !first.has_value() && first.error().code == workspace_error_code::compile &&
+           second.has_value() && second.value().approx_equals(6) &&
+           !unbound.has_value() && unbound.error().code == workspace_error_code::unbound_symbol &&
+           unbound.error().detail == "y" &&
+           !unparsed.has_value() && unparsed.error().token.value == "+" &&
+           stages == 2 + 3 + 3 + 1 &&
+           w.evaluate("2 ^ 10", vm).value() == 1024;
+}
+
+consteval static bool test_math()
+{
+    constexpr static auto within = [](const double value, const double expected, const std::int64_t ulps) {
+        const auto distance = std::bit_cast<std::int64_t>(value) - std::bit_cast<std::int64_t>(expected);
+        return distance >= -ulps && distance <= ulps;
+    };
+
+    return within(math::detail::sqrt(2.0), 1.4142135623730951, 1) &&
+           within(math::detail::sqrt(5e-324), 2.2227587494850775e-162, 1) &&
+           within(math::detail::exp(1.0), 2.718281828459045, 1) &&
+           within(math::detail::exp(-740.0), 4.2e-322, 1) &&
+           within(math::detail::ln(10.0), 2.302585092994046, 2) &&
+           within(math::detail::ln(1e-310), -713.8013788281542, 2) &&
+           within(math::detail::log2(3.0), 1.584962500721156, 3) &&
+           within(math::detail::pow(3.7, 2.5), 26.333240780428074, 3) &&
+           math::detail::log2(1024.0) == 10.0 && math::detail::ln(1.0) == 0.0 &&
+           math::detail::pow(-2.0, 3.0) == -8.0 && math::detail::pow(2.0, -2.0) == 0.25;
+}
+
+consteval static bool test_gradient()
 {
-    return std::get<number>(evaluate(source).value()).approx_equals(v);
+    constexpr static auto near = [](const double value, const double expected) {
+        return value - expected < 1e-12 && expected - value < 1e-12;
+    };
+
+    auto vm = mathc::vm{};
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(4)));
+    vm.insert_symbol("y", make_node<constant_node>(number::from_int(3)));
+
+    auto t = tape{};
+    const auto program = compiler::compile(parser::parse("x^2 * y + sqrt(x) - ln(y) / 2").value()).value();
+    const auto g = t.gradient(program, vm).value();
+
+    const auto shared = compiler::compile(parser::parse("(x + y) * (x + y) + 2 ^ y").value()).value();
+    const auto h = t.gradient(shared, vm).value();
+
+    const auto unbound = compiler::compile(parser::parse("x * z").value()).value();
+
+    return near(g.value, 50.0 - math::detail::ln(3.0) / 2) && g.partials.size() == 2 &&
+           near(g.partials[0], 24.25) && near(g.partials[1], 16.0 - 1.0 / 6) &&
+           near(h.value, 57.0) && near(h.partials[0], 14.0) &&
+           near(h.partials[1], 14.0 + 8.0 * math::detail::ln(2.0)) &&
+           !t.gradient(unbound, vm).has_value();
+}
+
+consteval static bool test_image()
+{
+    auto writer = image_writer{};
+    writer.add(compiler::compile(parser::parse("x * 2 + sqrt(y)").value()).value(), "x * 2 + sqrt(y)");
+    writer.add(compiler::compile(parser::parse("ln(x) - 1").value()).value(), "ln(x) - 1");
+
+    const auto bytes = writer.finish();
+    const auto header = std::bit_cast<image_header>([&] {
+        auto prefix = std::array<char, sizeof(image_header)>{};
+        std::ranges::copy(std::string_view{ bytes }.substr(0, prefix.size()), prefix.begin());
+        return prefix;
+    }());
+
+    return writer.size() == 2 && bytes.size() % 8 == 0 && header.magic == image_magic &&
+           header.version == image_version && header.program_count == 2 &&
+           header.symbol_count == 2 && header.function_count == 2 && header.names + header.names_size <= bytes.size();
+}
+
+consteval static bool test_request()
+{
+    const auto r = parse_request("x = 2 * y\r\n  y=3\n\nx + y\n sqrt(x)");
+    const auto header = encode_frame_header(70000, 7);
+    const auto decoded = decode_frame_header(std::string_view{ header.data(), header.size() });
+
+    return r.bindings.size() == 2 && r.bindings[0].symbol == "x" && r.bindings[0].value == " 2 * y" &&
+           r.bindings[1].symbol == "y" && r.expressions.size() == 2 && r.expressions[0] == "x + y" &&
+           r.expressions[1] == "sqrt(x)" && decoded.length == 70000 && decoded.id == 7 && header[2] == 1;
+}
+
+consteval static bool test_scan()
+{
+    constexpr static auto source = " \t 12.5e + sqrt_2(x), 7"sv;
+
+    return skip_whitespace(source, 0) == 3 && skip_digits(source, 3) == 5 && find_delimiter(source, 11) == 17 &&
+           skip_whitespace(source, source.size()) == source.size() && find_delimiter(source, 22) == source.size() &&
+           lexer::lex(source).size() == 9;
+}
+
+// Rewritten, source has the structure of expected, which is already canonical.
+consteval static bool test_rewrite(const std::string_view source, const std::string_view expected)
+{
+    auto tree = ast{};
+    auto canonical = rewriter{};
+    const auto root = canonical.rewrite(tree, arena_parser::parse(lexer::lex(source), tree).value());
+    const auto fired = canonical.rewrites;
+
+    const auto wanted = arena_parser::parse(lexer::lex(expected), tree).value();
+    return fired > 0 && canonical.same(tree, root, wanted) && canonical.rewrite(tree, wanted) == wanted &&
+           canonical.rewrites == 0;
+}
+
+consteval static bool test_rewrite_unchanged(const std::string_view source)
+{
+    auto tree = ast{};
+    auto canonical = rewriter{};
+    const auto root = arena_parser::parse(lexer::lex(source), tree).value();
+    return canonical.rewrite(tree, root) == root && canonical.rewrites == 0;
+}
+
+consteval static bool test_is_residual(const std::string_view source)
+{
+    return std::holds_alternative<node>(evaluate(source, run_tree).value());
+}
+
+// i j = k; a quarter turn about z takes x to y, and the arrays and the columns batch_evaluator
+// writes rotate as single values do.
+consteval static bool test_quaternion(const std::size_t rows)
+{
+    const auto half = math::sqrt(0.5).promote_to_double();
+    const auto quarter_turn = quaternion{ half, 0.0, 0.0, half };
+    const auto near = [](const vec3& a, const vec3& b) { return (a - b).dot(a - b) < 1e-24; };
+
+    const auto i = quaternion{ 0.0, 1.0, 0.0, 0.0 };
+    const auto j = quaternion{ 0.0, 0.0, 1.0, 0.0 };
+    if (i * j != quaternion{ 0.0, 0.0, 0.0, 1.0 } || j * i != quaternion{ 0.0, 0.0, 0.0, -1.0 } ||
+        !near(quarter_turn.rotate(vec3{ 1.0, 0.0, 0.0 }), vec3{ 0.0, 1.0, 0.0 }) ||
+        quarter_turn.rotate(vec4{ 0.0, 0.0, 2.0, 7.0 }).w != 7.0 ||
+        [&] { const auto d = (quarter_turn * quarter_turn.conjugate() - quaternion{}).as_vec4(); return d.dot(d); }() > 1e-24)
+        return false;
+
+    auto rotations = std::vector<quaternion>{};
+    auto points = std::vector<vec3>{};
+    auto composed = std::vector<quaternion>{};
+    for(auto row = 0uz; row < rows; row++) {
+        const auto q = quaternion{ 1.0, 0.1 * static_cast<double>(row % 7), 0.5, -0.25 }.normalized();
+        rotations.emplace_back(q);
+        points.emplace_back(static_cast<double>(row), 1.0, -2.0);
+        composed.emplace_back(quarter_turn);
+    }
+
+    auto expected = points;
+    for(auto row = 0uz; row < rows; row++)
+        expected[row] = rotations[row].rotate(points[row]);
+
+    auto evaluator = rotation_evaluator{};
+    if (!evaluator.rotate(rotations, points).has_value() || !evaluator.multiply(composed, rotations).has_value())
+        return false;
+
+    // Short rotations are refused before anything is read or written.
+    auto untouched = points;
+    if (rows > 0 &&
+        (evaluator.rotate(std::span{ rotations }.first(rows - 1), untouched).has_value() ||
+         evaluator.multiply(composed, std::span{ rotations }.first(rows - 1)).has_value() ||
+         untouched != points))
+        return false;
+
+    for(auto row = 0uz; row < rows; row++)
+        if (!near(points[row], expected[row]) || composed[row] != quarter_turn * rotations[row])
+            return false;
+
+    // Components over the columns t and x, turned about z a quarter each row.
+    auto formula_evaluator = rotation_formula_evaluator{};
+    const auto formula = rotation_compiler::compile("rotate(quat(t, 0, 0, t), vec3(x, 2x, 3))");
+    if (!formula.has_value() || formula->symbols != std::vector<std::string>{ "t", "x" } ||
+        rotation_compiler::compile("rotate(quat(1, 0, 0, 0), x)").has_value() ||
+        rotation_compiler::compile("rotate(quat(1, 0, 0), vec3(x, y, z))").has_value())
+        return false;
+
+    auto t = std::vector<double>(rows, half), x = std::vector<double>(rows);
+    for(auto row = 0uz; row < rows; row++)
+        x[row] = static_cast<double>(row);
+
+    auto px = std::vector<double>(rows), py = std::vector<double>(rows), pz = std::vector<double>(rows);
+    const auto columns = std::array{ std::span<const double>{ t }, std::span<const double>{ x } };
+    if (!formula_evaluator.evaluate(formula.value(), columns, { px, py, pz }).has_value() ||
+        formula_evaluator.evaluate(formula.value(), std::span{ columns }.first(1), { px, py, pz }).has_value() ||
+        formula_evaluator.evaluate(formula.value(), columns, { px, py, std::span{ pz }.first(1) }).has_value())
+        return false;
+
+    for(auto row = 0uz; row < rows; row++) {
+        const auto r = static_cast<double>(row);
+        if (!near(vec3{ px[row], py[row], pz[row] }, quarter_turn.rotate(vec3{ r, 2.0 * r, 3.0 })))
+            return false;
+    }
+
+    // One component at a time, from any expression.
+    return test_equals("rotate_y(0.5, 0.5, 0.5, 0.5, 1, 0, 0)", 1) && test_equals("rotate_x(0.5, 0.5, 0.5, 0.5, 1, 0, 0)", 0) &&
+           test_equals("qmul_z(0, 1, 0, 0, 0, 0, 1, 0)", 1) && test_equals("qmul_w(0, 1, 0, 0, 0, 1, 0, 0)", -1);
+}
+
+// Integer-only and double-only formulas keep no tag checks; an operand bound to an expression
+// keeps them where it is used. A rebound symbol or an overflow falls back to vm::execute.
+consteval static bool test_typed()
+{
+    auto vm = mathc::vm{};
+    vm.insert_symbol("x", make_node<constant_node>(number::from_int(3)));
+    vm.insert_symbol("y", make_node<constant_node>(number::from_double(0.5)));
+    vm.insert_symbol("z", parser::parse("x + 1").value());
+
+    const auto specialize = [&](const std::string_view source) {
+        return type_inference::specialize(compiler::compile(parser::parse(source).value()).value(), vm);
+    };
+
+    auto evaluator = typed_evaluator{};
+    const auto agrees = [&](const typed_program& p) {
+        const auto typed = evaluator.execute(p, vm).value();
+        const auto generic = vm.execute(p.generic).value();
+        return typed.is_int() == generic.is_int() && typed.approx_equals(generic.promote_to_double());
+    };
+
+    const auto integers = specialize("x^3 * 2 - x");
+    const auto reals = specialize("x / 2 + sqrt(y) * y");
+    const auto mixed = specialize("z * y + x");
+    const auto overflow = specialize("x^40 * x^40");
+    if (integers.generic_operations != 0 || integers.result != value_type::integer ||
+        evaluator.execute(integers, vm).value() != 51 ||
+        reals.generic_operations != 0 || reals.result != value_type::real || !agrees(reals) ||
+        mixed.generic_operations != 2 || !evaluator.execute(mixed, vm).value().approx_equals(5) ||
+        evaluator.deoptimizations != 0 || !agrees(overflow) || evaluator.deoptimizations != 1)
+        return false;
+
+    vm.insert_symbol("x", make_node<constant_node>(number::from_double(1.5)));
+    return agrees(integers) && evaluator.deoptimizations == 2;
 }
 
 static_assert(test_equals("1+1", 2));
@@ -99,6 +674,7 @@ static_assert(test_equals("1.5^5", 7.59375));
 static_assert(test_equals("1^5", 1));
 static_assert(test_equals("2^2", 4));
 static_assert(test_equals("2^3", 8));
+static_assert(test_equals("3^0", 1));
 static_assert(test_equals("sqrt(4)", 2));
 static_assert(test_equals("sqrt(0)", 0));
 static_assert(test_equals("log2(8)", 3));
@@ -162,48 +738,396 @@ static_assert(test_equals("2.5 * (3.5 + 4.5 * (2 + 3))", 65));
 static_assert(test_equals("(2.5 + 3.5) * (4.5 + 5.5)", 60));
 static_assert(test_equals("(10 + 20) * (30 - 10) / (2 + 3)", 120));
 static_assert(test_equals("2 ^ (3 + 4 * (5 - 2))", 32768));
+static_assert(test_equals("sqrt(16) + log2(8) * 2", 10));
+static_assert(test_equals_with("2x + y", { { "x", number::from_int(3) }, { "y", number::from_int(1) } }, 7));
+static_assert(test_equals_with("x^2 + sqrt(y)", { { "x", number::from_double(1.5) }, { "y", number::from_int(4) } }, 4.25));
+static_assert(test_is_residual("2x + 1"));
+static_assert(test_equals_interned("2x + y*x", { { "x", number::from_int(3) }, { "y", number::from_int(2) } }, 12));
+static_assert(test_symbol_table(1000));
+static_assert(test_batch(batch_evaluator::block_size + 3));
+static_assert(test_arena_residual_is_shared("2x + sqrt(y)"));
+static_assert(test_dag("sqrt(3^2 + 4^2) + sqrt(3^2 + 4^2)*2", {}, 10, 15));
+static_assert(test_dag("sqrt(x^2 + y^2) / sqrt(x^2 + y^2) + x", { { "x", number::from_int(3) }, { "y", number::from_int(4) } }, 10, 4));
+static_assert(test_parse_error("1 +", "+"));
+static_assert(test_parse_error("sqrt(1 2", "2"));
+static_assert(test_parse_error("(1 + 2", "2"));
+static_assert(test_parse_error("2 * (3 + sqrt(4, ))", ")"));
+static_assert(test_deep_nesting(2000));
+static_assert(test_deep_simplify(2000));
+static_assert(test_deep_compile(2000));
+static_assert(test_number());
+static_assert(test_user_function());
+static_assert(test_binding_programs());
+static_assert(test_model());
+static_assert(test_normalize());
+static_assert(test_parallel(64));
+static_assert(test_workspace());
+static_assert(test_math());
+static_assert(test_gradient());
+static_assert(test_image());
+static_assert(test_request());
+static_assert(test_scan());
+static_assert(test_rewrite("2*x*3", "6x"));
+static_assert(test_rewrite("x*-1*-1", "x"));
+static_assert(test_rewrite("x*1 + 0", "x"));
+static_assert(test_rewrite("2x + 3x", "5x"));
+static_assert(test_rewrite("x - x", "0"));
+static_assert(test_rewrite("1 + x + 2", "x + 3"));
+static_assert(test_rewrite("x*y*x", "x^2*y"));
+static_assert(test_rewrite("2x + sqrt(y) - x - sqrt(y*1)", "x"));
+static_assert(test_rewrite("x/y*0", "0.0"));
+static_assert(test_rewrite("(x/y)^0 + 1^(x/2)", "2.0"));
+static_assert(test_rewrite("x/y/1", "x/y"));
+static_assert(test_rewrite("x*0", "0*x"));
+static_assert(test_rewrite_unchanged("x/1"));
+static_assert(test_rewrite_unchanged("x^0"));
+static_assert(test_rewrite_unchanged("1^x"));
+static_assert(test_rewrite_unchanged("0*x"));
+static_assert(test_compiled<"x^2 + 2x*y - sqrt(y)">(3, 4, 31));
+static_assert(test_compiled<"(x + y)^3 / y + ln(x)">(1, 1, 8));
+static_assert(test_typed());
+static_assert(test_quaternion(rotation_evaluator::block_size + 5));
 #endif
 
+struct options
+{
+    bool print_tree{ false };
+    bool cse{ false };
+    bool read_stdin{ false };
+    bool stats{ false };
+    std::size_t threads{ 1 };  // 0: one per hardware thread
+    std::optional<std::size_t> cache{};
+    std::optional<std::string_view> file{};
+    std::optional<std::string_view> image{};
+    std::optional<std::string_view> write_image{};
+    std::optional<std::string_view> serve{};
+    server_settings server{};
+    std::optional<std::string_view> expression{};
+};
+
+// One expression per line against a single vm and ast, so a line allocates as little as
+// the evaluator itself needs. Results (and, when streaming, errors) go to stdout one line
+// per input line.
+struct line_evaluator
+{
+    // Without an output file, results collect in out.buffer.
+    explicit line_evaluator(const options& o, std::FILE* output = stdout) : settings(o), out(output)
+    {
+        if (settings.cache.has_value())
+            cache.emplace(settings.cache.value());
+        if (settings.write_image.has_value())
+            writer.emplace();
+    }
+
+    options settings;
+    mathc::vm vm{};
+    ast tree{};
+    std::optional<expression_cache> cache{};
+    std::optional<image_writer> writer{};
+    rewriter canonical{};
+    output_buffer out;
+    output_buffer errors{ stderr };
+    std::string text{};
+    std::size_t deduplicated{ 0 };
+    std::size_t failed{ 0 };
+
+    void operator()(const std::string_view line)
+    {
+        if (writer.has_value()) {
+            add_to_image(line);
+            return;
+        }
+
+        if (line.empty()) {
+            out.write('\n');
+            return;
+        }
+
+        auto& error_out = settings.expression.has_value() ? errors : out;
+
+        if (cache.has_value() && !settings.cse && !settings.print_tree) {
+            evaluate_cached(line, error_out);
+            return;
+        }
+
+        // --stats lexes up front, so lexing is timed apart from parsing.
+        tree.clear();
+        const auto parsed = settings.stats ? arena_parser::parse(lexer::lex(line), tree, vm.symbols, vm.functions) :
+                                             arena_parser::parse(line, tree, vm.symbols, vm.functions);
+        if (!parsed.has_value()) {
+            write_error(parsed.error(), error_out);
+            return;
+        }
+
+        auto shared = dag{};
+        auto* evaluated = &tree;
+        auto root = parsed.value();
+        if (settings.cse) {
+            shared = dag_builder::build(tree, root);
+            deduplicated += shared.deduplicated;
+            evaluated = &shared.tree;
+            root = shared.root;
+        }
+
+        if (settings.print_tree)
+            print_tree(copy_node(*evaluated, root));
+
+        write_result(*evaluated, interpreter::run(*evaluated, root, vm), error_out);
+    }
+
+    // A repeated line skips the front end: its cached program runs as is, and only a residual
+    // result needs a (copied) tree.
+    void evaluate_cached(const std::string_view line, output_buffer& error_out)
+    {
+        const auto entry = cache->get(line);
+        if (!entry.has_value()) {
+            write_error(entry.error(), error_out);
+            return;
+        }
+
+        const auto& cached = *entry.value();
+        if (const auto value = vm.execute(cached.compiled); value.has_value()) {
+            out.write(value.value());
+            out.write('\n');
+            return;
+        }
+
+        tree = cached.tree;
+        write_result(tree, interpreter::simplify(tree, cached.root, vm), error_out);
+    }
+
+    // Lines that don't compile are reported and left out of the image.
+    void add_to_image(const std::string_view line)
+    {
+        if (line.empty())
+            return;
+
+        tree.clear();
+        const auto parsed = arena_parser::parse(line, tree, vm.symbols, vm.functions);
+        if (!parsed.has_value()) {
+            write_error(parsed.error(), errors);
+            return;
+        }
+
+        const auto compiled = compiler::compile(tree, parsed.value(), vm.symbols, vm.functions);
+        if (!compiled.has_value()) {
+            errors.write(std::format("{}\n", compiled.error().error));
+            failed++;
+            return;
+        }
+
+        writer->add(compiled.value(), line);
+    }
+
+    // Programs run on the mapping; one that doesn't reduce to a number is evaluated again
+    // from its source, for the residual or the error.
+    void run_image(const image& programs)
+    {
+        for(auto i = 0uz; i < programs.size(); i++) {
+            if (const auto value = vm.execute(programs[i]); value.has_value()) {
+                out.write(value.value());
+                out.write('\n');
+            } else {
+                (*this)(programs.source(i));
+            }
+        }
+    }
+
+    // A parse_error or a cache_error: both carry the token and message.
+    void write_error(const auto& error, output_buffer& error_out)
+    {
+        error_out.write(std::format("{} | token: {} {}\n", error.error, error.token.value, token_type_str(error.token.type)));
+        failed++;
+    }
+
+    // A residual is rewritten into its canonical form first.
+    void write_result(ast& evaluated, const flat_execution_result& result, output_buffer& error_out)
+    {
+        if (!result.has_value()) {
+            error_out.write(std::format("{}\n", result.error().error));
+            failed++;
+            return;
+        }
+
+        if (std::holds_alternative<number>(result.value())) {
+            out.write(std::get<number>(result.value()));
+            out.write('\n');
+            return;
+        }
+
+        text.clear();
+        format_tree(text, copy_node(evaluated, canonical.rewrite(evaluated, std::get<node_index>(result.value()))));
+        text += '\n';
+        out.write(text);
+    }
+};
+
+// Mapped inputs are evaluated in chunks on --threads threads, each with its own
+// line_evaluator, and written in input order. --tree, --stats, --cache and --write-image
+// report from a single evaluator and keep the input on one thread.
+static void evaluate_lines(const std::string_view contents, line_evaluator& evaluator)
+{
+    const auto& settings = evaluator.settings;
+    if (settings.threads == 1 || settings.print_tree || settings.stats || settings.cache.has_value() ||
+        settings.write_image.has_value()) {
+        for_each_line(contents, evaluator);
+        return;
+    }
+
+    auto totals = std::mutex{};
+    const auto make = [&] {
+        return [&, worker = std::make_unique<line_evaluator>(settings, nullptr)](const std::string_view chunk) {
+            for_each_line(chunk, *worker);
+
+            const auto lock = std::scoped_lock{ totals };
+            evaluator.failed += std::exchange(worker->failed, 0);
+            evaluator.deduplicated += std::exchange(worker->deduplicated, 0);
+            return std::exchange(worker->out.buffer, {});
+        };
+    };
+
+    auto pipeline = chunk_pipeline{ .threads = settings.threads };
+    pipeline.run(contents, make, [&](const std::string_view output) { evaluator.out.write(output); });
+}
+
 int main(int argc, const char* argv[])
 {
+    auto settings = options{};
+
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
-    if (argc < 2) {
-        std::println("Usage: {} {{expression}}", argv[0]);
-        return 1;
-    }
-    const auto source = std::string_view{ argv[1] };
+    const auto arguments = std::span{ argv, static_cast<std::size_t>(argc) };
     #pragma GCC diagnostic pop
 
-    const auto tokens = lexer::lex(source);
-    // for(const auto& t : tokens)
-    //     std::println(stderr, "{:20} {}", token_type_str(t.type), t.value);
+    for(auto i = 1u; i < arguments.size(); i++) {
+        const auto argument = std::string_view{ arguments[i] };
+        if (argument == "--tree")
+            settings.print_tree = true;
+        else if (argument == "--cse")
+            settings.cse = true;
+        else if (argument == "--stats")
+            settings.stats = true;
+        else if (argument == "-")
+            settings.read_stdin = true;
+        else if (argument == "--file" && i + 1 < arguments.size())
+            settings.file = arguments[++i];
+        else if (argument == "--image" && i + 1 < arguments.size())
+            settings.image = arguments[++i];
+        else if (argument == "--write-image" && i + 1 < arguments.size())
+            settings.write_image = arguments[++i];
+        else if (argument == "--serve" && i + 1 < arguments.size())
+            settings.serve = arguments[++i];
+        else if (argument == "--workers" && i + 1 < arguments.size())
+            settings.server.workers = static_cast<std::size_t>(std::strtoull(arguments[++i], nullptr, 10));
+        else if (argument == "--batch" && i + 1 < arguments.size())
+            settings.server.max_batch = static_cast<std::size_t>(std::strtoull(arguments[++i], nullptr, 10));
+        else if (argument == "--latency" && i + 1 < arguments.size())
+            settings.server.max_latency = std::chrono::microseconds{ std::strtoll(arguments[++i], nullptr, 10) };
+        else if (argument == "--threads" && i + 1 < arguments.size())
+            settings.threads = static_cast<std::size_t>(std::strtoull(arguments[++i], nullptr, 10));
+        else if (argument == "--cache" && i + 1 < arguments.size())
+            settings.cache = static_cast<std::size_t>(std::strtoull(arguments[++i], nullptr, 10));
+        else
+            settings.expression = argument;
+    }
+
+    if (settings.serve.has_value()) {
+        if (settings.cache.has_value())
+            settings.server.cache_capacity = settings.cache.value();
 
-    const auto root_node_result = parser::parse(std::span{ tokens });
-    if (!root_node_result.has_value()) {
-        const auto& error = root_node_result.error();
-        std::println(stderr, "{} | token: {} {}", error.error, error.token.value, token_type_str(error.token.type));
+        auto daemon = server{ settings.server };
+        if (const auto listening = daemon.listen(settings.serve.value()); !listening.has_value()) {
+            std::println(stderr, "{}", listening.error().error);
+            return 1;
+        }
+
+        daemon.run();
+        return 0;
+    }
+
+    const auto inputs = std::ranges::count(std::array{ settings.read_stdin, settings.file.has_value(), settings.expression.has_value(),
+                                                settings.image.has_value() }, true);
+    if (inputs != 1) {
+        std::println("Usage: {} [--tree] [--cse] {{expression}}", arguments[0]);
+        std::println("       {} [--tree] [--cse] [--cache {{n}}] --file {{path}}   one expression per line, memory-mapped", arguments[0]);
+        std::println("       {} [--tree] [--cse] [--cache {{n}}] -                 one expression per line from stdin", arguments[0]);
+        std::println("       {} --image {{path}}                                   every program of an image, memory-mapped", arguments[0]);
+        std::println("       {} --serve {{unix:path|tcp:[address:]port}} [--workers {{n}}] [--batch {{n}}] [--latency {{us}}] [--cache {{n}}]", arguments[0]);
+        std::println("       --threads {{n}} evaluates a mapped file's lines on n threads (0: all), results in order");
+        std::println("       --cache keeps the last n distinct expressions parsed and compiled");
+        std::println("       --write-image {{path}} compiles the expressions into an image instead of evaluating them");
+        std::println("       --stats prints per-stage times and counters (needs -DMATHC_STATS)");
         return 1;
     }
 
-    const auto& root_node = root_node_result.value();
-    print_tree(root_node);
-    std::puts("");
+    if constexpr (!stats_enabled) {
+        if (settings.stats) {
+            std::println(stderr, "--stats needs a build with -DMATHC_STATS.");
+            return 1;
+        }
+    }
 
-    auto vm = mathc::vm{};
-    const auto result_or_error = interpreter::simplify(root_node, vm);
-    if (!result_or_error.has_value()) {
-        std::println(stderr, "{}", result_or_error.error().error);
-        return 1;
+    auto evaluator = line_evaluator{ settings };
+
+    if (settings.image.has_value()) {
+        const auto mapped = mapped_file::open(std::string{ settings.image.value() }.c_str());
+        if (!mapped.has_value()) {
+            std::println(stderr, "{}", mapped.error().error);
+            return 1;
+        }
+
+        const auto programs = image::open(mapped.value().contents(), evaluator.vm);
+        if (!programs.has_value()) {
+            std::println(stderr, "{}", programs.error().error);
+            return 1;
+        }
+
+        evaluator.run_image(programs.value());
+    } else if (settings.expression.has_value()) {
+        evaluator(settings.expression.value());
+    } else if (settings.file.has_value()) {
+        const auto mapped = mapped_file::open(std::string{ settings.file.value() }.c_str());
+        if (!mapped.has_value()) {
+            std::println(stderr, "{}", mapped.error().error);
+            return 1;
+        }
+
+        evaluate_lines(mapped.value().contents(), evaluator);
+    } else {
+        // Redirected regular files are mapped too; pipes are read in chunks.
+        if (const auto mapped = mapped_file::open(STDIN_FILENO); mapped.has_value())
+            evaluate_lines(mapped.value().contents(), evaluator);
+        else
+            for_each_line(stdin, evaluator);
     }
 
-    const auto& result = result_or_error.value();
-    if (std::holds_alternative<node>(result)) {
-        print_tree(std::get<node>(result));
-        std::puts("");
-        return 0;
+    if (evaluator.writer.has_value()) {
+        evaluator.errors.flush();
+        const auto written = write_file(std::string{ settings.write_image.value() }.c_str(), evaluator.writer->finish());
+        if (!written.has_value()) {
+            std::println(stderr, "{}", written.error().error);
+            return 1;
+        }
+
+        std::println(stderr, "Wrote {} programs.", evaluator.writer->size());
+    }
+
+    if (settings.cse)
+        std::println(stderr, "Deduplicated {} nodes.", evaluator.deduplicated);
+
+    if (evaluator.cache.has_value()) {
+        const auto stats = evaluator.cache->stats();
+        std::println(stderr, "Cache: {} hits, {} misses, {} evictions, {} entries.",
+                     stats.hits, stats.misses, stats.evictions, stats.size);
+    }
+
+    if (settings.stats) {
+        const auto& s = stats();
+        std::println(stderr, "Stats: lex {}, parse {}, evaluate {}; {} tokens, {} nodes, max depth {}, {} copied nodes, "
+                             "{} symbol lookups, {} function calls.",
+                     s.time_of(pipeline_stage::lex), s.time_of(pipeline_stage::parse), s.time_of(pipeline_stage::evaluate),
+                     s.tokens, s.nodes, s.max_depth, s.copies, s.symbol_lookups, s.function_calls);
     }
 
-    std::println("{}", std::get<number>(result));
-    return 0;
+    return evaluator.failed > 0 ? 1 : 0;
 }
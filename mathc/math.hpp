@@ -1,8 +1,12 @@
 #pragma once
 
-#include <cstdint>
+#include <array>
+#include <bit>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <limits>
+#include <optional>
 #include <type_traits>
 
 #define NO_NUMBER_IMPL
@@ -14,69 +18,280 @@ namespace math
 
 using namespace mathc;
 
+// Constant evaluation can't call <cmath>, so these stand in for it there (and in compiled
+// expressions). Each reduces its argument to a narrow range using the exponent bits and a
+// small table, and then needs only a short fixed polynomial: no recursion and no iterating to
+// convergence. Against correctly rounded results over the whole double range, sqrt and exp
+// are within 1 ULP, ln within 2, log2 within 3, and pow within 3 while |exponent * ln(base)|
+// stays below 709, i.e. while the result is finite and normal.
 namespace detail
 {
 
-constexpr static inline bool double_equal(const double a, const double b)
+constexpr static auto infinity = std::numeric_limits<double>::infinity();
+constexpr static auto quiet_nan = std::numeric_limits<double>::quiet_NaN();
+
+// Without ==: only exactly representable literals may be compared for equality.
+constexpr static inline bool is_infinite(const double x)
 {
-    constexpr static auto epsilon = std::numeric_limits<double>::epsilon();
-    return (a < b + epsilon && a > b - epsilon);
+    return x > std::numeric_limits<double>::max() || x < -std::numeric_limits<double>::max();
 }
 
-constexpr static auto NUM_ITER = 20;
+constexpr static double ln2_hi = 0.6931467056274414;  // trailing zeros: ln2_hi times any exponent is exact
+constexpr static double ln2_lo = 4.7493250390316726e-07;
 
-constexpr static inline double sqrt_newton(const double x, const double curr, const double prev, int iter = NUM_ITER)
+// A value carried as an unevaluated sum, for the few steps that need more than a double.
+struct double_double
 {
-    return (iter == 0 || double_equal(curr, prev)) ?
-        curr :
-        sqrt_newton(x, 0.5 * (curr + x / curr), curr, iter - 1);
+    double hi;
+    double lo;
+};
+
+constexpr static inline double_double two_sum(const double a, const double b)
+{
+    const auto sum = a + b;
+    const auto b_part = sum - a;
+    return { sum, (a - (sum - b_part)) + (b - b_part) };
 }
 
-constexpr static inline double exp(const double x, int iter = NUM_ITER)
+// Exact: Veltkamp splits each factor into halves whose products a double holds.
+constexpr static inline double_double two_product(const double a, const double b)
+{
+    constexpr static auto split = [](const double v) {
+        const auto scaled = 134217729.0 * v;  // 2^27 + 1
+        const auto high = scaled - (scaled - v);
+        return double_double{ high, v - high };
+    };
+
+    const auto product = a * b;
+    const auto [a_hi, a_lo] = split(a);
+    const auto [b_hi, b_lo] = split(b);
+    return { product, ((a_hi * b_hi - product) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo };
+}
+
+constexpr static inline double power_of_two(const std::int64_t k)
+{
+    return std::bit_cast<double>(static_cast<std::uint64_t>(k + 1023) << 52);
+}
+
+// x = mantissa * 2^exponent with the mantissa in [0.75, 1.5), for finite positive x.
+struct reduced
+{
+    double mantissa;
+    std::int64_t exponent;
+};
+
+constexpr static inline reduced reduce(double x)
 {
-    double result = 1.0, term = 1.0;
-    for (int i = 1; i <= iter; ++i) {
-        term *= x / i;
-        result += term;
+    auto exponent = std::int64_t{ 0 };
+    if (x < std::numeric_limits<double>::min()) {
+        x *= power_of_two(54);
+        exponent = -54;
     }
-    return result;
+
+    const auto bits = std::bit_cast<std::uint64_t>(x);
+    exponent += static_cast<std::int64_t>((bits >> 52) & 0x7ff) - 1023;
+    auto mantissa = std::bit_cast<double>((bits & 0x000f'ffff'ffff'ffff) | 0x3ff0'0000'0000'0000);
+    if (mantissa > 1.5) {
+        mantissa *= 0.5;
+        exponent++;
+    }
+
+    return { mantissa, exponent };
 }
 
-constexpr static inline double ln_newton(const double x, const double curr, const double prev, int iter = NUM_ITER)
+// ln(1 + j/16) for j in [-4, 8], split in two so that the sum is good to ~2^-106.
+constexpr static std::array<double_double, 13> ln_table{ {
+    { -0.2876820724517809, -2.607160616442564e-17 },
+    { -0.2076393647782445, -1.2053243216686129e-17 },
+    { -0.13353139262452263, 3.664457663660085e-18 },
+    { -0.06453852113757118, 6.470486661692933e-18 },
+    { 0.0, 0.0 },
+    { 0.06062462181643484, 2.6424025938726934e-18 },
+    { 0.11778303565638346, -1.1971685747593677e-18 },
+    { 0.17185025692665923, -6.0224538210113705e-18 },
+    { 0.22314355131420976, -9.091270597324799e-18 },
+    { 0.27193371548364176, 7.83319637697442e-19 },
+    { 0.3184537311185346, 2.7114779367326236e-17 },
+    { 0.3629054936893685, -2.1492361455310972e-17 },
+    { 0.4054651081081644, -2.8811380259626426e-18 },
+} };
+
+// ln(m) for m in [0.75, 1.5): m = c * (1 + s) / (1 - s) around the nearest c = 1 + j/16,
+// so |s| < 1/64 and ln((1 + s) / (1 - s)) = 2 * (s + s^3/3 + ...) needs five terms.
+constexpr static inline double_double ln_mantissa(const double m)
 {
-    return (iter == 0 || double_equal(curr, prev)) ?
-        curr :
-        ln_newton(x, curr - (exp(curr) - x) / exp(curr), curr, iter - 1);
+    const auto j = static_cast<std::int64_t>((m - 1.0) * 16.0 + 4.5) - 4;
+    const auto c = 1.0 + static_cast<double>(j) / 16.0;
+    const auto s = (m - c) / (m + c);  // m - c is exact
+    const auto s2 = s * s;
+    const auto series = (((((1.0 / 11.0) * s2 + 1.0 / 9.0) * s2 + 1.0 / 7.0) * s2 + 1.0 / 5.0) * s2 + 1.0 / 3.0);
+
+    const auto& table = ln_table[static_cast<std::size_t>(j + 4)];
+    return { table.hi, table.lo + (2.0 * s + 2.0 * s * s2 * series) };
 }
 
-constexpr static inline double pow(const double base, const double exponent)
+// ln for finite positive x, as hi + lo.
+constexpr static inline double_double ln_parts(const double x)
+{
+    const auto [m, e] = reduce(x);
+    const auto [table, tail] = ln_mantissa(m);
+    const auto exponent = static_cast<double>(e);
+
+    const auto head = two_sum(exponent * ln2_hi, table);
+    return two_sum(head.hi, head.lo + (exponent * ln2_lo + tail));
+}
+
+constexpr static inline double ln(const double x)
+{
+    if (x != x || x > std::numeric_limits<double>::max())
+        return x;
+    if (x < 0.0)
+        return quiet_nan;
+    if (x == 0.0)
+        return -infinity;
+
+    const auto [hi, lo] = ln_parts(x);
+    return hi + lo;
+}
+
+constexpr static inline double log2(const double x)
+{
+    constexpr static double inv_ln2_hi = 1.4426950408889634;
+    constexpr static double inv_ln2_lo = 2.0355273740931033e-17;
+
+    if (x != x || x > std::numeric_limits<double>::max())
+        return x;
+    if (x < 0.0)
+        return quiet_nan;
+    if (x == 0.0)
+        return -infinity;
+
+    // The exponent is added last, so powers of two come out exact.
+    const auto [m, e] = reduce(x);
+    const auto [table, tail] = ln_mantissa(m);
+    const auto ln_m = two_sum(table, tail);
+    const auto scaled = two_product(ln_m.hi, inv_ln2_hi);
+    const auto sum = two_sum(static_cast<double>(e), scaled.hi);
+    return sum.hi + (sum.lo + (scaled.lo + ln_m.lo * inv_ln2_hi + ln_m.hi * inv_ln2_lo));
+}
+
+// 2^(j/32) for j in [0, 32).
+constexpr static std::array<double, 32> exp2_table{
+    1.0, 1.0218971486541166, 1.0442737824274138, 1.0671404006768237,
+    1.0905077326652577, 1.1143867425958924, 1.1387886347566916, 1.1637248587775775,
+    1.189207115002721, 1.215247359980469, 1.241857812073484, 1.2690509571917332,
+    1.2968395546510096, 1.3252366431597413, 1.3542555469368927, 1.383909881963832,
+    1.4142135623730951, 1.4451808069770467, 1.4768261459394993, 1.5091644275934228,
+    1.5422108254079407, 1.5759808451078865, 1.6104903319492543, 1.645755478153965,
+    1.681792830507429, 1.718619298122478, 1.7562521603732995, 1.7947090750031072,
+    1.8340080864093424, 1.8741676341103, 1.9152065613971474, 1.9571441241754002,
+};
+
+// e^(x + x_lo), x_lo being a correction far below x's last bit. x = (32q + j) * ln2/32 + r
+// with |r| <= ln2/64, so e^x = 2^q * 2^(j/32) * e^r and e^r needs a degree 6 polynomial.
+constexpr static inline double exp(const double x, const double x_lo = 0.0)
 {
-    if (double_equal(0.0, base) && exponent <= 0.0)
+    constexpr static double inv_ln2_32 = 46.16624130844683;
+    constexpr static double ln2_32_hi = 0.021660834550857544;
+    constexpr static double ln2_32_lo = 1.4841640746973977e-08;
+
+    if (x != x)
+        return x;
+    if (x > 709.782712893384)
+        return infinity;
+    if (x < -745.1332191019412)
         return 0.0;
 
-    if (double_equal(exponent, 1.0))
-        return base;
+    const auto scaled = x * inv_ln2_32;
+    const auto k = static_cast<std::int64_t>(scaled < 0.0 ? scaled - 0.5 : scaled + 0.5);
+    const auto r = ((x - static_cast<double>(k) * ln2_32_hi) - static_cast<double>(k) * ln2_32_lo) + x_lo;
 
-    if (exponent < 0.0)
-        return 1.0  / pow(base, -exponent);
+    const auto polynomial = ((((1.0 / 720.0 * r + 1.0 / 120.0) * r + 1.0 / 24.0) * r + 1.0 / 6.0) * r + 0.5);
+    const auto expm1_r = r + r * r * polynomial;
+    const auto table = exp2_table[static_cast<std::size_t>(k & 31)];
+    const auto y = table + table * expm1_r;
 
-    auto int_exp = static_cast<std::int64_t>(exponent);
-    double result = 1.0;
+    // Scaled in two steps outside the normal exponent range, so subnormals round once.
+    const auto q = k >> 5;
+    if (q > 1023)
+        return y * power_of_two(1023) * power_of_two(q - 1023);
+    if (q < -1022)
+        return y * power_of_two(q + 54) * power_of_two(-54);
 
-    const auto frac_exp = exponent - static_cast<double>(int_exp);
+    return y * power_of_two(q);
+}
 
-    auto base_sq = base;
-    while (int_exp > 0) {
-        if (int_exp & 1)
-            result *= base_sq;
-        base_sq *= base_sq;
-        int_exp >>= 1;
+// Newton's method from the estimate that halves the exponent bits, which is within 6%:
+// each step squares the error, four reach the last bit.
+constexpr static inline double sqrt(double x)
+{
+    if (x != x || x < 0.0)
+        return quiet_nan;
+    if (x == 0.0 || x > std::numeric_limits<double>::max())
+        return x;
+
+    auto scale = 1.0;
+    if (x < std::numeric_limits<double>::min()) {
+        x *= power_of_two(54);
+        scale = power_of_two(-27);
     }
 
-    if (frac_exp != 0.0)
-        result *= exp(frac_exp * ln_newton(base, base, 0.0));
+    auto y = std::bit_cast<double>((std::bit_cast<std::uint64_t>(x) >> 1) + 0x1ff8'0000'0000'0000);
+    for(auto i = 0; i < 4; i++)
+        y = 0.5 * (y + x / y);
 
-    return result;
+    return y * scale;
+}
+
+constexpr static inline double pow(const double base, const double exponent)
+{
+    if (exponent == 0.0 || base == 1.0)
+        return 1.0;
+    if (base != base || exponent != exponent)
+        return quiet_nan;
+
+    constexpr static auto max_exact_integer = 9007199254740992.0;  // 2^53
+    const auto integral = exponent > -max_exact_integer && exponent < max_exact_integer &&
+                          static_cast<double>(static_cast<std::int64_t>(exponent)) - exponent == 0.0;
+    const auto odd = integral && (static_cast<std::int64_t>(exponent) & 1) != 0;
+
+    if (base == 0.0 || is_infinite(base)) {
+        const auto magnitude = (base == 0.0) == (exponent > 0.0) ? 0.0 : infinity;
+        return base < 0.0 && odd ? -magnitude : magnitude;
+    }
+
+    if (base < 0.0 && !integral)
+        return quiet_nan;
+
+    // Small integral exponents multiply exactly when the result is representable.
+    if (integral && exponent >= -64.0 && exponent <= 64.0) {
+        auto n = static_cast<std::int64_t>(exponent < 0.0 ? -exponent : exponent);
+        auto result = 1.0;
+        auto square = base;
+        while(n > 0) {
+            if (n & 1)
+                result *= square;
+            square *= square;
+            n >>= 1;
+        }
+
+        if (exponent > 0.0)
+            return result;
+
+        // Reciprocal of an underflowed power: constant evaluation can't divide by zero.
+        return result == 0.0 ? (base < 0.0 && odd ? -infinity : infinity) : 1.0 / result;
+    }
+
+    // e^(exponent * ln|base|), with the product kept to twice a double's precision: its
+    // rounding error would otherwise be multiplied by the result's magnitude.
+    const auto [ln_hi, ln_lo] = ln_parts(base < 0.0 ? -base : base);
+    const auto t = exponent * ln_hi;
+    const auto magnitude = t > 746.0 || t < -746.0 ? exp(t) : [&] {
+        const auto [product, error] = two_product(exponent, ln_hi);
+        return exp(product, error + exponent * ln_lo);
+    }();
+
+    return base < 0.0 && odd ? -magnitude : magnitude;
 }
 
 }
@@ -86,13 +301,7 @@ constexpr static inline number sqrt(const double num)
     if (!std::is_constant_evaluated())
         return number{ std::sqrt(num) };
 
-    if (num < 0)
-        assert(false);
-
-    if (detail::double_equal(num, 0.0))
-        return number::from_int(0);
-
-    return number{ detail::sqrt_newton(num, num, 0.0) };
+    return number{ detail::sqrt(num) };
 }
 
 constexpr static inline number sqrt(const std::int64_t num)
@@ -108,16 +317,53 @@ constexpr static inline number pow(const double base, const double exp)
     return number{ detail::pow(base, exp) };
 }
 
+// Empty where the product overflows std::int64_t.
+constexpr static inline std::optional<std::int64_t> checked_mul(const std::int64_t a, const std::int64_t b)
+{
+    std::int64_t product;
+    if (__builtin_mul_overflow(a, b, &product))
+        return {};
+
+    return product;
+}
+
+// base^exp for exp >= 0 by squaring, in O(log exp) multiplies; empty where it overflows.
+constexpr static inline std::optional<std::int64_t> checked_pow(std::int64_t base, std::int64_t exp)
+{
+    assert(exp >= 0);
+
+    auto result = std::int64_t{ 1 };
+    while(exp > 0) {
+        if (exp & 1) {
+            const auto product = checked_mul(result, base);
+            if (!product.has_value())
+                return {};
+            result = product.value();
+        }
+
+        // Only squared while a higher bit is left, so the last square can't overflow needlessly.
+        if ((exp >>= 1) > 0) {
+            const auto square = checked_mul(base, base);
+            if (!square.has_value())
+                return {};
+            base = square.value();
+        }
+    }
+
+    return result;
+}
+
+// A power too wide for std::int64_t is taken in doubles, where number would store it anyway.
 constexpr static inline number pow(const std::int64_t base, const std::int64_t exp)
 {
     if (exp < 0)
-        return number{ 1.0 / static_cast<double>(pow(base, -exp).as_int()) };
+        return number{ 1.0 / pow(base, -exp).promote_to_double() };
 
-    auto ret = base;
-    for(auto i = 1; i < exp; i++)
-        ret *= base;
+    const auto result = checked_pow(base, exp);
+    if (!result.has_value())
+        return pow(static_cast<double>(base), static_cast<double>(exp));
 
-    return number{ ret };
+    return number{ result.value() };
 }
 
 constexpr static inline number log(double num)
@@ -125,7 +371,7 @@ constexpr static inline number log(double num)
     if (!std::is_constant_evaluated())
         return number{ std::log(num) };
 
-    return number{ detail::ln_newton(num, num, 0.0) };
+    return number{ detail::ln(num) };
 }
 
 constexpr static inline number log2(double num)
@@ -133,7 +379,7 @@ constexpr static inline number log2(double num)
     if (!std::is_constant_evaluated())
         return number{ std::log2(num) };
 
-    return number{ detail::ln_newton(num, num, 0.0) / detail::ln_newton(2.0, 2.0, 0.0) };
+    return number{ detail::log2(num) };
 }
 
 }
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <common.hpp>
+#include <interpreter.hpp>
+#include <node.hpp>
+#include <symbols.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Symbols defined by expressions over other symbols, spreadsheet-style, with every result
+// cached. define() records which symbols an expression reads and marks it stale; update()
+// re-evaluates the stale symbols and everything that transitively reads them, each once and
+// after its inputs, and leaves every other cached result alone.
+//
+// A result is bound into the vm as a constant (or as the residual, for partial results), so
+// evaluating a dependent reads its inputs' results instead of re-evaluating their
+// expressions. A symbol whose expression fails or is part of a cycle keeps its error as its
+// result and is left unbound. Symbols must be bound through define(), not vm::insert_symbol,
+// for their dependents to be tracked.
+struct model
+{
+    struct cell
+    {
+        std::optional<node> expression{};
+        std::optional<execution_result> result{};
+        std::vector<symbol_id> dependencies{};  // symbols expression reads, each once
+        std::vector<symbol_id> dependents{};    // symbols whose expression reads this one
+        bool stale{ false };
+    };
+
+    constexpr symbol_id define(const std::string_view symbol, const node& expression)
+    {
+        const auto id = vm.symbols.intern(symbol);
+        define(id, expression);
+        return id;
+    }
+
+    constexpr void define(symbol_id id, const node& expression);
+
+    // Re-evaluates what changed since the last update; returns how many symbols were evaluated.
+    constexpr std::size_t update();
+
+    constexpr const execution_result* result(const symbol_id id) const
+    {
+        return id < cells.size() && cells[id].result.has_value() ? &cells[id].result.value() : nullptr;
+    }
+
+    constexpr const execution_result* result(const std::string_view symbol) const
+    {
+        const auto id = vm.symbols.find(symbol);
+        return id.has_value() ? result(id.value()) : nullptr;
+    }
+
+    struct vm vm{};
+    std::vector<cell> cells{};  // indexed by symbol_id
+
+private:
+    constexpr cell& cell_of(const symbol_id id)
+    {
+        if (id >= cells.size())
+            cells.resize(id + 1);
+
+        return cells[id];
+    }
+
+    constexpr void collect_dependencies(symbol_id id);
+    constexpr void evaluate(symbol_id id);
+
+    // update()'s scratch, kept so their capacity is reused between ticks.
+    std::vector<symbol_id> stale{};
+    std::vector<symbol_id> affected{};
+    std::vector<symbol_id> ready{};
+    std::vector<std::uint32_t> pending_inputs{};  // per symbol: affected dependencies not yet evaluated
+    std::vector<bool> is_affected{};
+};
+
+// Implementation
+
+constexpr inline void model::define(const symbol_id id, const node& expression)
+{
+    for(const auto dependency : cell_of(id).dependencies)
+        std::erase(cells[dependency].dependents, id);
+
+    cells[id].expression = copy_node(expression);
+    collect_dependencies(id);
+
+    for(const auto dependency : cells[id].dependencies)
+        cell_of(dependency).dependents.emplace_back(id);
+
+    if (!cells[id].stale) {
+        cells[id].stale = true;
+        stale.emplace_back(id);
+    }
+}
+
+constexpr inline void model::collect_dependencies(const symbol_id id)
+{
+    auto dependencies = std::vector<symbol_id>{};
+    auto pending = std::vector<const node*>{ &cells[id].expression.value() };
+
+    while(!pending.empty()) {
+        const auto* n = pending.back();
+        pending.pop_back();
+
+        if (const auto* op = std::get_if<op_node>(n); op) {
+            pending.emplace_back(op->right.get());
+            pending.emplace_back(op->left.get());
+        } else if (const auto* call = std::get_if<function_call_node>(n); call) {
+            for(const auto& argument : call->arguments)
+                pending.emplace_back(&argument);
+        } else if (const auto* symbol = std::get_if<symbol_node>(n); symbol) {
+            const auto dependency = symbol->id != null_symbol ? symbol->id : vm.symbols.intern(symbol->value);
+            if (std::ranges::find(dependencies, dependency) == dependencies.end())
+                dependencies.emplace_back(dependency);
+        }
+    }
+
+    cells[id].dependencies = std::move(dependencies);
+}
+
+constexpr inline void model::evaluate(const symbol_id id)
+{
+    auto& c = cells[id];
+    c.stale = false;
+
+    if (!c.expression.has_value())
+        return;
+
+    c.result = interpreter::run(c.expression.value(), vm);
+    if (!c.result->has_value()) {
+        if (id < vm.bindings.size())
+            vm.bindings[id].reset();
+        return;
+    }
+
+    if (const auto* n = std::get_if<number>(&c.result->value()); n)
+        vm.insert_symbol(id, make_node<constant_node>(*n));
+    else
+        vm.insert_symbol(id, std::get<node>(c.result->value()));
+}
+
+// Kahn's algorithm over the stale symbols and their transitive dependents: a symbol is
+// ready once every affected symbol it reads has been evaluated. Whatever never becomes
+// ready is on a cycle.
+constexpr inline std::size_t model::update()
+{
+    affected.clear();
+    ready.clear();
+    is_affected.assign(cells.size(), false);
+    pending_inputs.assign(cells.size(), 0);
+
+    const auto affect = [&](const symbol_id id) {
+        if (is_affected[id])
+            return;
+
+        is_affected[id] = true;
+        cells[id].stale = true;
+        affected.emplace_back(id);
+    };
+
+    for(const auto id : stale)
+        affect(id);
+    stale.clear();
+
+    for(auto i = 0u; i < affected.size(); i++)
+        for(const auto dependent : cells[affected[i]].dependents)
+            affect(dependent);
+
+    // A symbol reading itself never becomes ready.
+    for(const auto id : affected) {
+        auto reads_itself = false;
+        for(const auto dependency : cells[id].dependencies) {
+            if (dependency == id)
+                reads_itself = true;
+            else if (is_affected[dependency])
+                pending_inputs[id]++;
+        }
+
+        if (pending_inputs[id] == 0 && !reads_itself)
+            ready.emplace_back(id);
+    }
+
+    auto evaluated = std::size_t{ 0 };
+    while(!ready.empty()) {
+        const auto id = ready.back();
+        ready.pop_back();
+
+        evaluate(id);
+        evaluated++;
+
+        for(const auto dependent : cells[id].dependents)
+            if (dependent != id && is_affected[dependent] && --pending_inputs[dependent] == 0)
+                ready.emplace_back(dependent);
+    }
+
+    if (evaluated == affected.size())
+        return evaluated;
+
+    for(const auto id : affected) {
+        auto& c = cells[id];
+        if (!c.stale || !c.expression.has_value())
+            continue;
+
+        c.stale = false;
+        c.result = make_execution_error(std::format("Symbol {} is on or depends on a cycle.", vm.symbols.name(id)));
+        if (id < vm.bindings.size())
+            vm.bindings[id].reset();
+        evaluated++;
+    }
+
+    return evaluated;
+}
+
+}
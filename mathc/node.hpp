@@ -1,12 +1,16 @@
 #pragma once
 
-#include <memory>
+#include <format>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #include <number.hpp>
+#include <stats.hpp>
+#include <symbols.hpp>
 
 namespace mathc
 {
@@ -35,6 +39,19 @@ constexpr static inline auto operation_type_to_string(operation_type type)
     std::unreachable();
 }
 
+constexpr static inline number apply_operation(const operation_type type, const number& left, const number& right)
+{
+    switch(type) {
+        case operation_type::mul: return left * right;
+        case operation_type::div: return left / right;
+        case operation_type::add: return left + right;
+        case operation_type::sub: return left - right;
+        case operation_type::exp: return left ^ right;
+    }
+
+    std::unreachable();
+}
+
 struct op_node;
 struct constant_node;
 struct symbol_node;
@@ -42,6 +59,33 @@ struct function_call_node;
 
 using node = std::variant<op_node, constant_node, symbol_node, function_call_node>;
 
+// Owns a node together with every other node_ptr to it. Nodes are immutable once made, so
+// a copy shares rather than duplicates: a tree built from another keeps the subtrees it
+// didn't change. The count isn't atomic; a tree and the trees sharing with it stay on one
+// thread.
+struct node_ptr
+{
+    constexpr node_ptr() = default;
+    constexpr explicit node_ptr(node&& n);
+    constexpr node_ptr(const node_ptr& other);
+    constexpr node_ptr(node_ptr&& other) noexcept : shared(std::exchange(other.shared, nullptr)) {}
+    constexpr node_ptr& operator=(node_ptr other) noexcept { std::swap(shared, other.shared); return *this; }
+    constexpr ~node_ptr();
+
+    constexpr const node* get() const;
+    constexpr const node& operator*() const { return *get(); }
+    constexpr const node* operator->() const { return get(); }
+    constexpr explicit operator bool() const { return shared != nullptr; }
+
+    // The node, if nothing else shares it: it may then be taken apart.
+    constexpr node* exclusive() const;
+
+private:
+    struct shared_node;
+
+    shared_node* shared{ nullptr };
+};
+
 struct constant_node
 {
     number value;
@@ -50,25 +94,86 @@ struct constant_node
 struct symbol_node
 {
     std::string value;
+    symbol_id id{ null_symbol };  // resolved against a vm's symbol_table at parse time, if one was given
 };
 
 struct function_call_node
 {
     std::string function_name;
     std::vector<node> arguments;
+    function_id id{ null_function };  // resolved at parse time; builtin ids if no function_table was given
 };
 
 struct op_node
 {
-    std::unique_ptr<node> left;
-    std::unique_ptr<node> right;
+    constexpr op_node(node_ptr l, node_ptr r, const operation_type t)
+        : left(std::move(l)), right(std::move(r)), type(t) {}
+    constexpr op_node(const op_node&) = default;
+    constexpr op_node(op_node&&) noexcept = default;
+    constexpr op_node& operator=(const op_node&) = default;
+    constexpr op_node& operator=(op_node&&) noexcept = default;
+    constexpr ~op_node();
+
+    node_ptr left;
+    node_ptr right;
     operation_type type;
 };
 
+struct node_ptr::shared_node
+{
+    std::size_t references;
+    node value;
+};
+
+constexpr inline node_ptr::node_ptr(node&& n) : shared(new shared_node{ 1, std::move(n) }) {}
+
+constexpr inline node_ptr::node_ptr(const node_ptr& other) : shared(other.shared)
+{
+    if (shared)
+        shared->references++;
+}
+
+constexpr inline node_ptr::~node_ptr()
+{
+    if (shared && --shared->references == 0)
+        delete shared;
+}
+
+constexpr inline const node* node_ptr::get() const { return shared ? &shared->value : nullptr; }
+constexpr inline node* node_ptr::exclusive() const { return shared && shared->references == 1 ? &shared->value : nullptr; }
+
+// Operand chains are detached onto a heap stack before they are freed, so dropping a deep
+// tree costs no native stack per level. A shared operand isn't freed with this node and is
+// left to its other owners.
+constexpr inline op_node::~op_node()
+{
+    constexpr static auto is_owned_op = [](const node_ptr& n) {
+        return n.exclusive() && std::holds_alternative<op_node>(*n);
+    };
+
+    if (!is_owned_op(left) && !is_owned_op(right))
+        return;
+
+    std::vector<node_ptr> pending{};
+    pending.emplace_back(std::move(left));
+    pending.emplace_back(std::move(right));
+
+    while(!pending.empty()) {
+        const auto n = std::move(pending.back());
+        pending.pop_back();
+
+        if (is_owned_op(n)) {
+            auto& op = std::get<op_node>(*n.exclusive());
+            pending.emplace_back(std::move(op.left));
+            pending.emplace_back(std::move(op.right));
+        }
+    }
+}
+
 template<typename T>
-concept node_type = []<typename... Ts>(std::variant<Ts...>) {
+concept node_type = []<typename... Ts>(std::type_identity<std::variant<Ts...>>) {
     return (std::same_as<T, Ts> || ...);
-}(node{});
+}(std::type_identity<node>{});
 
 template<node_type T, typename... Args>
 constexpr static inline node make_node(Args&&... args)
@@ -77,9 +182,9 @@ constexpr static inline node make_node(Args&&... args)
 }
 
 template<node_type T, typename... Args>
-constexpr static inline std::unique_ptr<node> make_unique_node(Args&&... args)
+constexpr static inline node_ptr make_shared_node(Args&&... args)
 {
-    return std::make_unique<node>(std::in_place_type_t<T>{}, std::forward<Args>(args)...);
+    return node_ptr{ node{ std::in_place_type_t<T>{}, std::forward<Args>(args)... } };
 }
 
 constexpr static inline node copy_node(const auto& n);
@@ -98,22 +203,72 @@ constexpr static struct
 {
     constexpr static auto operator()(const op_node& op)
     {
-        return make_node<op_node>(std::make_unique<node>(copy_node(*op.left)),
-                                  std::make_unique<node>(copy_node(*op.right)),
-                                  op.type);
+        return make_node<op_node>(op.left, op.right, op.type);
     }
     constexpr static auto operator()(const function_call_node& op)
     {
         return make_node<function_call_node>(op.function_name,
-                                             copy_arguments(op));
+                                             copy_arguments(op),
+                                             op.id);
     }
     constexpr static auto operator()(const symbol_node& op) { return make_node<symbol_node>(op); }
     constexpr static auto operator()(const constant_node& op) { return make_node<constant_node>(op); }
 } copy_visitor{};
 
+// Shallow: the copy shares its operands with n and only makes the node and a call's list of
+// arguments anew.
 constexpr static inline node copy_node(const auto& n)
 {
+    count_stat(&pipeline_stats::copies);
     return std::visit(copy_visitor, n);
 }
 
+// Appends the tree as text, every operation parenthesized.
+static inline void format_tree(std::string& out, const node& root_node)
+{
+    if(std::holds_alternative<op_node>(root_node)) {
+        const auto& op = std::get<op_node>(root_node);
+        out += "(";
+
+        if (op.left.get())
+            format_tree(out, *op.left);
+
+        out += operation_type_to_string(op.type);
+
+        if (op.right.get())
+            format_tree(out, *op.right);
+
+        out += ")";
+        return;
+    }
+
+    else if (std::holds_alternative<constant_node>(root_node)) {
+        const auto& op = std::get<constant_node>(root_node);
+        out += std::format("{}", op.value);
+        return;
+    }
+
+    else if(std::holds_alternative<symbol_node>(root_node)) {
+        const auto& op = std::get<symbol_node>(root_node);
+        out += op.value;
+        return;
+    }
+
+    else if(std::holds_alternative<function_call_node>(root_node)) {
+        const auto& op = std::get<function_call_node>(root_node);
+        out += op.function_name;
+        out += "(";
+        for(auto i = 0u; i < op.arguments.size(); i++) {
+            const auto& argument = op.arguments[i];
+            format_tree(out, argument);
+            if (i != op.arguments.size() - 1)
+                out += ", ";
+        }
+        out += ")";
+        return;
+    }
+
+    std::unreachable();
+}
+
 }
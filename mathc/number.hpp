@@ -1,32 +1,49 @@
 #pragma once
 
 #include <cstdint>
+#include <bit>
+#include <cassert>
 #include <optional>
-#include <variant>
 
 #include <lexer.hpp>
 
 namespace mathc
 {
 
+// NaN-boxed into 8 bytes: a double is stored as its own bits (NaNs made canonical) and an
+// integer in the payload of the negative quiet NaNs, so telling the two apart is one mask.
+// Integers outside [min_int, max_int] are stored as doubles.
 struct number
 {
-    constexpr explicit number(std::int64_t i) : impl(i) {}
-    constexpr explicit number(double d) : impl(d) {}
+    constexpr explicit number(std::int64_t i) : bits(box(i)) {}
+    constexpr explicit number(double d) : bits(box(d)) {}
 
     constexpr static inline number from_int(std::int64_t num) { return number{ num }; }
     constexpr static inline number from_double(double num) { return number{ num }; }
     constexpr static inline std::optional<number> from_token(const token& t);
 
-    constexpr inline bool is_int() const { return std::holds_alternative<std::int64_t>(impl); }
-    constexpr inline bool is_double() const { return std::holds_alternative<double>(impl); }
+    constexpr inline bool is_int() const { return (bits & int_tag) == int_tag; }
+    constexpr inline bool is_double() const { return !is_int(); }
 
-    constexpr inline auto as_int() const { return std::get<std::int64_t>(impl); }
-    constexpr inline auto as_double() const { return std::get<double>(impl); }
+    constexpr inline std::int64_t as_int() const
+    {
+        assert(is_int());
+        return static_cast<std::int64_t>(bits << tag_bits) >> tag_bits;
+    }
+    constexpr inline double as_double() const { assert(is_double()); return std::bit_cast<double>(bits); }
+
+    constexpr inline double promote_to_double() const
+    {
+        return is_int() ? static_cast<double>(as_int()) : as_double();
+    }
 
-    constexpr inline auto promote_to_double() const
+    // Calls f with the value as std::int64_t or double.
+    constexpr inline decltype(auto) visit(auto&& f) const
     {
-        return std::visit([](const auto num){ return static_cast<double>(num); }, impl);
+        if (is_int())
+            return f(as_int());
+
+        return f(as_double());
     }
 
     constexpr number operator*(const number& other) const;
@@ -44,9 +61,24 @@ struct number
     constexpr bool operator==(std::int64_t other) const;
     constexpr bool operator==(int other) const;
 
-    std::variant<double, std::int64_t> impl{ 0 };
+    constexpr static std::int64_t max_int = (std::int64_t{ 1 } << 50) - 1;
+    constexpr static std::int64_t min_int = -(std::int64_t{ 1 } << 50);
+
+    std::uint64_t bits{ int_tag };
+
+private:
+    constexpr static int tag_bits = 13;
+    constexpr static std::uint64_t int_tag = 0xfff8'0000'0000'0000;
+    constexpr static std::uint64_t payload_mask = ~int_tag;
+    constexpr static std::uint64_t exponent_mask = 0x7ff0'0000'0000'0000;
+    constexpr static std::uint64_t canonical_nan = 0x7ff8'0000'0000'0000;
+
+    constexpr static inline std::uint64_t box(std::int64_t i);
+    constexpr static inline std::uint64_t box(double d);
 };
 
+static_assert(sizeof(number) == 8);
+
 }
 
 #ifndef NO_NUMBER_IMPL
@@ -59,6 +91,21 @@ struct number
 namespace mathc
 {
 
+constexpr inline std::uint64_t number::box(const std::int64_t i)
+{
+    if (i < min_int || i > max_int) [[unlikely]]
+        return box(static_cast<double>(i));
+
+    return int_tag | (static_cast<std::uint64_t>(i) & payload_mask);
+}
+
+constexpr inline std::uint64_t number::box(const double d)
+{
+    const auto b = std::bit_cast<std::uint64_t>(d);
+    const auto is_nan = (b & exponent_mask) == exponent_mask && (b & ~(exponent_mask | (std::uint64_t{ 1 } << 63))) != 0;
+    return is_nan ? canonical_nan : b;
+}
+
 constexpr static inline std::optional<number> parse_double(const std::string_view str)
 {
     double result = 0.0;
@@ -119,36 +166,37 @@ constexpr inline bool number::operator==(double other) const
 
 constexpr bool number::approx_equals(const auto other, const double acceptable_difference) const
 {
-    return std::visit([other, acceptable_difference](const auto d){
-        return (std::abs(static_cast<double>(d) - static_cast<double>(other))) < acceptable_difference;
-    }, impl);
+    return std::abs(promote_to_double() - static_cast<double>(other)) < acceptable_difference;
 }
 
 constexpr inline bool number::operator==(std::int64_t other) const { return is_int() && as_int() == other; }
 constexpr inline bool number::operator==(int other) const { return operator==(static_cast<std::int64_t>(other)); }
 
+// Same-kind operands take one branch each way; only mixed operands are promoted.
 template<bool promote_to_double = false, typename Callable>
 constexpr static inline number visit_two(Callable&& c, const number& a, const number& b)
 {
-    const auto op = [&c](const auto a_val, const auto b_val) {
-        if constexpr(!promote_to_double &&
-                     std::is_same_v<std::int64_t, std::remove_cvref_t<decltype(a_val)>> &&
-                     std::is_same_v<std::int64_t, std::remove_cvref_t<decltype(b_val)>>)
-            return number{ c(static_cast<std::int64_t>(a_val),
-                             static_cast<std::int64_t>(b_val)) };
-        else
-            return number{ c(static_cast<double>(a_val),
-                             static_cast<double>(b_val)) };
-    };
-
-    return std::visit([&](const auto& a_val, const auto& b_val) {
-        return op(a_val, b_val);
-    }, a.impl, b.impl);
+    if (a.is_double() && b.is_double())
+        return number{ c(a.as_double(), b.as_double()) };
+
+    if constexpr(!promote_to_double) {
+        if (a.is_int() && b.is_int())
+            return number{ c(a.as_int(), b.as_int()) };
+    }
+
+    return number{ c(a.promote_to_double(), b.promote_to_double()) };
 }
 
+// Integer operands are within [min_int, max_int], so of + - * only a product can overflow
+// std::int64_t; one that does is taken in doubles, where it would be stored anyway.
 constexpr inline number number::operator*(const number& other) const
 {
-    return visit_two([](const auto a, const auto b){ return a * b; }, *this, other);
+    if (is_int() && other.is_int()) {
+        const auto product = math::checked_mul(as_int(), other.as_int());
+        return product.has_value() ? number{ product.value() } : number{ promote_to_double() * other.promote_to_double() };
+    }
+
+    return visit_two<true>([](const auto a, const auto b){ return a * b; }, *this, other);
 }
 
 constexpr inline number number::operator+(const number& other) const
@@ -171,8 +219,8 @@ constexpr inline number number::operator^(const number& exponent) const
     return visit_two([](const auto a, const auto b){ return math::pow(a, b); }, *this, exponent);
 }
 
-constexpr inline number& number::operator=(const double other) { impl = other; return *this; }
-constexpr inline number& number::operator=(const std::int64_t other) { impl = other; return *this; }
+constexpr inline number& number::operator=(const double other) { bits = box(other); return *this; }
+constexpr inline number& number::operator=(const std::int64_t other) { bits = box(other); return *this; }
 
 }
 
@@ -185,7 +233,7 @@ struct std::formatter<mathc::number, char>
     template<class F>
     F::iterator format(const mathc::number& num, F& c) const
     {
-        return std::visit([&c](auto n){ return std::ranges::copy(std::format("{}", n), c.out()).out; }, num.impl);
+        return num.visit([&c](auto n){ return std::ranges::copy(std::format("{}", n), c.out()).out; });
     }
 };
 
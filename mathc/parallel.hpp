@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <ast.hpp>
+#include <common.hpp>
+#include <interpreter.hpp>
+#include <node.hpp>
+#include <number.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Simplifies large expressions on several threads, with the same results and errors as
+// interpreter::simplify. The tree is cut into subtrees of about grain nodes; worker threads
+// evaluate them numerically, stealing from each other's queues when their own runs dry.
+// Every subtree that reduced to a number is then memoized, and the ordinary sequential
+// simplify runs over what is left: residuals, errors and their order are its own, since an
+// unbound symbol or a failing call only ever leaves a subtree for it to visit.
+//
+// Workers call functions concurrently, so user functions must be safe to call from several
+// threads at once. Trees smaller than threshold, and every call during constant evaluation,
+// run the subtrees on the calling thread.
+struct parallel_evaluator
+{
+    constexpr flat_execution_result simplify(ast& tree, node_index root, vm& vm);
+    constexpr execution_result simplify(const node& root_node, vm& vm);
+
+    std::size_t threshold{ 1u << 16 };  // nodes; smaller trees are simplified sequentially
+    std::size_t grain{ 1u << 12 };      // nodes per subtree, at most
+    std::size_t threads{ 0 };           // 0: one per hardware thread
+
+    std::size_t subtrees{ 0 };  // subtrees cut by the last call, for inspection
+
+private:
+    struct task
+    {
+        node_index index;
+        std::uint32_t stage{ 0 };
+    };
+
+    // Per worker: evaluate()'s stacks.
+    struct scratch
+    {
+        std::vector<task> tasks{};
+        std::vector<number> values{};
+    };
+
+    struct queue
+    {
+        std::mutex mutex{};
+        std::deque<std::size_t> cuts{};  // indices into parallel_evaluator::cuts
+    };
+
+    constexpr void measure(const ast& tree, node_index root);
+    constexpr void resolve_symbols(const ast& tree, node_index root, vm& vm);
+    constexpr void plan(const ast& tree, node_index root);
+    constexpr std::optional<number> evaluate(const ast& tree, const vm& vm, node_index root, scratch& s) const;
+    void run_parallel(const ast& tree, const vm& vm);
+
+    // Indexed by node. Children are made before their parents, so every node below root has a
+    // smaller index and one pass in index order visits children first.
+    std::vector<std::size_t> sizes{};
+    std::vector<std::optional<number>> symbol_values{};  // symbol nodes: their binding, if it simplified to a number
+
+    std::vector<node_index> cuts{};
+    std::vector<std::optional<number>> results{};  // indexed like cuts
+};
+
+// Implementation
+
+constexpr inline void parallel_evaluator::measure(const ast& tree, const node_index root)
+{
+    sizes.assign(root + 1, 1);
+
+    for(auto i = 0u; i <= root; i++) {
+        const auto& n = tree[i];
+        if (n.type == flat_node_type::op)
+            sizes[i] += sizes[n.first] + sizes[n.second];
+        else if (n.type == flat_node_type::function_call)
+            for(const auto argument : tree.arguments_of(n))
+                sizes[i] += sizes[argument];
+    }
+}
+
+// On the calling thread, since simplifying a binding may grow the vm's scratch stacks. Each
+// symbol is simplified once however often it is read; failures are left for the sequential
+// pass to report.
+constexpr inline void parallel_evaluator::resolve_symbols(const ast& tree, const node_index root, vm& vm)
+{
+    symbol_values.assign(root + 1, std::nullopt);
+
+    auto by_symbol = std::vector<std::optional<std::optional<number>>>{};
+
+    for(auto i = 0u; i <= root; i++) {
+        const auto& n = tree[i];
+        if (n.type != flat_node_type::symbol)
+            continue;
+
+        const auto id = n.symbol != null_symbol ? std::optional{ n.symbol } : vm.symbols.find(tree.name(n));
+        if (!id.has_value())
+            continue;
+
+        if (id.value() >= by_symbol.size())
+            by_symbol.resize(id.value() + 1);
+
+        auto& resolved = by_symbol[id.value()];
+        if (!resolved.has_value()) {
+            resolved.emplace();
+            if (const auto* bound = vm.symbol_node(id.value()); bound) {
+                const auto simplified = interpreter::simplify(*bound, vm);
+                if (simplified.has_value() && std::holds_alternative<number>(simplified.value()))
+                    resolved->emplace(std::get<number>(simplified.value()));
+            }
+        }
+
+        symbol_values[i] = resolved.value();
+    }
+}
+
+// Top down: a subtree within grain becomes a task, anything larger is split into its
+// children. Leaves aren't worth a task and shared nodes are cut once.
+constexpr inline void parallel_evaluator::plan(const ast& tree, const node_index root)
+{
+    cuts.clear();
+
+    auto seen = std::vector<bool>(root + 1, false);
+    auto pending = std::vector<node_index>{ root };
+
+    while(!pending.empty()) {
+        const auto index = pending.back();
+        pending.pop_back();
+
+        if (seen[index])
+            continue;
+        seen[index] = true;
+
+        if (sizes[index] == 1)
+            continue;
+
+        if (sizes[index] <= grain) {
+            cuts.emplace_back(index);
+            continue;
+        }
+
+        const auto& n = tree[index];
+        if (n.type == flat_node_type::op) {
+            pending.emplace_back(n.second);
+            pending.emplace_back(n.first);
+        } else if (n.type == flat_node_type::function_call) {
+            for(const auto argument : tree.arguments_of(n))
+                pending.emplace_back(argument);
+        }
+    }
+}
+
+// Numbers only: anything that would leave a residual or an error gives up on the subtree.
+constexpr inline std::optional<number> parallel_evaluator::evaluate(const ast& tree, const vm& vm, const node_index root,
+                                                                    scratch& s) const
+{
+    s.tasks.clear();
+    s.values.clear();
+    s.tasks.emplace_back(root);
+
+    while(!s.tasks.empty()) {
+        const auto [index, stage] = s.tasks.back();
+        s.tasks.back().stage++;
+
+        const auto& n = tree[index];
+
+        switch(n.type) {
+            case flat_node_type::constant:
+                s.tasks.pop_back();
+                s.values.emplace_back(tree.value(n));
+                break;
+
+            case flat_node_type::symbol:
+                if (!symbol_values[index].has_value())
+                    return std::nullopt;
+
+                s.tasks.pop_back();
+                s.values.emplace_back(symbol_values[index].value());
+                break;
+
+            case flat_node_type::op: {
+                if (stage < 2) {
+                    s.tasks.emplace_back(stage == 0 ? n.first : n.second);
+                    break;
+                }
+
+                s.tasks.pop_back();
+                const auto right = s.values.back();
+                s.values.pop_back();
+                s.values.back() = apply_operation(n.operation, s.values.back(), right);
+                break;
+            }
+
+            case flat_node_type::function_call: {
+                if (stage < n.argument_count) {
+                    s.tasks.emplace_back(tree.arguments_of(n)[stage]);
+                    break;
+                }
+
+                s.tasks.pop_back();
+                const auto* function = vm.find_function(n.function, tree.name(n));
+                if (!function || function->arity != n.argument_count)
+                    return std::nullopt;
+
+                const auto base = s.values.size() - n.argument_count;
+                const auto result = function->func(std::span{ s.values }.subspan(base));
+                if (!result.has_value() || !std::holds_alternative<number>(result.value()))
+                    return std::nullopt;
+
+                s.values.resize(base);
+                s.values.emplace_back(std::get<number>(result.value()));
+                break;
+            }
+        }
+    }
+
+    return s.values.back();
+}
+
+inline void parallel_evaluator::run_parallel(const ast& tree, const vm& vm)
+{
+    const auto hardware = std::max(1uz, static_cast<std::size_t>(std::thread::hardware_concurrency()));
+    const auto workers = std::min(threads == 0 ? hardware : threads, cuts.size());
+    auto queues = std::vector<queue>(workers);
+
+    // Neighbouring cuts go to the same worker, which then mostly reads nearby nodes.
+    for(auto w = 0uz; w < workers; w++)
+        for(auto i = w * cuts.size() / workers; i < (w + 1) * cuts.size() / workers; i++)
+            queues[w].cuts.emplace_back(i);
+
+    // No task spawns another, so once every queue has been seen empty there is nothing left.
+    const auto next = [&](const std::size_t w) -> std::optional<std::size_t> {
+        for(auto k = 0uz; k < workers; k++) {
+            auto& q = queues[(w + k) % workers];
+            const auto lock = std::scoped_lock{ q.mutex };
+            if (q.cuts.empty())
+                continue;
+
+            const auto cut = k == 0 ? q.cuts.back() : q.cuts.front();
+            if (k == 0)
+                q.cuts.pop_back();
+            else
+                q.cuts.pop_front();
+            return cut;
+        }
+
+        return std::nullopt;
+    };
+
+    // Each worker writes only the results of the cuts it took.
+    const auto work = [&](const std::size_t w) {
+        auto s = scratch{};
+        while(const auto cut = next(w))
+            results[cut.value()] = evaluate(tree, vm, cuts[cut.value()], s);
+    };
+
+    auto pool = std::vector<std::jthread>{};
+    pool.reserve(workers - 1);
+    for(auto w = 1uz; w < workers; w++)
+        pool.emplace_back(work, w);
+
+    work(0);
+}
+
+constexpr inline flat_execution_result parallel_evaluator::simplify(ast& tree, const node_index root, vm& vm)
+{
+    subtrees = 0;
+    if (tree.size() < threshold)
+        return interpreter::simplify(tree, root, vm);
+
+    measure(tree, root);
+    resolve_symbols(tree, root, vm);
+    plan(tree, root);
+
+    subtrees = cuts.size();
+    results.assign(cuts.size(), std::nullopt);
+
+    auto sequential = threads == 1 || cuts.size() <= 1;
+    if consteval {
+        sequential = true;
+    }
+
+    if (sequential) {
+        auto s = scratch{};
+        for(auto i = 0uz; i < cuts.size(); i++)
+            results[i] = evaluate(tree, vm, cuts[i], s);
+    } else {
+        run_parallel(tree, vm);
+    }
+
+    auto memo = flat_simplify_memo(tree.size());
+    for(auto i = 0uz; i < cuts.size(); i++)
+        if (results[i].has_value())
+            memo[cuts[i]] = results[i].value();
+
+    return interpreter::simplify(tree, root, vm, memo);
+}
+
+constexpr inline execution_result parallel_evaluator::simplify(const node& root_node, vm& vm)
+{
+    auto tree = ast{};
+    const auto root = copy_node(root_node, tree);
+
+    auto result = simplify(tree, root, vm);
+    if (!result.has_value())
+        return make_execution_error(std::move(result.error().error));
+
+    if (std::holds_alternative<number>(result.value()))
+        return make_execution_result<number>(std::get<number>(result.value()));
+
+    return execution_result{ std::in_place_t{}, std::in_place_type_t<node>{}, copy_node(tree, std::get<node_index>(result.value())) };
+}
+
+}
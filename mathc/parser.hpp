@@ -1,25 +1,37 @@
 #pragma once
 
 #include <cassert>
-#include <memory>
+#include <cstdint>
 #include <optional>
+#include <span>
+#include <string_view>
 #include <utility>
+#include <vector>
 
+#include <ast.hpp>
 #include <common.hpp>
 #include <functions.hpp>
+#include <lexer.hpp>
 #include <node.hpp>
+#include <stats.hpp>
+#include <symbols.hpp>
 #include <token.hpp>
 
 namespace mathc
 {
 
+// Messages are static: a failed parse allocates nothing. token says where, and for
+// "Invalid number." what.
 struct parse_error
 {
     token token;
-    std::string error;
+    std::string_view error;
 };
 
-using parse_result = std::expected<node, parse_error>;
+template<typename T>
+using basic_parse_result = std::expected<T, parse_error>;
+
+using parse_result = basic_parse_result<node>;
 
 template<typename T, typename... Args>
 constexpr static inline parse_result make_parse_result_node(Args&&... args)
@@ -29,59 +41,163 @@ constexpr static inline parse_result make_parse_result_node(Args&&... args)
                          std::forward<Args>(args)... };
 }
 
-struct [[nodiscard]]  parser
+// Builders decide what the parser produces: tree_builder makes the node variant tree,
+// arena_builder appends into an ast and hands out indices. Given a symbol_table, both
+// intern symbols as they are parsed so later stages never look names up again; given a
+// function_table, calls resolve against it instead of against the builtins alone.
+
+struct tree_builder
+{
+    using output_type = node;
+
+    symbol_table* symbols{ nullptr };
+    const function_table* functions{ nullptr };
+
+    constexpr tree_builder() = default;
+    constexpr explicit tree_builder(symbol_table& s) : symbols(&s) {}
+    constexpr tree_builder(symbol_table& s, const function_table& f) : symbols(&s), functions(&f) {}
+
+    constexpr function_id find_function(const std::string_view name) const { return resolve_function(functions, name); }
+
+    constexpr static node make_constant(const number& value)
+    {
+        count_stat(&pipeline_stats::nodes);
+        return make_node<constant_node>(value);
+    }
+
+    constexpr node make_symbol(const std::string_view symbol) const
+    {
+        count_stat(&pipeline_stats::nodes);
+        return make_node<symbol_node>(std::string{ symbol }, symbols ? symbols->intern(symbol) : null_symbol);
+    }
+
+    constexpr static node make_op(node&& left, node&& right, const operation_type type)
+    {
+        count_stat(&pipeline_stats::nodes);
+        return make_node<op_node>(node_ptr{ std::move(left) },
+                                  node_ptr{ std::move(right) },
+                                  type);
+    }
+
+    constexpr static node make_function_call(const std::string_view function_name, const function_id id,
+                                             const std::span<node> arguments)
+    {
+        count_stat(&pipeline_stats::nodes);
+        return make_node<function_call_node>(std::string{ function_name },
+                                             std::vector<node>{ std::make_move_iterator(arguments.begin()),
+                                                                std::make_move_iterator(arguments.end()) },
+                                             id);
+    }
+};
+
+struct arena_builder
+{
+    using output_type = node_index;
+
+    ast& tree;
+    symbol_table* symbols{ nullptr };
+    const function_table* functions{ nullptr };
+
+    constexpr explicit arena_builder(ast& t) : tree(t) {}
+    constexpr arena_builder(ast& t, symbol_table& s) : tree(t), symbols(&s) {}
+    constexpr arena_builder(ast& t, symbol_table& s, const function_table& f) : tree(t), symbols(&s), functions(&f) {}
+
+    constexpr function_id find_function(const std::string_view name) const { return resolve_function(functions, name); }
+
+    constexpr node_index make_constant(const number& value) const
+    {
+        count_stat(&pipeline_stats::nodes);
+        return tree.make_constant(value);
+    }
+
+    constexpr node_index make_symbol(const std::string_view symbol) const
+    {
+        count_stat(&pipeline_stats::nodes);
+        return tree.make_symbol(symbol, symbols ? symbols->intern(symbol) : null_symbol);
+    }
+
+    constexpr node_index make_op(const node_index left, const node_index right, const operation_type type) const
+    {
+        count_stat(&pipeline_stats::nodes);
+        return tree.make_op(left, right, type);
+    }
+
+    constexpr node_index make_function_call(const std::string_view function_name, const function_id id,
+                                            const std::span<node_index> arguments) const
+    {
+        count_stat(&pipeline_stats::nodes);
+        return tree.make_function_call(function_name, arguments, id);
+    }
+};
+
+template<typename Output>
+struct parse_scratch;
+
+template<typename Builder, token_source Source = span_token_source>
+struct [[nodiscard]] basic_parser
 {
-    std::span<const token> tokens{};
-    std::size_t index{ 0 };
+    using output_type = typename Builder::output_type;
+    using result_type = basic_parse_result<output_type>;
+
+    Source source;
+    std::optional<token> current_token{};
+    token last_token{};
+    Builder builder;
+    parse_scratch<output_type>* scratch{ nullptr };
 
     template<typename... Args>
     constexpr inline auto make_parse_error(Args&&... args) const
     {
-        const auto current_token = current();
         if (current_token.has_value())
-            return parse_result{ std::unexpect_t{},
-                                 current_token.value(),
-                                 std::forward<Args>(args)... };
+            return result_type{ std::unexpect_t{},
+                                current_token.value(),
+                                std::forward<Args>(args)... };
 
-        return parse_result{ std::unexpect_t{},
-                             *tokens.rbegin(),
-                             std::forward<Args>(args)... };
+        return result_type{ std::unexpect_t{},
+                            last_token,
+                            std::forward<Args>(args)... };
     }
 
     constexpr inline bool current_is(token_type t) const
     {
-        return index < tokens.size() ? tokens[index].type == t : false;
+        return current_token.has_value() ? current_token->type == t : false;
     }
 
     constexpr inline const std::optional<std::reference_wrapper<const token>> current() const
     {
-        return index < tokens.size() ? 
-                   std::make_optional(std::ref(tokens[index])) :
+        return current_token.has_value() ?
+                   std::make_optional(std::cref(current_token.value())) :
                    std::optional<std::reference_wrapper<const token>>{};
     }
 
-    constexpr inline const std::optional<std::reference_wrapper<const token>> peek() const
+    constexpr inline bool consume()
     {
-        return index + 1 < tokens.size() ?
-                   std::make_optional(std::ref(tokens[index + 1])) :
-                   std::optional<std::reference_wrapper<const token>>{};
+        if (!current_token.has_value())
+            return false;
+
+        last_token = current_token.value();
+        current_token = source.next();
+        return true;
     }
 
-    constexpr inline bool consume() { return (index++) < tokens.size(); }
+    constexpr result_type parse();
+    constexpr result_type parse_expression();
 
-    constexpr parse_result parse();
-    constexpr parse_result parse_expression();
-    constexpr parse_result parse_term();
-    constexpr parse_result parse_factor();
-    constexpr parse_result parse_var();
+    constexpr result_type parse_constant();
+    constexpr result_type parse_symbol();
 
-    constexpr parse_result parse_constant();
-    constexpr parse_result parse_symbol();
-    constexpr parse_result parse_function_call(const std::string_view function_name);
+    template<typename... Args>
+    constexpr static result_type parse(const std::span<const token> tokens, Args&&... builder_args);
 
-    constexpr parse_result parse_paren_expression();
+    // Pulls tokens from the lexer as it goes; the token sequence is never materialized.
+    template<typename... Args>
+    constexpr static result_type parse(const std::string_view buffer, Args&&... builder_args);
 
-    constexpr static parse_result parse(const std::span<const token> tokens);
+    // As above, with the parser's stacks kept in scratch: reused across parses, they stop
+    // allocating once they have grown to the deepest expression seen.
+    template<typename... Args>
+    constexpr static result_type parse(const std::string_view buffer, parse_scratch<output_type>& scratch,
+                                       Args&&... builder_args);
 
     template<token_type t, token_type... ts>
     constexpr inline std::tuple<bool, token_type> current_token_is()
@@ -101,12 +217,21 @@ struct [[nodiscard]]  parser
     }
 
 private:
-    parser() = default;
+    template<typename, token_source>
+    friend struct basic_parser;
+
+    constexpr basic_parser(Source&& s, Builder&& b) : source(std::move(s)), builder(std::move(b)) {}
+
+    constexpr result_type parse_source();
 };
 
+using parser = basic_parser<tree_builder>;
+using arena_parser = basic_parser<arena_builder>;
+
 // Implementation
 
-constexpr inline parse_result parser::parse()
+template<typename Builder, token_source Source>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse()
 {
     return parse_expression();
 }
@@ -121,190 +246,273 @@ constexpr inline parse_result parser::parse()
 // <factor> = ['+'|'-'] <var> { ^ <var> }
 // <var> = <constant> | <symbol> [<function_call>] | <paren_expression>
 // <paren_expression> = '(' <expr> ')'
-// <function_call> = '(' <expr> { ',' <expr> } ')' 
+// <function_call> = '(' <expr> { ',' <expr> } ')'
+//
+// Parsed without recursion: every '(' pushes a parse_frame holding the partial <expr>,
+// <term> and <factor> of its group, and each token is handled once at the innermost
+// frame, so nesting depth only costs frames on the heap.
 
-constexpr inline parse_result parser::parse_expression()
+template<typename Output>
+struct parse_frame
 {
-    PROPAGATE_ERROR(term, parse_term());
-
-    while(true) {
-        const auto [found, type] = current_token_is<token_type::op_add, token_type::op_sub>();
-        if (!found) break;
-
-        assert(consume());
-        PROPAGATE_ERROR(term2, parse_term());
-        term = make_node<op_node>(std::make_unique<node>(std::move(term)),
-                                  std::make_unique<node>(std::move(term2)),
-                                  (type == token_type::op_sub ? operation_type::sub : operation_type::add));
-    }
-
-    return term_result;
-}
+    enum class group : std::uint8_t
+    {
+        root,
+        paren,
+        function_call
+    };
+
+    group type{ group::root };
+    std::string_view function_name{};
+    function_id function{ null_function };
+    std::size_t arguments{ 0 };  // function_call: where its arguments start on parse_scratch::arguments
+
+    std::optional<Output> expression{};
+    operation_type expression_operation{ operation_type::add };
+    std::optional<Output> term{};
+    operation_type term_operation{ operation_type::mul };
+    bool implicit{ false };  // after an implicit multiplication only more of those continue the term
+    std::optional<Output> factor{};
+    bool negate{ false };
+};
 
-constexpr inline parse_result parser::parse_term()
+// Arguments of every open call share one stack, so frames own no storage of their own.
+template<typename Output>
+struct parse_scratch
 {
-    PROPAGATE_ERROR(factor, parse_factor());
-
-    while(true) {
-        const auto [found, type] = current_token_is<token_type::op_mul,
-                                                    token_type::op_div>();
-        if (!found) break;
-
-        assert(consume());
-        PROPAGATE_ERROR(factor2, parse_factor());
-        factor = make_node<op_node>(std::make_unique<node>(std::move(factor)),
-                                    std::make_unique<node>(std::move(factor2)),
-                                    (type == token_type::op_mul ? operation_type::mul : operation_type::div));
-    }
-
-    while(true) {
-        const auto [implicit_multiplication_found, _] = current_token_is<token_type::number_literal,
-                                                                         token_type::paren_open,
-                                                                         token_type::alpha>();
-        if (!implicit_multiplication_found) break;
-
-        PROPAGATE_ERROR(factor2, parse_factor());
-        factor = make_node<op_node>(std::make_unique<node>(std::move(factor)),
-                                    std::make_unique<node>(std::move(factor2)),
-                                    operation_type::mul);
-    }
-
-    return factor_result;
-}
+    std::vector<parse_frame<Output>> frames{};
+    std::vector<Output> arguments{};
+};
 
-constexpr inline parse_result parser::parse_factor()
+template<typename Builder, token_source Source>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse_expression()
 {
-    bool negate{ false };
-    if (const auto [found, type] = current_token_is<token_type::op_add, token_type::op_sub>(); found) {
-        negate = (type == token_type::op_sub);
-        assert(consume());
-    }
+    using frame = parse_frame<output_type>;
 
-    PROPAGATE_ERROR(var, parse_var());
+    constexpr static auto take = [](std::optional<output_type>& o) {
+        auto value = std::move(o.value());
+        o.reset();
+        return value;
+    };
 
-    if (negate)
-        var = make_node<op_node>(std::make_unique<node>(std::move(var)),
-                                 make_unique_node<constant_node>(number::from_int(-1)),
-                                 operation_type::mul);
-
-    while (true) {
-        const auto [found, _] = current_token_is<token_type::op_exp>();
-        if (!found) break;
-
-        assert(consume());
-        PROPAGATE_ERROR(var2, parse_var());
-        var = make_node<op_node>(std::make_unique<node>(std::move(var)),
-                                 std::make_unique<node>(std::move(var2)),
-                                 operation_type::exp);
-    }
-
-    return var_result;
-}
-
-constexpr inline parse_result parser::parse_paren_expression()
-{
-    if (const auto [found, _] = current_token_is<token_type::paren_open>(); !found)
-        return make_parse_error("Expected (.");
+    auto local = parse_scratch<output_type>{};
+    auto& frames = scratch ? scratch->frames : local.frames;
+    auto& arguments = scratch ? scratch->arguments : local.arguments;
+    frames.clear();
+    arguments.clear();
+    frames.emplace_back();
 
-    assert(consume());
-    PROPAGATE_ERROR(expr, parse_expression());
-    if (const auto [found, _] = current_token_is<token_type::paren_close>(); !found)
-        return make_parse_error("Expected ).");
+    // factor: at the start of a <factor>, var: at a <var> (the right side of '^')
+    auto at_factor = true;
 
-    assert(consume());
-    return expr_result;
-}
+    while(true) {
+        if (at_factor) {
+            if (const auto [found, type] = current_token_is<token_type::op_add, token_type::op_sub>(); found) {
+                frames.back().negate = (type == token_type::op_sub);
+                assert(consume());
+            }
+        }
 
-constexpr inline parse_result parser::parse_var()
-{
-    if (const auto [constant_found, _] = current_token_is<token_type::number_literal>(); constant_found) {
-        PROPAGATE_ERROR(constant, parse_constant());
-        return constant_result;
-    }
+        // <var>
+        std::optional<output_type> value{};
+        if (const auto [found, type] = current_token_is<token_type::number_literal,
+                                                        token_type::alpha,
+                                                        token_type::paren_open>(); !found) {
+            return make_parse_error("Unexpected token.");
+        } else if (type == token_type::number_literal) {
+            auto constant = parse_constant();
+            if (!constant.has_value())
+                return constant;
+            value = std::move(constant.value());
+        } else if (type == token_type::alpha) {
+            const auto name = current().value().get().value;
+            if (const auto function = builder.find_function(name); function != null_function) {
+                assert(consume());
+                if (const auto [paren_found, _] = current_token_is<token_type::paren_open>(); !paren_found)
+                    return make_parse_error("Expected function call.");
 
-    if (const auto [symbol_found, _] = current_token_is<token_type::alpha>(); symbol_found) {
-        PROPAGATE_ERROR(symbol, parse_symbol());
-        const auto& value = std::get<symbol_node>(symbol).value;
+                assert(consume());
+                frames.emplace_back(frame{ .type = frame::group::function_call,
+                                           .function_name = name,
+                                           .function = function,
+                                           .arguments = arguments.size() });
+                record_depth(frames.size() - 1);
+                at_factor = true;
+                continue;
+            }
 
-        if (const auto* function = find_function(value); function) {
-            PROPAGATE_ERROR(function_call, parse_function_call(value));
-            return function_call_result;
+            auto symbol = parse_symbol();
+            if (!symbol.has_value())
+                return symbol;
+            value = std::move(symbol.value());
+        } else {
+            assert(consume());
+            frames.emplace_back(frame{ .type = frame::group::paren });
+            record_depth(frames.size() - 1);
+            at_factor = true;
+            continue;
         }
 
-        return symbol_result;
-    }
-
-    if (const auto [paren_found, _] = current_token_is<token_type::paren_open>(); paren_found) {
-        PROPAGATE_ERROR(expr, parse_paren_expression());
-        return expr_result;
-    }
-
-    return make_parse_error("Unexpected token.");
-}
+        // Folds the finished <var> into the innermost frame; a closed group becomes a <var>
+        // of the frame below it.
+        while(true) {
+            auto& f = frames.back();
+
+            if (f.factor.has_value()) {
+                f.factor = builder.make_op(take(f.factor), take(value), operation_type::exp);
+            } else if (f.negate) {
+                f.factor = builder.make_op(take(value), builder.make_constant(number::from_int(-1)), operation_type::mul);
+                f.negate = false;
+            } else {
+                f.factor = take(value);
+            }
 
-constexpr inline parse_result parser::parse_function_call(const std::string_view function_name)
-{
-    if (const auto [paren_found, _] = current_token_is<token_type::paren_open>(); !paren_found)
-        return make_parse_error("Expected function call.");
+            if (const auto [found, _] = current_token_is<token_type::op_exp>(); found) {
+                assert(consume());
+                at_factor = false;
+                break;
+            }
 
-    assert(consume());
+            if (f.term.has_value())
+                f.term = builder.make_op(take(f.term), take(f.factor), f.term_operation);
+            else
+                f.term = take(f.factor);
+
+            if (!f.implicit) {
+                if (const auto [found, type] = current_token_is<token_type::op_mul, token_type::op_div>(); found) {
+                    assert(consume());
+                    f.term_operation = (type == token_type::op_mul ? operation_type::mul : operation_type::div);
+                    at_factor = true;
+                    break;
+                }
+            }
 
-    auto result = make_parse_result_node<function_call_node>(std::string{ function_name }, std::vector<node>{});
-    auto& node = std::get<function_call_node>(result.value());
+            if (const auto [found, _] = current_token_is<token_type::number_literal,
+                                                         token_type::paren_open,
+                                                         token_type::alpha>(); found) {
+                f.implicit = true;
+                f.term_operation = operation_type::mul;
+                at_factor = true;
+                break;
+            }
 
-    while(true) {
-        PROPAGATE_ERROR(expr, parse_expression());
-        node.arguments.emplace_back(std::move(expr));
+            f.implicit = false;
+            if (f.expression.has_value())
+                f.expression = builder.make_op(take(f.expression), take(f.term), f.expression_operation);
+            else
+                f.expression = take(f.term);
 
-        if (const auto [close_token, type] =
-            current_token_is<token_type::comma, token_type::paren_close>(); close_token) {
-            if (type == token_type::comma) {
-                assert(consume());
-                continue;
-            } else if (type == token_type::paren_close) {
+            if (const auto [found, type] = current_token_is<token_type::op_add, token_type::op_sub>(); found) {
                 assert(consume());
+                f.expression_operation = (type == token_type::op_sub ? operation_type::sub : operation_type::add);
+                at_factor = true;
                 break;
             }
-        }
 
-        return make_parse_error("Junk encountered while parsing function arguments.");
-    }
+            switch(f.type) {
+                case frame::group::root:
+                    return result_type{ take(f.expression) };
+
+                case frame::group::paren:
+                    if (const auto [found, _] = current_token_is<token_type::paren_close>(); !found)
+                        return make_parse_error("Expected ).");
+
+                    assert(consume());
+                    value = take(f.expression);
+                    frames.pop_back();
+                    continue;
+
+                case frame::group::function_call:
+                    arguments.emplace_back(take(f.expression));
+                    if (const auto [found, type] = current_token_is<token_type::comma, token_type::paren_close>(); found) {
+                        assert(consume());
+                        if (type == token_type::comma) {
+                            at_factor = true;
+                            break;
+                        }
+
+                        value = builder.make_function_call(f.function_name, f.function,
+                                                           std::span{ arguments }.subspan(f.arguments));
+                        arguments.erase(std::next(arguments.begin(), static_cast<long>(f.arguments)), arguments.end());
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    return make_parse_error("Junk encountered while parsing function arguments.");
+            }
 
-    return result;
+            break;
+        }
+    }
 }
 
-constexpr inline parse_result parser::parse_symbol()
+template<typename Builder, token_source Source>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse_symbol()
 {
     if (const auto [is_symbol, _] = current_token_is<token_type::alpha>(); !is_symbol)
         return make_parse_error("Invalid symbol encountered.");
 
-    const auto& token = current().value().get();
+    const auto token = current().value().get();
     assert(consume());
 
-    return make_parse_result_node<symbol_node>(token.value);
+    return result_type{ builder.make_symbol(token.value) };
 }
 
-constexpr inline parse_result parser::parse_constant()
+template<typename Builder, token_source Source>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse_constant()
 {
     if (const auto [is_number, _] = current_token_is<token_type::number_literal>(); !is_number)
         return make_parse_error("Not a number.");
 
     auto number = number::from_token(current().value().get());
     if (!number.has_value())
-        return make_parse_error(std::format("Invalid number: {}", current().value().get().value));
+        return make_parse_error("Invalid number.");
 
     assert(consume());
-    return make_parse_result_node<constant_node>(std::move(number.value()));
+    return result_type{ builder.make_constant(number.value()) };
+}
+
+template<typename Builder, token_source Source>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse_source()
+{
+    const auto timer = stage_timer{ pipeline_stage::parse };
+    current_token = source.next();
+    if (!current_token.has_value())
+        return result_type{ std::unexpect_t{}, token{}, "Expected expression",  };
+
+    return parse();
 }
 
-constexpr inline parse_result parser::parse(const std::span<const token> tokens)
+template<typename Builder, token_source Source>
+template<typename... Args>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse(const std::span<const token> tokens,
+                                                                                                 Args&&... builder_args)
 {
-    if (tokens.size() == 0)
-        return parse_result{ std::unexpect_t{}, token{}, "Expected expression",  };
+    basic_parser<Builder, span_token_source> p{ span_token_source{ tokens },
+                                                Builder{ std::forward<Args>(builder_args)... } };
+    return p.parse_source();
+}
 
-    parser p;
-    p.tokens = tokens;
-    return p.parse();
+template<typename Builder, token_source Source>
+template<typename... Args>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse(const std::string_view buffer,
+                                                                                                 Args&&... builder_args)
+{
+    basic_parser<Builder, lexer> p{ lexer::stream(buffer),
+                                    Builder{ std::forward<Args>(builder_args)... } };
+    return p.parse_source();
+}
+
+template<typename Builder, token_source Source>
+template<typename... Args>
+constexpr inline basic_parser<Builder, Source>::result_type basic_parser<Builder, Source>::parse(const std::string_view buffer,
+                                                                                                 parse_scratch<output_type>& scratch,
+                                                                                                 Args&&... builder_args)
+{
+    basic_parser<Builder, lexer> p{ lexer::stream(buffer),
+                                    Builder{ std::forward<Args>(builder_args)... } };
+    p.scratch = &scratch;
+    return p.parse_source();
 }
 
 }
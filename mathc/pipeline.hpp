@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mathc
+{
+
+// Runs independent lines on several threads and hands their output back in input order.
+// The input is cut after a newline every chunk_size bytes or so; each worker makes its own
+// state once (a vm, an ast: nothing is shared) and turns one chunk at a time into its output
+// text. Finished chunks wait in a reorder buffer of window slots until every chunk before
+// them has been emitted, so memory stays bounded however far ahead the fastest worker gets:
+// a worker that is window chunks ahead waits.
+struct chunk_pipeline
+{
+    // make(): a worker, called once per thread. worker(chunk) -> std::string: the chunk's
+    // output. emit(std::string_view): called on this thread, in order.
+    void run(std::string_view contents, auto&& make, auto&& emit);
+
+    std::size_t threads{ 0 };          // 0: one per hardware thread
+    std::size_t chunk_size{ 1u << 20 };  // bytes, rounded up to the end of a line
+    std::size_t window{ 0 };           // chunks in flight; 0: four per thread
+
+private:
+    // The chunk starting at from, or an empty view at the end.
+    constexpr std::string_view chunk_at(std::string_view contents, std::size_t from) const;
+};
+
+// Implementation
+
+constexpr inline std::string_view chunk_pipeline::chunk_at(const std::string_view contents, const std::size_t from) const
+{
+    if (from >= contents.size())
+        return {};
+
+    const auto cut = contents.find('\n', std::min(contents.size(), from + std::max(chunk_size, std::size_t{ 1 }) - 1));
+    return contents.substr(from, cut == std::string_view::npos ? std::string_view::npos : cut + 1 - from);
+}
+
+inline void chunk_pipeline::run(const std::string_view contents, auto&& make, auto&& emit)
+{
+    const auto hardware = std::max(1uz, static_cast<std::size_t>(std::thread::hardware_concurrency()));
+    const auto workers = threads == 0 ? hardware : threads;
+    const auto slots = window == 0 ? 4 * workers : window;
+
+    auto mutex = std::mutex{};
+    auto claimable = std::condition_variable{};  // a slot came free
+    auto finished = std::condition_variable{};   // the next chunk to emit is done
+
+    auto reorder = std::vector<std::optional<std::string>>(slots);
+    auto next_chunk = 0uz;   // claimed so far
+    auto next_offset = 0uz;  // where the next claimed chunk starts
+    auto emitted = 0uz;
+    auto total = std::optional<std::size_t>{};  // chunks, once the last has been claimed
+
+    const auto work = [&] {
+        auto worker = make();
+
+        while(true) {
+            auto chunk = std::string_view{};
+            auto index = 0uz;
+            {
+                auto lock = std::unique_lock{ mutex };
+                claimable.wait(lock, [&] { return total.has_value() || next_chunk < emitted + slots; });
+                if (total.has_value())
+                    return;
+
+                chunk = chunk_at(contents, next_offset);
+                if (chunk.empty()) {
+                    total = next_chunk;
+                    claimable.notify_all();
+                    finished.notify_all();
+                    return;
+                }
+
+                index = next_chunk++;
+                next_offset += chunk.size();
+            }
+
+            auto output = worker(chunk);
+
+            const auto lock = std::scoped_lock{ mutex };
+            reorder[index % slots] = std::move(output);
+            if (index == emitted)
+                finished.notify_all();
+        }
+    };
+
+    auto pool = std::vector<std::jthread>{};
+    for(auto w = 0uz; w < workers; w++)
+        pool.emplace_back(work);
+
+    // Emitting holds no lock, so workers keep filling other slots meanwhile.
+    while(true) {
+        auto output = std::string{};
+        {
+            auto lock = std::unique_lock{ mutex };
+            finished.wait(lock, [&] { return reorder[emitted % slots].has_value() || total == emitted; });
+            if (total == emitted)
+                break;
+
+            output = std::move(reorder[emitted % slots].value());
+            reorder[emitted % slots].reset();
+            emitted++;
+        }
+
+        claimable.notify_all();
+        emit(std::string_view{ output });
+    }
+}
+
+}
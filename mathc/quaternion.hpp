@@ -0,0 +1,432 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <format>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <common.hpp>
+#include <math.hpp>
+#include <simd.hpp>
+
+namespace mathc
+{
+
+// Rotation math next to the scalar pipeline: vec3, vec4 and quaternion values, and kernels
+// that rotate and compose whole arrays of them.
+//
+// number stays a NaN-boxed scalar, which the vm's stack, program constants and batch columns
+// all rely on, so these are values of their own rather than kinds of number. They meet the
+// pipeline at columns: batch_evaluator fills one double column per component, and the
+// kernels below take those columns as they are, one element per vector lane (4 per avx2
+// register, 8 per avx512, 2 per neon). Arrays of values are transposed into columns a block
+// at a time. From an expression, rotation.hpp lowers rotate(quat(...), vec3(...)) onto
+// these columns, and the rotate_x/y/z and qmul_w/x/y/z builtins give single components.
+//
+// Quaternions are w + xi + yj + zk. Rotation by q assumes q is a unit quaternion.
+
+struct vec3
+{
+    double x{ 0.0 };
+    double y{ 0.0 };
+    double z{ 0.0 };
+
+    constexpr vec3 operator+(const vec3& other) const { return { x + other.x, y + other.y, z + other.z }; }
+    constexpr vec3 operator-(const vec3& other) const { return { x - other.x, y - other.y, z - other.z }; }
+    constexpr vec3 operator*(const double s) const { return { x * s, y * s, z * s }; }
+    constexpr bool operator==(const vec3&) const = default;
+
+    constexpr double dot(const vec3& other) const { return x * other.x + y * other.y + z * other.z; }
+    constexpr vec3 cross(const vec3& other) const
+    {
+        return { y * other.z - z * other.y, z * other.x - x * other.z, x * other.y - y * other.x };
+    }
+};
+
+struct vec4
+{
+    double x{ 0.0 };
+    double y{ 0.0 };
+    double z{ 0.0 };
+    double w{ 0.0 };
+
+    constexpr vec4 operator+(const vec4& other) const { return { x + other.x, y + other.y, z + other.z, w + other.w }; }
+    constexpr vec4 operator-(const vec4& other) const { return { x - other.x, y - other.y, z - other.z, w - other.w }; }
+    constexpr vec4 operator*(const double s) const { return { x * s, y * s, z * s, w * s }; }
+    constexpr bool operator==(const vec4&) const = default;
+
+    constexpr double dot(const vec4& other) const { return x * other.x + y * other.y + z * other.z + w * other.w; }
+    constexpr vec3 xyz() const { return { x, y, z }; }
+};
+
+struct quaternion
+{
+    double w{ 1.0 };
+    double x{ 0.0 };
+    double y{ 0.0 };
+    double z{ 0.0 };
+
+    constexpr quaternion operator+(const quaternion& other) const
+    {
+        return { w + other.w, x + other.x, y + other.y, z + other.z };
+    }
+    constexpr quaternion operator-(const quaternion& other) const
+    {
+        return { w - other.w, x - other.x, y - other.y, z - other.z };
+    }
+    constexpr quaternion operator*(const double s) const { return { w * s, x * s, y * s, z * s }; }
+    constexpr quaternion operator*(const quaternion& other) const;
+    constexpr bool operator==(const quaternion&) const = default;
+
+    constexpr quaternion conjugate() const { return { w, -x, -y, -z }; }
+    constexpr double norm() const { return math::sqrt(w * w + x * x + y * y + z * z).promote_to_double(); }
+    constexpr quaternion normalized() const { return *this * (1.0 / norm()); }
+
+    // q v q*, for unit q.
+    constexpr vec3 rotate(const vec3& v) const;
+    constexpr vec4 rotate(const vec4& v) const;
+
+    constexpr vec4 as_vec4() const { return { x, y, z, w }; }
+    constexpr static quaternion from_vec4(const vec4& v) { return { v.w, v.x, v.y, v.z }; }
+};
+
+// One double column per component, as batch_evaluator writes them. Every column has the
+// same number of rows.
+template<typename T>
+struct basic_vec3_columns
+{
+    std::span<T> x, y, z;
+};
+
+template<typename T>
+struct basic_quaternion_columns
+{
+    std::span<T> w, x, y, z;
+};
+
+using vec3_columns = basic_vec3_columns<double>;
+using quaternion_columns = basic_quaternion_columns<double>;
+using const_quaternion_columns = basic_quaternion_columns<const double>;
+
+struct rotation_kernel_table
+{
+    std::string_view name;
+
+    void(*rotate)(const_quaternion_columns rotations, vec3_columns points);  // points in place
+    void(*multiply)(quaternion_columns left, const_quaternion_columns right);  // left = left * right
+};
+
+// Implementation
+
+// Written once for a double and for a register of them: T is either.
+namespace detail
+{
+
+template<typename T>
+[[gnu::always_inline]] constexpr static inline void hamilton(T& w1, T& x1, T& y1, T& z1,
+                                                            const T w2, const T x2, const T y2, const T z2)
+{
+    const auto w = w1 * w2 - x1 * x2 - y1 * y2 - z1 * z2;
+    const auto x = w1 * x2 + x1 * w2 + y1 * z2 - z1 * y2;
+    const auto y = w1 * y2 - x1 * z2 + y1 * w2 + z1 * x2;
+    const auto z = w1 * z2 + x1 * y2 - y1 * x2 + z1 * w2;
+    w1 = w; x1 = x; y1 = y; z1 = z;
+}
+
+// v + 2w (u x v) + u x (2 (u x v)), with u the vector part: q v q* without forming q*.
+template<typename T>
+[[gnu::always_inline]] constexpr static inline void rotate(const T w, const T x, const T y, const T z,
+                                                          T& px, T& py, T& pz)
+{
+    const auto tx = 2.0 * (y * pz - z * py);
+    const auto ty = 2.0 * (z * px - x * pz);
+    const auto tz = 2.0 * (x * py - y * px);
+    px = px + w * tx + (y * tz - z * ty);
+    py = py + w * ty + (z * tx - x * tz);
+    pz = pz + w * tz + (x * ty - y * tx);
+}
+
+}
+
+constexpr inline quaternion quaternion::operator*(const quaternion& other) const
+{
+    auto product = *this;
+    detail::hamilton(product.w, product.x, product.y, product.z, other.w, other.x, other.y, other.z);
+    return product;
+}
+
+constexpr inline vec3 quaternion::rotate(const vec3& v) const
+{
+    auto r = v;
+    detail::rotate(w, x, y, z, r.x, r.y, r.z);
+    return r;
+}
+
+constexpr inline vec4 quaternion::rotate(const vec4& v) const
+{
+    const auto r = rotate(v.xyz());
+    return { r.x, r.y, r.z, v.w };
+}
+
+struct scalar_rotation_kernels
+{
+    constexpr static void rotate(const const_quaternion_columns q, const vec3_columns p)
+    {
+        for(auto i = 0u; i < p.x.size(); i++)
+            detail::rotate(q.w[i], q.x[i], q.y[i], q.z[i], p.x[i], p.y[i], p.z[i]);
+    }
+
+    constexpr static void multiply(const quaternion_columns l, const const_quaternion_columns r)
+    {
+        for(auto i = 0u; i < l.w.size(); i++)
+            detail::hamilton(l.w[i], l.x[i], l.y[i], l.z[i], r.w[i], r.x[i], r.y[i], r.z[i]);
+    }
+};
+
+constexpr static rotation_kernel_table scalar_rotation_kernel_table
+{
+    "scalar",
+    scalar_rotation_kernels::rotate, scalar_rotation_kernels::multiply,
+};
+
+// Lane i of every register holds element i of a chunk: the same formulas as the scalar
+// kernels, a register of elements at a time, with the tail done one element at a time.
+template<typename D, typename I>
+struct vector_rotation_kernels
+{
+    using v = vector_kernels<D, I>;
+
+    [[gnu::always_inline]] static inline void rotate(const const_quaternion_columns q, const vec3_columns p)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + v::lanes <= p.x.size(); i += v::lanes) {
+            D w{}, x{}, y{}, z{}, px{}, py{}, pz{};
+            v::load(w, q.w, i); v::load(x, q.x, i); v::load(y, q.y, i); v::load(z, q.z, i);
+            v::load(px, p.x, i); v::load(py, p.y, i); v::load(pz, p.z, i);
+
+            detail::rotate(w, x, y, z, px, py, pz);
+
+            v::store(p.x, i, px); v::store(p.y, i, py); v::store(p.z, i, pz);
+        }
+
+        scalar_rotation_kernels::rotate({ q.w.subspan(i), q.x.subspan(i), q.y.subspan(i), q.z.subspan(i) },
+                                        { p.x.subspan(i), p.y.subspan(i), p.z.subspan(i) });
+    }
+
+    [[gnu::always_inline]] static inline void multiply(const quaternion_columns l, const const_quaternion_columns r)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + v::lanes <= l.w.size(); i += v::lanes) {
+            D w1{}, x1{}, y1{}, z1{}, w2{}, x2{}, y2{}, z2{};
+            v::load(w1, l.w, i); v::load(x1, l.x, i); v::load(y1, l.y, i); v::load(z1, l.z, i);
+            v::load(w2, r.w, i); v::load(x2, r.x, i); v::load(y2, r.y, i); v::load(z2, r.z, i);
+
+            detail::hamilton(w1, x1, y1, z1, w2, x2, y2, z2);
+
+            v::store(l.w, i, w1); v::store(l.x, i, x1); v::store(l.y, i, y1); v::store(l.z, i, z1);
+        }
+
+        scalar_rotation_kernels::multiply({ l.w.subspan(i), l.x.subspan(i), l.y.subspan(i), l.z.subspan(i) },
+                                          { r.w.subspan(i), r.x.subspan(i), r.y.subspan(i), r.z.subspan(i) });
+    }
+};
+
+#if defined(__x86_64__)
+
+struct avx2_rotation_kernels
+{
+    using v = vector_rotation_kernels<f64x4, i64x4>;
+
+    [[gnu::target("avx2")]] static void rotate(const const_quaternion_columns q, const vec3_columns p) { v::rotate(q, p); }
+    [[gnu::target("avx2")]] static void multiply(const quaternion_columns l, const const_quaternion_columns r) { v::multiply(l, r); }
+};
+
+struct avx512_rotation_kernels
+{
+    using v = vector_rotation_kernels<f64x8, i64x8>;
+
+    [[gnu::target("avx512f,avx512dq")]] static void rotate(const const_quaternion_columns q, const vec3_columns p) { v::rotate(q, p); }
+    [[gnu::target("avx512f,avx512dq")]] static void multiply(const quaternion_columns l, const const_quaternion_columns r) { v::multiply(l, r); }
+};
+
+constexpr static rotation_kernel_table avx2_rotation_kernel_table
+{
+    "avx2",
+    avx2_rotation_kernels::rotate, avx2_rotation_kernels::multiply,
+};
+
+constexpr static rotation_kernel_table avx512_rotation_kernel_table
+{
+    "avx512",
+    avx512_rotation_kernels::rotate, avx512_rotation_kernels::multiply,
+};
+
+#elif defined(__aarch64__)
+
+struct neon_rotation_kernels
+{
+    using v = vector_rotation_kernels<f64x2, i64x2>;
+
+    static void rotate(const const_quaternion_columns q, const vec3_columns p) { v::rotate(q, p); }
+    static void multiply(const quaternion_columns l, const const_quaternion_columns r) { v::multiply(l, r); }
+};
+
+constexpr static rotation_kernel_table neon_rotation_kernel_table
+{
+    "neon",
+    neon_rotation_kernels::rotate, neon_rotation_kernels::multiply,
+};
+
+#endif
+
+// Every table this cpu can run, widest first: one per entry of available_kernels(), so the
+// same isa is picked for both.
+inline std::span<const rotation_kernel_table* const> available_rotation_kernels()
+{
+    static const auto tables = [] {
+        std::vector<const rotation_kernel_table*> t{};
+        for(const auto* k : available_kernels()) {
+#if defined(__x86_64__)
+            if (k->name == avx512_rotation_kernel_table.name)
+                t.emplace_back(&avx512_rotation_kernel_table);
+            if (k->name == avx2_rotation_kernel_table.name)
+                t.emplace_back(&avx2_rotation_kernel_table);
+#elif defined(__aarch64__)
+            if (k->name == neon_rotation_kernel_table.name)
+                t.emplace_back(&neon_rotation_kernel_table);
+#endif
+            if (k->name == scalar_rotation_kernel_table.name)
+                t.emplace_back(&scalar_rotation_kernel_table);
+        }
+        return t;
+    }();
+
+    return tables;
+}
+
+inline const rotation_kernel_table& rotation_kernels()
+{
+    static const auto& selected = *available_rotation_kernels().front();
+    return selected;
+}
+
+constexpr static inline const rotation_kernel_table& active_rotation_kernels()
+{
+    if consteval {
+        return scalar_rotation_kernel_table;
+    } else {
+        return rotation_kernels();
+    }
+}
+
+// Rotates arrays of values by arrays of rotations, element by element. Values are
+// transposed into columns block_size at a time, run through the column kernels and
+// written back; callers that already hold columns call the kernels directly.
+struct rotation_evaluator
+{
+    constexpr static std::size_t block_size = 256;
+
+    // points[i] = rotations[i] points[i] rotations[i]*; vec4's w is kept. The spans must be
+    // the same length; otherwise nothing is rotated.
+    constexpr batch_result rotate(std::span<const quaternion> rotations, std::span<vec3> points);
+    constexpr batch_result rotate(std::span<const quaternion> rotations, std::span<vec4> points);
+
+    // left[i] = left[i] * right[i], for spans of the same length.
+    constexpr batch_result multiply(std::span<quaternion> left, std::span<const quaternion> right);
+
+    constexpr static batch_result validate(std::size_t expected, std::size_t given);
+
+private:
+    // Four columns of block_size for each operand: w, x, y, z.
+    std::vector<double> left_columns = std::vector<double>(4 * block_size);
+    std::vector<double> right_columns = std::vector<double>(4 * block_size);
+
+    constexpr quaternion_columns columns(std::vector<double>& storage, const std::size_t rows)
+    {
+        const auto s = std::span{ storage };
+        return { s.subspan(0, rows), s.subspan(block_size, rows), s.subspan(2 * block_size, rows),
+                 s.subspan(3 * block_size, rows) };
+    }
+
+    constexpr batch_result rotate_points(std::span<const quaternion> rotations, auto points);
+};
+
+constexpr inline batch_result rotation_evaluator::validate(const std::size_t expected, const std::size_t given)
+{
+    if (given != expected)
+        return batch_result{ std::unexpect_t{}, std::format("Expected {} rotations, got {}.", expected, given) };
+
+    return {};
+}
+
+constexpr inline batch_result rotation_evaluator::rotate_points(const std::span<const quaternion> rotations, const auto points)
+{
+    if (const auto valid = validate(points.size(), rotations.size()); !valid.has_value())
+        return valid;
+
+    const auto& kernels = active_rotation_kernels();
+
+    for(auto start = std::size_t{ 0 }; start < points.size(); start += block_size) {
+        const auto rows = std::min(block_size, points.size() - start);
+        const auto q = columns(right_columns, rows);
+        const auto p = columns(left_columns, rows);
+
+        for(auto i = 0uz; i < rows; i++) {
+            const auto& r = rotations[start + i];
+            const auto& point = points[start + i];
+            q.w[i] = r.w; q.x[i] = r.x; q.y[i] = r.y; q.z[i] = r.z;
+            p.x[i] = point.x; p.y[i] = point.y; p.z[i] = point.z;
+        }
+
+        kernels.rotate({ q.w, q.x, q.y, q.z }, { p.x, p.y, p.z });
+
+        for(auto i = 0uz; i < rows; i++) {
+            auto& point = points[start + i];
+            point.x = p.x[i]; point.y = p.y[i]; point.z = p.z[i];
+        }
+    }
+
+    return {};
+}
+
+constexpr inline batch_result rotation_evaluator::rotate(const std::span<const quaternion> rotations, const std::span<vec3> points)
+{
+    return rotate_points(rotations, points);
+}
+
+constexpr inline batch_result rotation_evaluator::rotate(const std::span<const quaternion> rotations, const std::span<vec4> points)
+{
+    return rotate_points(rotations, points);
+}
+
+constexpr inline batch_result rotation_evaluator::multiply(const std::span<quaternion> left, const std::span<const quaternion> right)
+{
+    if (const auto valid = validate(left.size(), right.size()); !valid.has_value())
+        return valid;
+
+    const auto& kernels = active_rotation_kernels();
+
+    for(auto start = std::size_t{ 0 }; start < left.size(); start += block_size) {
+        const auto rows = std::min(block_size, left.size() - start);
+        const auto l = columns(left_columns, rows);
+        const auto r = columns(right_columns, rows);
+
+        for(auto i = 0uz; i < rows; i++) {
+            const auto& a = left[start + i];
+            const auto& b = right[start + i];
+            l.w[i] = a.w; l.x[i] = a.x; l.y[i] = a.y; l.z[i] = a.z;
+            r.w[i] = b.w; r.x[i] = b.x; r.y[i] = b.y; r.z[i] = b.z;
+        }
+
+        kernels.multiply(l, { r.w, r.x, r.y, r.z });
+
+        for(auto i = 0uz; i < rows; i++)
+            left[start + i] = { l.w[i], l.x[i], l.y[i], l.z[i] };
+    }
+
+    return {};
+}
+
+}
@@ -0,0 +1,537 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ast.hpp>
+#include <node.hpp>
+#include <number.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// Shrinks residual trees with algebra the interpreter doesn't do. Every op node, children
+// first, goes through a table of rules; passes repeat until none fires, up to max_passes or
+// until budget node visits are spent:
+//
+//   fold_constants    2 * 3 -> 6
+//   remove_identities x * 1, x + 0, x - 0, x ^ 1 -> x; d / 1 -> d; d * 0 -> 0.0; d ^ 0, 1 ^ d -> 1.0
+//   collect_products  2 * x * 3 -> 6 * x, x * -1 * -1 -> x, x * y * x -> x ^ 2 * y
+//   collect_sums      2 * x + y - x -> x + y, 1 + x + 2 -> x + 3
+//
+// Products become a constant times the other factors, in their order; sums become their
+// terms in order of first appearance, the constant last. Like terms and factors are found by
+// structure, so x * y and y * x are not alike. The rules assume finite, nonzero values, as
+// algebra does: x * 0 is 0 even where x would be infinite, x * x ^ -1 is 1 even where x
+// would be 0. Identities only match integer constants and keep whether a result is an
+// integer: those that drop x's kind only fire where x is known to be a double, d above, being
+// a double constant or a quotient. x * 0 becomes 0 * x rather than 0. Terms that cancel
+// completely still leave the integer 0, x * x ^ -1 the integer 1, and reassociated double
+// coefficients can round differently.
+//
+// Rewritten nodes are appended to the ast; unchanged subtrees keep their index.
+struct rewriter
+{
+    constexpr node_index rewrite(ast& tree, node_index root);
+
+    // Same structure: the same operations on equal constants, symbols and calls.
+    constexpr bool same(const ast& tree, node_index a, node_index b);
+
+    std::size_t max_passes{ 8 };
+    std::size_t budget{ 1u << 22 };  // node visits, over every pass
+
+    std::size_t rewrites{ 0 };  // rules that fired in the last call, for inspection
+
+private:
+    using rule = std::optional<node_index>(rewriter::*)(ast& tree, node_index index);
+
+    struct term
+    {
+        node_index monomial{ null_index };
+        number coefficient{ std::int64_t{ 0 } };
+    };
+
+    struct factor
+    {
+        node_index base{ null_index };
+        std::int64_t power{ 0 };
+    };
+
+    constexpr node_index pass(ast& tree, node_index root);
+
+    constexpr std::optional<node_index> fold_constants(ast& tree, node_index index);
+    constexpr std::optional<node_index> remove_identities(ast& tree, node_index index);
+    constexpr std::optional<node_index> collect_products(ast& tree, node_index index);
+    constexpr std::optional<node_index> collect_sums(ast& tree, node_index index);
+
+    constexpr static std::array<rule, 4> rules{
+        &rewriter::fold_constants,
+        &rewriter::remove_identities,
+        &rewriter::collect_products,
+        &rewriter::collect_sums,
+    };
+
+    // Whether the node's value is a double whatever its symbols are bound to.
+    constexpr static bool known_double(const ast& tree, node_index index);
+
+    constexpr std::uint64_t hash(const ast& tree, node_index index);
+
+    // The entry whose key_of is the same as key, added if there is none. found says which.
+    template<typename entry>
+    constexpr entry& like(const ast& tree, std::vector<entry>& entries, node_index entry::* key_of, node_index key, bool& found);
+
+    // Takes visits from what is left of the budget, or fails and takes nothing.
+    constexpr bool spend(std::size_t visits);
+
+    std::size_t remaining{ 0 };
+
+    // Indexed by node.
+    std::vector<node_index> mapped{};
+    std::vector<bool> chained{};  // continues a parent's sum or product, collected from there
+    std::vector<std::optional<std::uint64_t>> hashes{};
+
+    std::vector<node_index> pending{};
+    std::vector<std::pair<node_index, number>> signed_pending{};
+    std::vector<term> terms{};
+    std::vector<factor> factors{};
+    std::vector<std::uint32_t> slots{};  // open addressing over terms or factors, by hash
+};
+
+// Implementation
+
+constexpr inline node_index rewriter::rewrite(ast& tree, node_index root)
+{
+    rewrites = 0;
+    remaining = budget;
+    hashes.clear();
+
+    for(auto passes = 0uz; passes < max_passes; passes++) {
+        const auto before = rewrites;
+        root = pass(tree, root);
+        if (rewrites == before)
+            break;
+    }
+
+    return root;
+}
+
+constexpr inline bool rewriter::spend(const std::size_t visits)
+{
+    if (visits > remaining) [[unlikely]]
+        return false;
+
+    remaining -= visits;
+    return true;
+}
+
+constexpr inline node_index rewriter::pass(ast& tree, const node_index root)
+{
+    constexpr static auto is_sum = [](const flat_node& n) {
+        return n.type == flat_node_type::op && (n.operation == operation_type::add || n.operation == operation_type::sub);
+    };
+    constexpr static auto is_product = [](const flat_node& n) {
+        return n.type == flat_node_type::op && n.operation == operation_type::mul;
+    };
+
+    // Marks what is reachable from root (mapped) and which nodes only continue a chain.
+    mapped.assign(root + 1, null_index);
+    chained.assign(root + 1, false);
+    pending.assign(1, root);
+    while(!pending.empty()) {
+        const auto index = pending.back();
+        pending.pop_back();
+        if (mapped[index] != null_index)
+            continue;
+        mapped[index] = index;
+
+        const auto& n = tree[index];
+        if (n.type == flat_node_type::op) {
+            for(const auto child : { n.first, n.second }) {
+                const auto& c = tree[child];
+                if ((is_sum(n) && is_sum(c)) || (is_product(n) && is_product(c)))
+                    chained[child] = true;
+                pending.emplace_back(child);
+            }
+        } else if (n.type == flat_node_type::function_call) {
+            for(const auto argument : tree.arguments_of(n))
+                pending.emplace_back(argument);
+        }
+    }
+
+    if (!spend(root + 1))
+        return root;
+
+    // Children have smaller indices, so ascending order rewrites them first.
+    for(auto index = 0u; index <= root; index++) {
+        if (mapped[index] == null_index)
+            continue;
+
+        // Copied, not referenced: rewriting grows tree.nodes.
+        const auto n = tree[index];
+
+        if (n.type == flat_node_type::function_call) {
+            auto arguments = std::vector<node_index>{};
+            for(const auto argument : tree.arguments_of(n))
+                arguments.emplace_back(mapped[argument]);
+            if (!std::ranges::equal(arguments, tree.arguments_of(n)))
+                mapped[index] = tree.make_function_call(std::string{ tree.name(n) }, arguments, n.function);
+            continue;
+        }
+
+        if (n.type != flat_node_type::op)
+            continue;
+
+        auto current = mapped[n.first] == n.first && mapped[n.second] == n.second ?
+                       index : tree.make_op(mapped[n.first], mapped[n.second], n.operation);
+
+        for(const auto r : rules) {
+            if (chained[index] && (r == &rewriter::collect_products || r == &rewriter::collect_sums))
+                continue;
+            if (tree[current].type != flat_node_type::op)
+                break;
+
+            if (const auto rewritten = (this->*r)(tree, current); rewritten.has_value()) {
+                current = rewritten.value();
+                rewrites++;
+            }
+        }
+
+        mapped[index] = current;
+    }
+
+    return mapped[root];
+}
+
+constexpr inline std::optional<node_index> rewriter::fold_constants(ast& tree, const node_index index)
+{
+    const auto n = tree[index];
+    if (tree[n.first].type != flat_node_type::constant || tree[n.second].type != flat_node_type::constant)
+        return std::nullopt;
+
+    return tree.make_constant(apply_operation(n.operation, tree.value(tree[n.first]), tree.value(tree[n.second])));
+}
+
+constexpr inline bool rewriter::known_double(const ast& tree, const node_index index)
+{
+    const auto& n = tree[index];
+    return (n.type == flat_node_type::constant && tree.value(n).is_double()) ||
+           (n.type == flat_node_type::op && n.operation == operation_type::div);
+}
+
+constexpr inline std::optional<node_index> rewriter::remove_identities(ast& tree, const node_index index)
+{
+    const auto n = tree[index];
+    const auto is = [&](const node_index i, const int value) {
+        return tree[i].type == flat_node_type::constant && tree.value(tree[i]) == value;
+    };
+    const auto real = [&](const double value) { return tree.make_constant(number{ value }); };
+
+    switch(n.operation) {
+        case operation_type::add:
+            if (is(n.first, 0)) return n.second;
+            if (is(n.second, 0)) return n.first;
+            break;
+        case operation_type::sub:
+            if (is(n.second, 0)) return n.first;
+            break;
+        case operation_type::mul:
+            if (is(n.first, 1)) return n.second;
+            if (is(n.second, 1)) return n.first;
+            if (is(n.first, 0) && known_double(tree, n.second)) return real(0.0);
+            if (is(n.second, 0) && known_double(tree, n.first)) return real(0.0);
+            break;
+        case operation_type::div:
+            if (is(n.second, 1) && known_double(tree, n.first)) return n.first;
+            break;
+        case operation_type::exp:
+            if (is(n.second, 1)) return n.first;
+            if (is(n.second, 0) && known_double(tree, n.first)) return real(1.0);
+            if (is(n.first, 1) && known_double(tree, n.second)) return real(1.0);
+            break;
+    }
+
+    return std::nullopt;
+}
+
+// Canonical: coefficient * (f1 * f2 * ...), the coefficient left out when it is 1.
+constexpr inline std::optional<node_index> rewriter::collect_products(ast& tree, const node_index index)
+{
+    const auto n = tree[index];
+    if (n.operation != operation_type::mul)
+        return std::nullopt;
+
+    factors.clear();
+    slots.clear();
+    auto coefficient = number{ std::int64_t{ 1 } };
+    auto constants = 0uz;
+    auto merged = false;
+
+    pending.assign(1, index);
+    while(!pending.empty()) {
+        if (!spend(1))
+            return std::nullopt;
+
+        const auto i = pending.back();
+        pending.pop_back();
+        const auto& f = tree[i];
+
+        if (f.type == flat_node_type::op && f.operation == operation_type::mul) {
+            pending.emplace_back(f.second);
+            pending.emplace_back(f.first);
+            continue;
+        }
+
+        if (f.type == flat_node_type::constant) {
+            coefficient = coefficient * tree.value(f);
+            constants++;
+            continue;
+        }
+
+        // x ^ k with an integer k is k factors of x.
+        auto base = i;
+        auto power = std::int64_t{ 1 };
+        if (f.type == flat_node_type::op && f.operation == operation_type::exp &&
+            tree[f.second].type == flat_node_type::constant && tree.value(tree[f.second]).is_int()) {
+            base = f.first;
+            power = tree.value(tree[f.second]).as_int();
+        }
+
+        auto found = false;
+        auto& existing = like(tree, factors, &factor::base, base, found);
+        existing.power += power;
+        merged = merged || found;
+    }
+
+    const auto canonical = !merged && constants <= 1 &&
+                           (constants == 0 || (tree[n.first].type == flat_node_type::constant && !(coefficient == 1)));
+    if (canonical)
+        return std::nullopt;
+
+    // An integer 0 keeps the factors, which may make the product a double.
+    if (coefficient.is_double() && coefficient.as_double() == 0.0)
+        return tree.make_constant(coefficient);
+
+    auto product = null_index;
+    for(const auto& [base, power] : factors) {
+        if (power == 0)
+            continue;
+
+        const auto f = power == 1 ? base : tree.make_op(base, tree.make_constant(number{ power }), operation_type::exp);
+        product = product == null_index ? f : tree.make_op(product, f, operation_type::mul);
+    }
+
+    if (product == null_index)
+        return tree.make_constant(coefficient);
+    if (coefficient == 1)
+        return product;
+    return tree.make_op(tree.make_constant(coefficient), product, operation_type::mul);
+}
+
+// Canonical: like terms merged, in order of first appearance, the constant last.
+constexpr inline std::optional<node_index> rewriter::collect_sums(ast& tree, const node_index index)
+{
+    const auto n = tree[index];
+    if (n.operation != operation_type::add && n.operation != operation_type::sub)
+        return std::nullopt;
+
+    const auto one = number{ std::int64_t{ 1 } };
+    const auto zero = number{ std::int64_t{ 0 } };
+
+    terms.clear();
+    slots.clear();
+    auto constant = zero;
+    auto constants = 0uz;
+    auto constant_last = true;
+    auto merged = false;
+
+    signed_pending.assign(1, { index, one });
+    while(!signed_pending.empty()) {
+        if (!spend(1))
+            return std::nullopt;
+
+        const auto [i, sign] = signed_pending.back();
+        signed_pending.pop_back();
+        const auto& t = tree[i];
+
+        if (t.type == flat_node_type::op && (t.operation == operation_type::add || t.operation == operation_type::sub)) {
+            signed_pending.emplace_back(t.second, t.operation == operation_type::sub ? zero - sign : sign);
+            signed_pending.emplace_back(t.first, sign);
+            continue;
+        }
+
+        if (t.type == flat_node_type::constant) {
+            constant = constant + sign * tree.value(t);
+            constants++;
+            continue;
+        }
+
+        constant_last = constant_last && constants == 0;
+
+        // A canonical product: coefficient * monomial.
+        auto coefficient = sign;
+        auto monomial = i;
+        if (t.type == flat_node_type::op && t.operation == operation_type::mul && tree[t.first].type == flat_node_type::constant) {
+            coefficient = sign * tree.value(tree[t.first]);
+            monomial = t.second;
+        }
+
+        auto found = false;
+        auto& existing = like(tree, terms, &term::monomial, monomial, found);
+        existing.coefficient = found ? existing.coefficient + coefficient : coefficient;
+        merged = merged || found;
+    }
+
+    const auto has_zero = std::ranges::any_of(terms, [](const term& t) { return t.coefficient.promote_to_double() == 0.0; });
+    if (!merged && !has_zero && constants <= 1 && constant_last)
+        return std::nullopt;
+
+    const auto negative = [](const number& value) { return value.promote_to_double() < 0.0; };
+    const auto scaled = [&](const number& coefficient, const node_index monomial) {
+        return coefficient == 1 ? monomial : tree.make_op(tree.make_constant(coefficient), monomial, operation_type::mul);
+    };
+
+    auto sum = null_index;
+    for(const auto& [monomial, coefficient] : terms) {
+        if (coefficient.promote_to_double() == 0.0)
+            continue;
+
+        if (sum == null_index)
+            sum = scaled(coefficient, monomial);
+        else if (negative(coefficient))
+            sum = tree.make_op(sum, scaled(zero - coefficient, monomial), operation_type::sub);
+        else
+            sum = tree.make_op(sum, scaled(coefficient, monomial), operation_type::add);
+    }
+
+    if (sum == null_index)
+        return tree.make_constant(constant);
+    if (constants == 0 || constant.promote_to_double() == 0.0)
+        return sum;
+    if (negative(constant))
+        return tree.make_op(sum, tree.make_constant(zero - constant), operation_type::sub);
+    return tree.make_op(sum, tree.make_constant(constant), operation_type::add);
+}
+
+constexpr inline std::uint64_t rewriter::hash(const ast& tree, const node_index index)
+{
+    if (index >= hashes.size())
+        hashes.resize(tree.size());
+    if (hashes[index].has_value())
+        return hashes[index].value();
+
+    constexpr auto mix = [](const std::uint64_t seed, const std::uint64_t value) {
+        return (seed ^ value) * 0x100000001b3;
+    };
+
+    const auto& n = tree[index];
+    auto h = mix(0xcbf29ce484222325, static_cast<std::uint64_t>(n.type));
+    switch(n.type) {
+        case flat_node_type::constant:
+            h = mix(h, tree.value(n).bits);
+            break;
+        case flat_node_type::symbol:
+            h = mix(h, hash_symbol(tree.name(n)));
+            break;
+        case flat_node_type::op:
+            // Recursive, but only into children not hashed yet.
+            h = mix(mix(mix(h, static_cast<std::uint64_t>(n.operation)), hash(tree, n.first)), hash(tree, n.second));
+            break;
+        case flat_node_type::function_call:
+            h = mix(h, hash_symbol(tree.name(n)));
+            for(const auto argument : tree.arguments_of(n))
+                h = mix(h, hash(tree, argument));
+            break;
+    }
+
+    hashes[index] = h;
+    return h;
+}
+
+template<typename entry>
+constexpr inline entry& rewriter::like(const ast& tree, std::vector<entry>& entries, node_index entry::* const key_of,
+                                       const node_index key, bool& found)
+{
+    const auto mask = [&] { return slots.size() - 1; };
+
+    // Kept at most half full; growing rebuilds it from the entries.
+    if (2 * (entries.size() + 1) > slots.size()) {
+        slots.assign(std::bit_ceil(std::max(16uz, 4 * (entries.size() + 1))), null_index);
+        for(auto i = 0uz; i < entries.size(); i++) {
+            auto slot = hash(tree, entries[i].*key_of) & mask();
+            while(slots[slot] != null_index)
+                slot = (slot + 1) & mask();
+            slots[slot] = static_cast<std::uint32_t>(i);
+        }
+    }
+
+    for(auto slot = hash(tree, key) & mask();; slot = (slot + 1) & mask()) {
+        if (slots[slot] == null_index) {
+            slots[slot] = static_cast<std::uint32_t>(entries.size());
+            found = false;
+            auto& added = entries.emplace_back();
+            added.*key_of = key;
+            return added;
+        }
+
+        if (same(tree, entries[slots[slot]].*key_of, key)) {
+            found = true;
+            return entries[slots[slot]];
+        }
+    }
+}
+
+constexpr inline bool rewriter::same(const ast& tree, const node_index a, const node_index b)
+{
+    if (a == b)
+        return true;
+    if (hash(tree, a) != hash(tree, b))
+        return false;
+
+    auto pairs = std::vector<std::pair<node_index, node_index>>{ { a, b } };
+    while(!pairs.empty()) {
+        const auto [x, y] = pairs.back();
+        pairs.pop_back();
+        if (x == y)
+            continue;
+
+        const auto& l = tree[x];
+        const auto& r = tree[y];
+        if (l.type != r.type)
+            return false;
+
+        switch(l.type) {
+            case flat_node_type::constant:
+                if (tree.value(l).bits != tree.value(r).bits)
+                    return false;
+                break;
+            case flat_node_type::symbol:
+                if (tree.name(l) != tree.name(r))
+                    return false;
+                break;
+            case flat_node_type::op:
+                if (l.operation != r.operation)
+                    return false;
+                pairs.emplace_back(l.first, r.first);
+                pairs.emplace_back(l.second, r.second);
+                break;
+            case flat_node_type::function_call:
+                if (tree.name(l) != tree.name(r) || l.argument_count != r.argument_count)
+                    return false;
+                for(auto i = 0u; i < l.argument_count; i++)
+                    pairs.emplace_back(tree.arguments_of(l)[i], tree.arguments_of(r)[i]);
+                break;
+        }
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <batch.hpp>
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <node.hpp>
+#include <parser.hpp>
+#include <quaternion.hpp>
+#include <symbols.hpp>
+
+namespace mathc
+{
+
+// Rotation formulas, "rotate(quat(w, x, y, z), vec3(x, y, z))" with each argument a scalar
+// expression over the same symbols, lowered onto columns: every component compiles to its
+// own program, batch_evaluator fills one column per component and the rotation kernels
+// turn the point columns in place. quat, vec3 and rotate only make up the formula's top;
+// inside a component they are calls that fail. For single values, rotate_x/y/z and
+// qmul_w/x/y/z are builtins in any expression.
+
+struct rotation_formula
+{
+    std::array<program, 4> rotation{};  // w, x, y, z
+    std::array<program, 3> point{};     // x, y, z
+    std::vector<std::string> symbols{}; // the formula's columns, in order of first use
+
+    // Per component, rotation then point: for each of its program::symbols, the index of
+    // its column in symbols.
+    std::array<std::vector<std::uint32_t>, 7> inputs{};
+};
+
+using rotation_formula_result = std::expected<rotation_formula, compile_error>;
+
+struct rotation_compiler
+{
+    constexpr static rotation_formula_result compile(std::string_view source);
+};
+
+struct rotation_formula_evaluator
+{
+    // Rotates every row: columns are in formula::symbols order, output is the rotated point.
+    constexpr batch_result evaluate(const rotation_formula& formula,
+                                    std::span<const std::span<const double>> columns,
+                                    vec3_columns output);
+
+    batch_evaluator batch{};
+    std::vector<double> rotation_columns{};
+    std::vector<std::span<const double>> component_columns{};
+};
+
+// Implementation
+
+constexpr inline rotation_formula_result rotation_compiler::compile(const std::string_view source)
+{
+    const auto fail = [](std::string error) { return rotation_formula_result{ std::unexpect_t{}, compile_error{ std::move(error) } }; };
+    const auto outside = [](std::span<number>) {
+        return make_execution_error("quat, vec3 and rotate only make up the top of a rotation formula.");
+    };
+
+    auto symbols = symbol_table{};
+    auto functions = function_table{};
+    functions.define({ .name = "rotate", .func = outside, .arity = 2 });
+    functions.define({ .name = "quat", .func = outside, .arity = 4 });
+    functions.define({ .name = "vec3", .func = outside, .arity = 3 });
+
+    const auto root = parser::parse(source, symbols, functions);
+    if (!root.has_value())
+        return fail(std::format("{} Near '{}'.", root.error().error, root.error().token.value));
+
+    const auto call = [](const node& n, const std::string_view name, const std::size_t arity) -> const function_call_node* {
+        const auto* c = std::get_if<function_call_node>(&n);
+        return c && c->function_name == name && c->arguments.size() == arity ? c : nullptr;
+    };
+
+    const auto* rotate = call(root.value(), "rotate", 2);
+    const auto* rotation = rotate ? call(rotate->arguments[0], "quat", 4) : nullptr;
+    const auto* point = rotate ? call(rotate->arguments[1], "vec3", 3) : nullptr;
+    if (!rotation || !point)
+        return fail("Expected rotate(quat(w, x, y, z), vec3(x, y, z)).");
+
+    auto formula = rotation_formula{};
+    auto ids = std::vector<symbol_id>{};
+
+    const auto lower = [&](const node& component, program& p, std::vector<std::uint32_t>& inputs) -> emit_result {
+        auto compiled = compiler::compile(component, symbols, functions);
+        if (!compiled.has_value())
+            return emit_result{ std::unexpect_t{}, compiled.error() };
+
+        p = std::move(compiled.value());
+        for(auto i = 0uz; i < p.symbol_ids.size(); i++) {
+            auto column = std::ranges::find(ids, p.symbol_ids[i]);
+            if (column == ids.end()) {
+                ids.push_back(p.symbol_ids[i]);
+                formula.symbols.push_back(p.symbols[i]);
+                column = std::prev(ids.end());
+            }
+            inputs.push_back(static_cast<std::uint32_t>(std::distance(ids.begin(), column)));
+        }
+
+        return {};
+    };
+
+    for(auto i = 0uz; i < formula.rotation.size(); i++)
+        if (const auto lowered = lower(rotation->arguments[i], formula.rotation[i], formula.inputs[i]); !lowered)
+            return fail(lowered.error().error);
+
+    for(auto i = 0uz; i < formula.point.size(); i++)
+        if (const auto lowered = lower(point->arguments[i], formula.point[i], formula.inputs[4 + i]); !lowered)
+            return fail(lowered.error().error);
+
+    return formula;
+}
+
+constexpr inline batch_result rotation_formula_evaluator::evaluate(const rotation_formula& formula,
+                                                                   const std::span<const std::span<const double>> columns,
+                                                                   const vec3_columns output)
+{
+    const auto rows = output.x.size();
+    if (output.y.size() != rows || output.z.size() != rows)
+        return batch_result{ std::unexpect_t{}, "Output columns differ in length." };
+    if (columns.size() != formula.symbols.size())
+        return batch_result{ std::unexpect_t{},
+                             std::format("Expected {} columns, got {}.", formula.symbols.size(), columns.size()) };
+
+    rotation_columns.resize(4 * rows);
+    const auto storage = std::span{ rotation_columns };
+    const auto q = quaternion_columns{ storage.subspan(0, rows), storage.subspan(rows, rows),
+                                       storage.subspan(2 * rows, rows), storage.subspan(3 * rows, rows) };
+    const auto targets = std::array{ q.w, q.x, q.y, q.z, output.x, output.y, output.z };
+
+    for(auto k = 0uz; k < targets.size(); k++) {
+        component_columns.clear();
+        for(const auto column : formula.inputs[k])
+            component_columns.push_back(columns[column]);
+
+        const auto& p = k < 4 ? formula.rotation[k] : formula.point[k - 4];
+        if (const auto evaluated = batch.evaluate(p, component_columns, targets[k]); !evaluated)
+            return evaluated;
+    }
+
+    active_rotation_kernels().rotate({ q.w, q.x, q.y, q.z }, output);
+    return {};
+}
+
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace mathc
+{
+
+constexpr static bool is_number(const char c)      { return c >= '0' && c <= '9'; }
+constexpr static bool is_whitespace(const char c)  { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+constexpr static bool is_operation(const char c)   { return c == '*' || c == '/' || c == '+' || c == '-' || c == '^'; }
+constexpr static bool is_paren(const char c)       { return c == '(' || c == ')'; }
+constexpr static bool is_comma(const char c)       { return c == ','; }
+
+// Ends a symbol.
+constexpr static bool is_delimiter(const char c)   { return is_whitespace(c) || is_operation(c) || is_paren(c) || is_comma(c); }
+
+// Where the lexer's byte runs end: whitespace, digits and symbols. At runtime these classify
+// 16 bytes at a time into a bitmask (sse2 on x86-64, neon on aarch64, both baseline) and
+// take its lowest set bit, so a long run costs a compare per class member per block instead
+// of a branch per byte. A block never reads past the buffer; the tail, and constant
+// evaluation, go byte by byte.
+//
+// Tokens are mostly a few bytes long and one block finds their end, so the scans stay inline
+// at 16 bytes: a 32 or 64 byte block would need a per-token call to code built for that isa.
+constexpr static std::size_t skip_whitespace(std::string_view s, std::size_t from);
+constexpr static std::size_t skip_digits(std::string_view s, std::size_t from);
+constexpr static std::size_t find_delimiter(std::string_view s, std::size_t from);
+
+// Implementation
+
+namespace detail
+{
+
+using byte_block [[gnu::vector_size(16)]] = signed char;
+
+constexpr static std::size_t block_size = sizeof(byte_block);
+
+// Bit i (x86-64, scalar) or nibble i (aarch64) is set where lane i of matches is.
+[[gnu::always_inline]] inline std::uint64_t block_mask(const byte_block matches)
+{
+#if defined(__x86_64__)
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(std::bit_cast<__m128i>(matches)));
+#elif defined(__aarch64__)
+    const auto narrowed = vshrn_n_u16(vreinterpretq_u16_s8(std::bit_cast<int8x16_t>(matches)), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+#else
+    auto mask = std::uint64_t{ 0 };
+    for(auto lane = 0u; lane < block_size; lane++)
+        if (matches[lane])
+            mask |= std::uint64_t{ 1 } << lane;
+    return mask;
+#endif
+}
+
+[[gnu::always_inline]] inline std::size_t first_lane(const std::uint64_t mask)
+{
+#if defined(__aarch64__)
+    return static_cast<std::size_t>(std::countr_zero(mask)) / 4;
+#else
+    return static_cast<std::size_t>(std::countr_zero(mask));
+#endif
+}
+
+[[gnu::always_inline]] inline byte_block whitespace_lanes(const byte_block b)
+{
+    return (b == ' ') | (b == '\t') | (b == '\r') | (b == '\n');
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+// The first position of a full block at or after from where match is set, or where the
+// blocks ran out.
+[[gnu::always_inline]] inline std::size_t find_in_blocks(const std::string_view s, std::size_t from, auto&& match)
+{
+    for(; from + block_size <= s.size(); from += block_size) {
+        auto block = byte_block{};
+        std::memcpy(&block, s.data() + from, block_size);
+
+        if (const auto mask = block_mask(match(block)); mask != 0)
+            return from + first_lane(mask);
+    }
+
+    return from;
+}
+
+#pragma GCC diagnostic pop
+
+}
+
+constexpr inline std::size_t skip_whitespace(const std::string_view s, std::size_t from)
+{
+    if !consteval {
+        from = detail::find_in_blocks(s, from, [](const detail::byte_block b) { return ~detail::whitespace_lanes(b); });
+    }
+
+    while(from < s.size() && is_whitespace(s[from]))
+        from++;
+    return from;
+}
+
+constexpr inline std::size_t skip_digits(const std::string_view s, std::size_t from)
+{
+    if !consteval {
+        from = detail::find_in_blocks(s, from, [](const detail::byte_block b) { return (b < '0') | (b > '9'); });
+    }
+
+    while(from < s.size() && is_number(s[from]))
+        from++;
+    return from;
+}
+
+constexpr inline std::size_t find_delimiter(const std::string_view s, std::size_t from)
+{
+    if !consteval {
+        from = detail::find_in_blocks(s, from, [](const detail::byte_block b) {
+            return detail::whitespace_lanes(b) |
+                   (b == '*') | (b == '/') | (b == '+') | (b == '-') | (b == '^') |
+                   (b == '(') | (b == ')') | (b == ',');
+        });
+    }
+
+    while(from < s.size() && !is_delimiter(s[from]))
+        from++;
+    return from;
+}
+
+}
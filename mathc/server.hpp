@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <expected>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <ast.hpp>
+#include <cache.hpp>
+#include <interpreter.hpp>
+#include <lexer.hpp>
+#include <node.hpp>
+#include <parser.hpp>
+#include <rewrite.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// A long-running evaluator, so clients don't pay a process start per batch of formulas.
+//
+// Every message is a frame: its length and a request id, both 4 bytes little-endian, then
+// length bytes of text. A request is lines: "name = expression" binds a symbol for that
+// request only, every other non-empty line is an expression. Its response carries the same
+// id and one line per expression, in order: the value, the residual, or "error: " and the
+// message. Responses to one connection's requests can come back in any order.
+//
+// One thread reads every connection; a pool of workers, each with its own vm, evaluates.
+// Workers coalesce: one takes queued requests until they hold max_batch expressions, and
+// waits up to max_latency after the oldest arrived for a batch to fill. A latency of zero
+// evaluates whatever is queued at once. Expressions are parsed and compiled once for all
+// workers, in a shared expression_cache.
+
+struct server_settings
+{
+    std::size_t workers{ 0 };                     // 0: one per hardware thread
+    std::size_t max_batch{ 256 };                 // expressions a worker takes at once
+    std::chrono::microseconds max_latency{ 0 };   // longest a request waits for its batch to fill
+    std::size_t cache_capacity{ 1u << 16 };       // compiled expressions kept warm
+    std::size_t max_frame{ 1u << 26 };            // bytes; a connection sending more is closed
+};
+
+struct server_error
+{
+    std::string error;
+};
+
+constexpr static std::size_t frame_header_size = 8;
+
+constexpr static inline std::array<char, frame_header_size> encode_frame_header(const std::uint32_t length, const std::uint32_t id)
+{
+    auto header = std::array<char, frame_header_size>{};
+    for(auto i = 0u; i < 4; i++) {
+        header[i] = static_cast<char>((length >> (8 * i)) & 0xff);
+        header[4 + i] = static_cast<char>((id >> (8 * i)) & 0xff);
+    }
+
+    return header;
+}
+
+struct frame_header
+{
+    std::uint32_t length;
+    std::uint32_t id;
+};
+
+// header holds at least frame_header_size bytes.
+constexpr static inline frame_header decode_frame_header(const std::string_view header)
+{
+    auto length = std::uint32_t{ 0 };
+    auto id = std::uint32_t{ 0 };
+    for(auto i = 0u; i < 4; i++) {
+        length |= std::uint32_t{ static_cast<unsigned char>(header[i]) } << (8 * i);
+        id |= std::uint32_t{ static_cast<unsigned char>(header[4 + i]) } << (8 * i);
+    }
+
+    return { .length = length, .id = id };
+}
+
+struct request_binding
+{
+    std::string_view symbol;
+    std::string_view value;
+};
+
+// Views into the request's text.
+struct request
+{
+    std::vector<request_binding> bindings{};
+    std::vector<std::string_view> expressions{};
+};
+
+constexpr static inline request parse_request(std::string_view text);
+
+struct server
+{
+    explicit server(const server_settings& s) : settings(s), cache(s.cache_capacity) {}
+    ~server();
+
+    server(const server&) = delete;
+    server& operator=(const server&) = delete;
+
+    // "unix:{path}", "tcp:{port}" or "tcp:{ipv4 address}:{port}".
+    std::expected<void, server_error> listen(std::string_view endpoint);
+
+    // Serves until stop(), from another thread.
+    void run();
+    void stop();
+
+private:
+    struct connection
+    {
+        explicit connection(const int f) : fd(f) {}
+        ~connection() { ::close(fd); }
+
+        connection(const connection&) = delete;
+        connection& operator=(const connection&) = delete;
+
+        int fd;
+        std::mutex write_mutex{};
+        std::string input{};  // read but not yet framed, only touched by the reading thread
+    };
+
+    struct pending_request
+    {
+        std::shared_ptr<connection> from;
+        std::uint32_t id;
+        std::string text;
+        request parsed{};  // views into text, which a unique_ptr keeps in place
+        std::chrono::steady_clock::time_point arrived{ std::chrono::steady_clock::now() };
+    };
+
+    struct worker_state
+    {
+        mathc::vm vm{};
+        ast tree{};
+        rewriter canonical{};
+        std::string response{};
+    };
+
+    bool read_frames(const std::shared_ptr<connection>& c);
+    void work();
+    void evaluate(const request& r, worker_state& w);
+    static void send_frame(connection& c, std::uint32_t id, std::string_view text);
+
+    server_settings settings;
+    expression_cache cache;
+    int listener{ -1 };
+    std::array<int, 2> wake{ -1, -1 };  // a pipe, written by stop() to end the poll
+
+    std::mutex queue_mutex{};
+    std::condition_variable queue_ready{};
+    std::deque<std::unique_ptr<pending_request>> queue{};
+    std::size_t queued_expressions{ 0 };
+    bool stopping{ false };
+};
+
+// Implementation
+
+constexpr inline request parse_request(std::string_view text)
+{
+    const auto trim = [](std::string_view s) {
+        while(!s.empty() && is_whitespace(s.front()))
+            s.remove_prefix(1);
+        while(!s.empty() && is_whitespace(s.back()))
+            s.remove_suffix(1);
+        return s;
+    };
+
+    auto r = request{};
+    while(!text.empty()) {
+        const auto end = text.find('\n');
+        const auto line = trim(text.substr(0, end));
+        text = end == std::string_view::npos ? std::string_view{} : text.substr(end + 1);
+
+        if (const auto equals = line.find('='); equals != std::string_view::npos)
+            r.bindings.emplace_back(request_binding{ .symbol = trim(line.substr(0, equals)), .value = line.substr(equals + 1) });
+        else if (!line.empty())
+            r.expressions.emplace_back(line);
+    }
+
+    return r;
+}
+
+inline server::~server()
+{
+    if (listener >= 0)
+        ::close(listener);
+    for(const auto fd : wake)
+        if (fd >= 0)
+            ::close(fd);
+}
+
+// Raw socket addresses at the os boundary.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+inline std::expected<void, server_error> server::listen(const std::string_view endpoint)
+{
+    const auto fail = [&](const std::string_view what) {
+        return std::expected<void, server_error>{ std::unexpect_t{}, std::format("Cannot {} {}.", what, endpoint) };
+    };
+
+    if (::pipe2(wake.data(), O_CLOEXEC) != 0)
+        return fail("create a wake pipe for");
+
+    if (endpoint.starts_with("unix:")) {
+        const auto path = endpoint.substr(5);
+        auto address = sockaddr_un{};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+            return fail("use the path of");
+
+        std::ranges::copy(path, &address.sun_path[0]);
+        ::unlink(address.sun_path);
+
+        listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+            return fail("bind");
+    } else if (endpoint.starts_with("tcp:")) {
+        auto host = std::string{ "0.0.0.0" };
+        auto port = std::string{ endpoint.substr(4) };
+        if (const auto colon = port.rfind(':'); colon != std::string::npos) {
+            host = port.substr(0, colon);
+            port = port.substr(colon + 1);
+        }
+
+        auto address = sockaddr_in{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<std::uint16_t>(std::strtoul(port.c_str(), nullptr, 10)));
+        if (::inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+            return fail("use the address of");
+
+        listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const auto reuse = 1;
+        if (listener < 0 || ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+            return fail("bind");
+    } else {
+        return fail("listen on unknown endpoint");
+    }
+
+    if (::listen(listener, SOMAXCONN) != 0)
+        return fail("listen on");
+
+    return {};
+}
+
+inline void server::run()
+{
+    const auto hardware = std::max(1uz, static_cast<std::size_t>(std::thread::hardware_concurrency()));
+    auto pool = std::vector<std::jthread>{};
+    for(auto w = 0uz; w < (settings.workers == 0 ? hardware : settings.workers); w++)
+        pool.emplace_back([this] { work(); });
+
+    auto connections = std::vector<std::shared_ptr<connection>>{};
+    auto polled = std::vector<pollfd>{};
+    auto chunk = std::string(1u << 16, '\0');
+
+    while(true) {
+        polled.clear();
+        polled.emplace_back(pollfd{ .fd = wake[0], .events = POLLIN, .revents = 0 });
+        polled.emplace_back(pollfd{ .fd = listener, .events = POLLIN, .revents = 0 });
+        for(const auto& c : connections)
+            polled.emplace_back(pollfd{ .fd = c->fd, .events = POLLIN, .revents = 0 });
+
+        if (::poll(polled.data(), polled.size(), -1) < 0)
+            continue;
+
+        if (polled[0].revents != 0)
+            break;
+
+        // Closed connections are dropped here; workers still answering them hold them open.
+        auto kept = 0uz;
+        for(auto i = 0uz; i < connections.size(); i++) {
+            auto open = true;
+            if (polled[i + 2].revents != 0) {
+                const auto read = ::recv(connections[i]->fd, chunk.data(), chunk.size(), 0);
+                open = read > 0;
+                if (open) {
+                    connections[i]->input.append(chunk.data(), static_cast<std::size_t>(read));
+                    open = read_frames(connections[i]);
+                }
+            }
+
+            if (open)
+                connections[kept++] = std::move(connections[i]);
+            else
+                ::shutdown(connections[i]->fd, SHUT_RDWR);
+        }
+        connections.resize(kept);
+
+        if (polled[1].revents != 0)
+            if (const auto fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC); fd >= 0)
+                connections.emplace_back(std::make_shared<connection>(fd));
+    }
+
+    {
+        const auto lock = std::scoped_lock{ queue_mutex };
+        stopping = true;
+    }
+    queue_ready.notify_all();
+}
+
+inline void server::stop()
+{
+    const auto byte = char{ 0 };
+    [[maybe_unused]] const auto written = ::write(wake[1], &byte, 1);
+}
+
+// Queues every complete frame. False when a frame is over max_frame, to close the connection.
+inline bool server::read_frames(const std::shared_ptr<connection>& c)
+{
+    auto consumed = 0uz;
+    auto queued = 0uz;
+    auto valid = true;
+
+    while(c->input.size() - consumed >= frame_header_size) {
+        const auto header = decode_frame_header(std::string_view{ c->input }.substr(consumed));
+        if (header.length > settings.max_frame) {
+            valid = false;
+            break;
+        }
+
+        if (c->input.size() - consumed - frame_header_size < header.length)
+            break;
+
+        auto pending = std::make_unique<pending_request>(pending_request{
+            .from = c,
+            .id = header.id,
+            .text = c->input.substr(consumed + frame_header_size, header.length) });
+        pending->parsed = parse_request(pending->text);
+        consumed += frame_header_size + header.length;
+
+        const auto lock = std::scoped_lock{ queue_mutex };
+        queued_expressions += pending->parsed.expressions.size();
+        queue.emplace_back(std::move(pending));
+        queued++;
+    }
+
+    c->input.erase(0, consumed);
+    if (queued > 0)
+        queue_ready.notify_all();
+
+    return valid;
+}
+
+inline void server::send_frame(connection& c, const std::uint32_t id, const std::string_view text)
+{
+    const auto header = encode_frame_header(static_cast<std::uint32_t>(text.size()), id);
+    const auto lock = std::scoped_lock{ c.write_mutex };
+
+    for(const auto part : { std::string_view{ header.data(), header.size() }, text }) {
+        for(auto sent = 0uz; sent < part.size();) {
+            const auto n = ::send(c.fd, part.data() + sent, part.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return;
+            sent += static_cast<std::size_t>(n);
+        }
+    }
+}
+
+#pragma GCC diagnostic pop
+
+inline void server::work()
+{
+    auto state = worker_state{};
+    auto batch = std::vector<std::unique_ptr<pending_request>>{};
+
+    while(true) {
+        {
+            auto lock = std::unique_lock{ queue_mutex };
+            queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            // Coalesce: wait for a full batch, but not past the oldest request's deadline.
+            const auto deadline = queue.front()->arrived + settings.max_latency;
+            queue_ready.wait_until(lock, deadline, [&] {
+                return stopping || queue.empty() || queued_expressions >= settings.max_batch;
+            });
+
+            auto expressions = 0uz;
+            while(!queue.empty() && (batch.empty() || expressions + queue.front()->parsed.expressions.size() <= settings.max_batch)) {
+                expressions += queue.front()->parsed.expressions.size();
+                batch.emplace_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            queued_expressions -= expressions;
+        }
+
+        for(const auto& pending : batch) {
+            evaluate(pending->parsed, state);
+            send_frame(*pending->from, pending->id, state.response);
+        }
+        batch.clear();
+    }
+}
+
+// Same results as main's cached evaluation: the compiled program, or the rewritten residual
+// when it doesn't reduce to a number.
+inline void server::evaluate(const request& r, worker_state& w)
+{
+    auto& out = w.response;
+    out.clear();
+
+    // Bindings are scoped to the request, and so are their names: a long-lived table would
+    // keep every name any client ever sent.
+    w.vm.clear_symbols();
+    for(const auto& binding : r.bindings) {
+        auto value = parser::parse(binding.value, w.vm.symbols, w.vm.functions);
+        if (binding.symbol.empty() || !value.has_value()) {
+            for(auto i = 0uz; i < r.expressions.size(); i++)
+                out += std::format("error: Binding of {} does not parse.\n", binding.symbol);
+            return;
+        }
+
+        w.vm.insert_symbol(binding.symbol, value.value());
+    }
+
+    for(const auto expression : r.expressions) {
+        const auto entry = cache.get(expression);
+        if (!entry.has_value()) {
+            out += std::format("error: {}\n", entry.error().error);
+            continue;
+        }
+
+        const auto& cached = *entry.value();
+        if (const auto value = w.vm.execute(cached.compiled); value.has_value()) {
+            out += std::format("{}\n", value.value());
+            continue;
+        }
+
+        w.tree = cached.tree;
+        const auto result = interpreter::simplify(w.tree, cached.root, w.vm);
+        if (!result.has_value())
+            out += std::format("error: {}\n", result.error().error);
+        else if (std::holds_alternative<number>(result.value()))
+            out += std::format("{}\n", std::get<number>(result.value()));
+        else {
+            format_tree(out, copy_node(w.tree, w.canonical.rewrite(w.tree, std::get<node_index>(result.value()))));
+            out += '\n';
+        }
+    }
+}
+
+}
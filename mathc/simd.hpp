@@ -0,0 +1,389 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <math.hpp>
+#include <node.hpp>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace mathc
+{
+
+// Column kernels used by batch evaluation. Each entry works in place on `left`/`values`.
+// The scalar table is constexpr and is what constant evaluation uses; at runtime kernels()
+// picks the widest table the cpu supports (avx512 > avx2 > scalar on x86-64, neon on
+// aarch64).
+//
+// Accuracy: add/sub/mul/div/sqrt are exact IEEE operations in every table. ln/log2 are
+// range reduced to [sqrt(1/2), sqrt(2)) and use the atanh series, within 2 ulp of std::log
+// for positive normal inputs; chunks containing anything else go through std:: per lane.
+// pow squares-and-multiplies when every exponent in a chunk is integral with |y| <= 8
+// (within 4 ulp of std::pow) and calls std::pow otherwise.
+struct kernel_table
+{
+    std::string_view name;
+
+    void(*add)(std::span<double> left, std::span<const double> right);
+    void(*sub)(std::span<double> left, std::span<const double> right);
+    void(*mul)(std::span<double> left, std::span<const double> right);
+    void(*div)(std::span<double> left, std::span<const double> right);
+    void(*pow)(std::span<double> left, std::span<const double> right);
+
+    void(*sqrt)(std::span<double> values);
+    void(*log2)(std::span<double> values);
+    void(*ln)(std::span<double> values);
+};
+
+struct scalar_kernels
+{
+    constexpr static void add(const std::span<double> left, const std::span<const double> right)
+    {
+        for(auto i = 0u; i < left.size(); i++) left[i] += right[i];
+    }
+
+    constexpr static void sub(const std::span<double> left, const std::span<const double> right)
+    {
+        for(auto i = 0u; i < left.size(); i++) left[i] -= right[i];
+    }
+
+    constexpr static void mul(const std::span<double> left, const std::span<const double> right)
+    {
+        for(auto i = 0u; i < left.size(); i++) left[i] *= right[i];
+    }
+
+    constexpr static void div(const std::span<double> left, const std::span<const double> right)
+    {
+        for(auto i = 0u; i < left.size(); i++) left[i] /= right[i];
+    }
+
+    constexpr static void pow(const std::span<double> left, const std::span<const double> right)
+    {
+        for(auto i = 0u; i < left.size(); i++) left[i] = math::pow(left[i], right[i]).as_double();
+    }
+
+    constexpr static void sqrt(const std::span<double> values)
+    {
+        for(auto& value : values) value = math::sqrt(value).promote_to_double();
+    }
+
+    constexpr static void log2(const std::span<double> values)
+    {
+        for(auto& value : values) value = math::log2(value).promote_to_double();
+    }
+
+    constexpr static void ln(const std::span<double> values)
+    {
+        for(auto& value : values) value = math::log(value).promote_to_double();
+    }
+};
+
+constexpr static kernel_table scalar_kernel_table
+{
+    "scalar",
+    scalar_kernels::add, scalar_kernels::sub, scalar_kernels::mul, scalar_kernels::div, scalar_kernels::pow,
+    scalar_kernels::sqrt, scalar_kernels::log2, scalar_kernels::ln,
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunsafe-buffer-usage"
+
+// Width-generic bodies over gcc/clang vector extensions, D lanes of double and I lanes of
+// int64 of the same size. They are always inlined into the per-isa wrappers below so the
+// vector code is generated for that wrapper's target, and they never pass vectors by
+// value across a call.
+template<typename D, typename I>
+struct vector_kernels
+{
+    constexpr static std::size_t lanes = sizeof(D) / sizeof(double);
+
+    template<typename V, typename T>
+    [[gnu::always_inline]] static inline void load(V& v, const std::span<T> s, const std::size_t i)
+    {
+        std::memcpy(&v, s.subspan(i, lanes).data(), sizeof(V));
+    }
+
+    template<typename V, typename T>
+    [[gnu::always_inline]] static inline void store(const std::span<T> s, const std::size_t i, const V& v)
+    {
+        std::memcpy(s.subspan(i, lanes).data(), &v, sizeof(V));
+    }
+
+    [[gnu::always_inline]] static inline bool all(const I& mask)
+    {
+        for(auto lane = 0u; lane < lanes; lane++)
+            if (!mask[lane])
+                return false;
+        return true;
+    }
+
+    template<operation_type op, typename T, typename V>
+    [[gnu::always_inline]] static inline void arithmetic(const std::span<T> left, const std::span<const T> right)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + lanes <= left.size(); i += lanes) {
+            V a{}, b{};
+            load(a, left, i);
+            load(b, right, i);
+
+            if constexpr (op == operation_type::add) a += b;
+            else if constexpr (op == operation_type::sub) a -= b;
+            else if constexpr (op == operation_type::mul) a *= b;
+            else if constexpr (op == operation_type::div) a /= b;
+
+            store(left, i, a);
+        }
+
+        for(; i < left.size(); i++) {
+            if constexpr (op == operation_type::add) left[i] += right[i];
+            else if constexpr (op == operation_type::sub) left[i] -= right[i];
+            else if constexpr (op == operation_type::mul) left[i] *= right[i];
+            else if constexpr (op == operation_type::div) left[i] /= right[i];
+        }
+    }
+
+    template<bool base2>
+    [[gnu::always_inline]] static inline void logarithm(const std::span<double> values)
+    {
+        constexpr auto ln2_hi = 6.93147180369123816490e-01;
+        constexpr auto ln2_lo = 1.90821492927058770002e-10;
+        constexpr auto log2e = 1.44269504088896340736;
+        constexpr auto sqrt2 = 1.41421356237309504880;
+
+        auto i = std::size_t{ 0 };
+        for(; i + lanes <= values.size(); i += lanes) {
+            D x{};
+            load(x, values, i);
+
+            if (!all((x >= 0x1p-1022) & (x < std::numeric_limits<double>::infinity()))) {
+                for(auto lane = i; lane < i + lanes; lane++)
+                    values[lane] = base2 ? std::log2(values[lane]) : std::log(values[lane]);
+                continue;
+            }
+
+            // x = 2^e * m, m in [1, 2), then folded into [sqrt(1/2), sqrt(2))
+            const auto bits = __builtin_bit_cast(I, x);
+            const auto biased = (bits >> 52) | 0x4330000000000000;
+            auto e = __builtin_bit_cast(D, biased) - 0x1p52 - 1023.0;
+            auto m = __builtin_bit_cast(D, (bits & 0x000fffffffffffff) | 0x3ff0000000000000);
+
+            const auto fold = m > sqrt2;
+            m = fold ? m * 0.5 : m;
+            e = fold ? e + 1.0 : e;
+
+            // ln(m) = 2 atanh(s) = 2 (s + s^3/3 + s^5/5 + ...), |s| <= 0.1716
+            const auto s = (m - 1.0) / (m + 1.0);
+            const auto z = s * s;
+            auto p = z * (1.0 / 21.0) + (1.0 / 19.0);
+            p = p * z + (1.0 / 17.0);
+            p = p * z + (1.0 / 15.0);
+            p = p * z + (1.0 / 13.0);
+            p = p * z + (1.0 / 11.0);
+            p = p * z + (1.0 / 9.0);
+            p = p * z + (1.0 / 7.0);
+            p = p * z + (1.0 / 5.0);
+            p = p * z + (1.0 / 3.0);
+            const auto ln_m = 2.0 * s + 2.0 * s * z * p;
+
+            if constexpr (base2)
+                x = e + ln_m * log2e;
+            else
+                x = e * ln2_hi + (ln_m + e * ln2_lo);
+
+            store(values, i, x);
+        }
+
+        for(; i < values.size(); i++)
+            values[i] = base2 ? std::log2(values[i]) : std::log(values[i]);
+    }
+
+    [[gnu::always_inline]] static inline void pow(const std::span<double> left, const std::span<const double> right)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + lanes <= left.size(); i += lanes) {
+            D x{}, y{};
+            load(x, left, i);
+            load(y, right, i);
+
+            const auto abs_y = __builtin_bit_cast(D, __builtin_bit_cast(I, y) & 0x7fffffffffffffff);
+            const auto shifted = abs_y + 0x1p52;
+            if (!all((abs_y <= 8.0) & (__builtin_bit_cast(I, shifted - 0x1p52) == __builtin_bit_cast(I, abs_y)))) {
+                for(auto lane = i; lane < i + lanes; lane++)
+                    left[lane] = std::pow(left[lane], right[lane]);
+                continue;
+            }
+
+            const auto n = __builtin_bit_cast(I, shifted) & 0xf;
+            auto result = D{} + 1.0;
+            auto base = x;
+            for(auto bit = 0; bit < 4; bit++) {
+                result = ((n >> bit) & 1) != 0 ? result * base : result;
+                base = base * base;
+            }
+
+            store(left, i, y < 0.0 ? 1.0 / result : result);
+        }
+
+        for(; i < left.size(); i++)
+            left[i] = std::pow(left[i], right[i]);
+    }
+};
+
+#if defined(__x86_64__)
+
+using f64x4 [[gnu::vector_size(32)]] = double;
+using i64x4 [[gnu::vector_size(32)]] = std::int64_t;
+using f64x8 [[gnu::vector_size(64)]] = double;
+using i64x8 [[gnu::vector_size(64)]] = std::int64_t;
+
+struct avx2_kernels
+{
+    using v = vector_kernels<f64x4, i64x4>;
+
+    [[gnu::target("avx2")]] static void add(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::add, double, f64x4>(l, r); }
+    [[gnu::target("avx2")]] static void sub(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::sub, double, f64x4>(l, r); }
+    [[gnu::target("avx2")]] static void mul(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::mul, double, f64x4>(l, r); }
+    [[gnu::target("avx2")]] static void div(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::div, double, f64x4>(l, r); }
+    [[gnu::target("avx2")]] static void pow(const std::span<double> l, const std::span<const double> r) { v::pow(l, r); }
+
+    [[gnu::target("avx2")]] static void log2(const std::span<double> values) { v::logarithm<true>(values); }
+    [[gnu::target("avx2")]] static void ln(const std::span<double> values) { v::logarithm<false>(values); }
+
+    [[gnu::target("avx2")]] static void sqrt(const std::span<double> values)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + 4 <= values.size(); i += 4) {
+            auto* p = values.subspan(i, 4).data();
+            _mm256_storeu_pd(p, _mm256_sqrt_pd(_mm256_loadu_pd(p)));
+        }
+        for(; i < values.size(); i++)
+            values[i] = std::sqrt(values[i]);
+    }
+};
+
+struct avx512_kernels
+{
+    using v = vector_kernels<f64x8, i64x8>;
+
+    [[gnu::target("avx512f,avx512dq")]] static void add(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::add, double, f64x8>(l, r); }
+    [[gnu::target("avx512f,avx512dq")]] static void sub(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::sub, double, f64x8>(l, r); }
+    [[gnu::target("avx512f,avx512dq")]] static void mul(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::mul, double, f64x8>(l, r); }
+    [[gnu::target("avx512f,avx512dq")]] static void div(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::div, double, f64x8>(l, r); }
+    [[gnu::target("avx512f,avx512dq")]] static void pow(const std::span<double> l, const std::span<const double> r) { v::pow(l, r); }
+
+    [[gnu::target("avx512f,avx512dq")]] static void log2(const std::span<double> values) { v::logarithm<true>(values); }
+    [[gnu::target("avx512f,avx512dq")]] static void ln(const std::span<double> values) { v::logarithm<false>(values); }
+
+    [[gnu::target("avx512f,avx512dq")]] static void sqrt(const std::span<double> values)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + 8 <= values.size(); i += 8) {
+            auto* p = values.subspan(i, 8).data();
+            _mm512_storeu_pd(p, _mm512_sqrt_pd(_mm512_loadu_pd(p)));
+        }
+        for(; i < values.size(); i++)
+            values[i] = std::sqrt(values[i]);
+    }
+};
+
+constexpr static kernel_table avx2_kernel_table
+{
+    "avx2",
+    avx2_kernels::add, avx2_kernels::sub, avx2_kernels::mul, avx2_kernels::div, avx2_kernels::pow,
+    avx2_kernels::sqrt, avx2_kernels::log2, avx2_kernels::ln,
+};
+
+constexpr static kernel_table avx512_kernel_table
+{
+    "avx512",
+    avx512_kernels::add, avx512_kernels::sub, avx512_kernels::mul, avx512_kernels::div, avx512_kernels::pow,
+    avx512_kernels::sqrt, avx512_kernels::log2, avx512_kernels::ln,
+};
+
+#elif defined(__aarch64__)
+
+using f64x2 [[gnu::vector_size(16)]] = double;
+using i64x2 [[gnu::vector_size(16)]] = std::int64_t;
+
+struct neon_kernels
+{
+    using v = vector_kernels<f64x2, i64x2>;
+
+    static void add(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::add, double, f64x2>(l, r); }
+    static void sub(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::sub, double, f64x2>(l, r); }
+    static void mul(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::mul, double, f64x2>(l, r); }
+    static void div(const std::span<double> l, const std::span<const double> r) { v::arithmetic<operation_type::div, double, f64x2>(l, r); }
+    static void pow(const std::span<double> l, const std::span<const double> r) { v::pow(l, r); }
+
+    static void log2(const std::span<double> values) { v::logarithm<true>(values); }
+    static void ln(const std::span<double> values) { v::logarithm<false>(values); }
+
+    static void sqrt(const std::span<double> values)
+    {
+        auto i = std::size_t{ 0 };
+        for(; i + 2 <= values.size(); i += 2) {
+            auto* p = values.subspan(i, 2).data();
+            vst1q_f64(p, vsqrtq_f64(vld1q_f64(p)));
+        }
+        for(; i < values.size(); i++)
+            values[i] = std::sqrt(values[i]);
+    }
+};
+
+constexpr static kernel_table neon_kernel_table
+{
+    "neon",
+    neon_kernels::add, neon_kernels::sub, neon_kernels::mul, neon_kernels::div, neon_kernels::pow,
+    neon_kernels::sqrt, neon_kernels::log2, neon_kernels::ln,
+};
+
+#endif
+
+#pragma GCC diagnostic pop
+
+// Every table this cpu can run, widest first.
+inline std::span<const kernel_table* const> available_kernels()
+{
+    static const auto tables = [] {
+        std::vector<const kernel_table*> t{};
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+            t.emplace_back(&avx512_kernel_table);
+        if (__builtin_cpu_supports("avx2"))
+            t.emplace_back(&avx2_kernel_table);
+#elif defined(__aarch64__)
+        t.emplace_back(&neon_kernel_table);
+#endif
+        t.emplace_back(&scalar_kernel_table);
+        return t;
+    }();
+
+    return tables;
+}
+
+inline const kernel_table& kernels()
+{
+    static const auto& selected = *available_kernels().front();
+    return selected;
+}
+
+constexpr static inline const kernel_table& active_kernels()
+{
+    if consteval {
+        return scalar_kernel_table;
+    } else {
+        return kernels();
+    }
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace mathc
+{
+
+// Per-thread counters and stage timings of the pipeline, for finding where a slow formula
+// spends its time. Compiled in only with -DMATHC_STATS: otherwise every counting call is an
+// empty constexpr function and stats() stays all zero. Nothing is counted during constant
+// evaluation.
+//
+// With the streaming parser, lexing happens inside parse and is timed as part of it; only
+// lexer::lex is timed as its own stage. The outermost run or simplify is timed as evaluate,
+// so evaluations nested inside it (symbols bound to expressions) aren't counted twice.
+
+#ifdef MATHC_STATS
+constexpr static bool stats_enabled = true;
+#else
+constexpr static bool stats_enabled = false;
+#endif
+
+enum class pipeline_stage : std::uint8_t
+{
+    lex,
+    parse,
+    evaluate
+};
+
+struct pipeline_stats
+{
+    std::array<std::chrono::nanoseconds, 3> time{};  // by pipeline_stage
+    std::size_t tokens{ 0 };
+    std::size_t nodes{ 0 };           // built by the parser
+    std::size_t max_depth{ 0 };       // deepest nesting of parentheses and calls parsed
+    std::size_t copies{ 0 };          // nodes copied by copy_node
+    std::size_t symbol_lookups{ 0 };  // reads of symbol bindings from a vm
+    std::size_t function_calls{ 0 };
+
+    constexpr std::chrono::nanoseconds time_of(const pipeline_stage stage) const
+    {
+        return time[static_cast<std::size_t>(stage)];
+    }
+};
+
+namespace detail
+{
+
+inline thread_local pipeline_stats current_stats{};
+inline thread_local std::array<std::uint32_t, 3> timing_depth{};
+
+}
+
+inline const pipeline_stats& stats() { return detail::current_stats; }
+inline void reset_stats() { detail::current_stats = {}; }
+
+constexpr inline void count_stat([[maybe_unused]] std::size_t pipeline_stats::* const counter,
+                                 [[maybe_unused]] const std::size_t n = 1)
+{
+    if constexpr (stats_enabled) {
+        if !consteval {
+            detail::current_stats.*counter += n;
+        }
+    }
+}
+
+constexpr inline void record_depth([[maybe_unused]] const std::size_t depth)
+{
+    if constexpr (stats_enabled) {
+        if !consteval {
+            if (depth > detail::current_stats.max_depth)
+                detail::current_stats.max_depth = depth;
+        }
+    }
+}
+
+// Adds the time until it goes out of scope to its stage, unless a timer of the same stage is
+// already running on this thread. Compiled out, it does nothing.
+struct stage_timer
+{
+    constexpr explicit stage_timer(const pipeline_stage s) : stage(s)
+    {
+        if constexpr (stats_enabled) {
+            if !consteval {
+                outermost = detail::timing_depth[static_cast<std::size_t>(stage)]++ == 0;
+                if (outermost)
+                    start = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+    constexpr ~stage_timer()
+    {
+        if constexpr (stats_enabled) {
+            if !consteval {
+                detail::timing_depth[static_cast<std::size_t>(stage)]--;
+                if (outermost)
+                    detail::current_stats.time[static_cast<std::size_t>(stage)] += std::chrono::steady_clock::now() - start;
+            }
+        }
+    }
+
+    stage_timer(const stage_timer&) = delete;
+    stage_timer& operator=(const stage_timer&) = delete;
+
+private:
+    pipeline_stage stage;
+    bool outermost{ false };
+    std::chrono::steady_clock::time_point start{};
+};
+
+}
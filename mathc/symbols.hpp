@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mathc
+{
+
+using symbol_id = std::uint32_t;
+
+constexpr static symbol_id null_symbol = std::numeric_limits<symbol_id>::max();
+
+using function_id = std::uint32_t;  // index into a function_table (functions.hpp)
+
+constexpr static function_id null_function = std::numeric_limits<function_id>::max();
+
+constexpr static inline std::uint64_t hash_symbol(const std::string_view symbol)
+{
+    // FNV-1a
+    std::uint64_t hash = 14695981039346656037ull;
+    for(const auto c : symbol) {
+        hash ^= static_cast<std::uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Interns symbol names into dense ids. Lookup is open addressing with linear probing over
+// a power-of-two slot array kept at most half full; ids index straight into anything that
+// is keyed by symbol (e.g. vm::bindings).
+struct symbol_table
+{
+    std::vector<std::string> names{};
+    std::vector<std::uint64_t> hashes{};
+    std::vector<symbol_id> slots{};
+
+    constexpr inline std::size_t size() const { return names.size(); }
+    constexpr inline std::string_view name(const symbol_id id) const { return names[id]; }
+
+    constexpr std::optional<symbol_id> find(const std::string_view symbol) const;
+    constexpr symbol_id intern(const std::string_view symbol);
+
+    // Forgets every symbol, keeping capacity; ids handed out before are reused.
+    constexpr void clear()
+    {
+        names.clear();
+        hashes.clear();
+        std::ranges::fill(slots, null_symbol);
+    }
+
+private:
+    constexpr void place(symbol_id id);
+    constexpr void grow();
+};
+
+// Implementation
+
+constexpr inline std::optional<symbol_id> symbol_table::find(const std::string_view symbol) const
+{
+    if (slots.empty())
+        return {};
+
+    const auto hash = hash_symbol(symbol);
+    const auto mask = slots.size() - 1;
+    for(auto i = static_cast<std::size_t>(hash) & mask;; i = (i + 1) & mask) {
+        const auto id = slots[i];
+        if (id == null_symbol)
+            return {};
+        if (hashes[id] == hash && names[id] == symbol)
+            return id;
+    }
+}
+
+constexpr inline symbol_id symbol_table::intern(const std::string_view symbol)
+{
+    if (const auto existing = find(symbol); existing.has_value())
+        return existing.value();
+
+    if ((names.size() + 1) * 2 > slots.size())
+        grow();
+
+    const auto id = static_cast<symbol_id>(names.size());
+    names.emplace_back(symbol);
+    hashes.emplace_back(hash_symbol(symbol));
+    place(id);
+    return id;
+}
+
+constexpr inline void symbol_table::place(const symbol_id id)
+{
+    const auto mask = slots.size() - 1;
+    auto i = static_cast<std::size_t>(hashes[id]) & mask;
+    while(slots[i] != null_symbol)
+        i = (i + 1) & mask;
+
+    slots[i] = id;
+}
+
+constexpr inline void symbol_table::grow()
+{
+    slots.assign(std::max<std::size_t>(16, slots.size() * 2), null_symbol);
+    for(auto id = symbol_id{ 0 }; id < names.size(); id++)
+        place(id);
+}
+
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <concepts>
+#include <optional>
+#include <span>
 #include <string_view>
-#include <string>
 #include <utility>
 
 namespace mathc
@@ -64,12 +66,29 @@ constexpr std::string_view token_type_str(const token_type t)
     std::unreachable();
 }
 
+// value views into the lexed buffer, which has to outlive the token.
 struct token
 {
     token_type type{ token_type::null };
-    std::string value;
+    std::string_view value;
     bool has_decimal{ false };
     std::size_t index_in_stream{ 0 };
 };
 
+template<typename T>
+concept token_source = requires(T source) {
+    { source.next() } -> std::same_as<std::optional<token>>;
+};
+
+struct span_token_source
+{
+    std::span<const token> tokens{};
+    std::size_t index{ 0 };
+
+    constexpr inline std::optional<token> next()
+    {
+        return index < tokens.size() ? std::make_optional(tokens[index++]) : std::optional<token>{};
+    }
+};
+
 }
@@ -0,0 +1,456 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
+#include <math.hpp>
+#include <node.hpp>
+#include <number.hpp>
+#include <stats.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// A compiled program specialized to the kinds of its operands. Type inference runs over the
+// bytecode once, with each symbol assumed to keep the kind its binding has when specialized:
+// an operation whose operands are both proven integers or both doubles gets an int64-only or
+// double-only instruction, and only an operation with an operand of unknown kind (a symbol
+// bound to an expression, a function without a scalar kernel) keeps number's tag checks.
+//
+// The results are vm::execute's. Each assumption is checked where it is relied upon: a symbol
+// rebound to another kind, an integer result leaving number's integer range (which number
+// would store as a double) or a negative integer exponent makes typed_evaluator run the
+// generic program instead, as does any error, so errors are vm::execute's as well.
+
+enum class value_type : std::uint8_t
+{
+    integer,
+    real,
+    mixed  // a number, of either kind
+};
+
+enum class typed_opcode : std::uint8_t
+{
+    push_constant,  // operand: index into typed_program::constants, already in its slot's kind
+    load_integer,   // operand: index into program::symbols; the binding must hold an integer
+    load_real,      // operand: index into program::symbols; the binding must hold a double
+    load_number,    // operand: index into program::symbols
+    add_integer,    // integer operands: a result outside number's integer range deoptimizes
+    sub_integer,
+    mul_integer,
+    exp_integer,    // as above, and a negative exponent deoptimizes
+    add_real,
+    sub_real,
+    mul_real,
+    div_real,
+    exp_real,
+    add,            // number operands
+    sub,
+    mul,
+    div,
+    exp,
+    to_real,        // operand: depth below the top of an integer made a double
+    box_integer,    // operand: depth below the top of an integer made a number
+    box_real,       // operand: depth below the top of a double made a number
+    call_real,      // operand: index into program::functions, called through its scalar kernel
+    call,           // operand: index into program::functions, argument_count: numbers on the stack
+    store_temp,     // operand: temporary slot
+    load_temp,      // operand: temporary slot
+};
+
+struct typed_instruction
+{
+    typed_opcode code;
+    std::uint16_t argument_count{ 0 };
+    std::uint32_t operand{ 0 };
+};
+
+// An integer's, a double's or a number's bits: which is known from the instruction reading it.
+using typed_slot = std::uint64_t;
+
+struct typed_program
+{
+    program generic{};                          // what runs when an assumption fails
+    std::vector<typed_instruction> instructions{};
+    std::vector<typed_slot> constants{};
+    std::vector<value_type> symbol_types{};     // assumed, indexed like program::symbols
+    value_type result{ value_type::mixed };
+    std::size_t generic_operations{ 0 };        // operations left on number's tag checks
+};
+
+struct type_inference
+{
+    // The kinds of p's symbols as bound in vm: constants keep theirs, anything else is mixed.
+    constexpr static std::vector<value_type> binding_types(const program& p, const vm& vm);
+
+    constexpr static typed_program specialize(program p, std::span<const value_type> symbol_types);
+    constexpr static typed_program specialize(program p, const vm& vm);
+
+private:
+    constexpr static std::uint32_t no_constant = std::numeric_limits<std::uint32_t>::max();
+
+    // The inferred stack: a slot pushed straight from a constant can change kind by
+    // re-encoding the constant rather than by an instruction.
+    struct slot
+    {
+        value_type type;
+        std::uint32_t constant{ no_constant };
+    };
+
+    typed_program output{};
+    std::vector<slot> stack{};
+    std::vector<value_type> temporaries{};
+
+    constexpr void convert(std::size_t depth, value_type to);
+    constexpr void emit_operation(opcode code);
+    constexpr void emit_call(const instruction& i, const function& callee);
+};
+
+struct typed_evaluator
+{
+    constexpr evaluation_result execute(const typed_program& p, vm& vm);
+
+    std::size_t deoptimizations{ 0 };
+
+    // Kept between evaluations so their capacity is reused.
+    std::vector<typed_slot> stack{};
+    std::vector<typed_slot> temporaries{};
+    std::vector<number> arguments{};
+};
+
+// Implementation
+
+constexpr static inline typed_slot encode(const number& n, const value_type type)
+{
+    switch(type) {
+        case value_type::integer: return std::bit_cast<typed_slot>(n.as_int());
+        case value_type::real:    return std::bit_cast<typed_slot>(n.promote_to_double());
+        case value_type::mixed:   return std::bit_cast<typed_slot>(n);
+    }
+
+    std::unreachable();
+}
+
+constexpr static inline number decode(const typed_slot s, const value_type type)
+{
+    switch(type) {
+        case value_type::integer: return number{ std::bit_cast<std::int64_t>(s) };
+        case value_type::real:    return number{ std::bit_cast<double>(s) };
+        case value_type::mixed:   return std::bit_cast<number>(s);
+    }
+
+    std::unreachable();
+}
+
+template<typename T>
+constexpr static inline T top_as(const std::vector<typed_slot>& stack) { return std::bit_cast<T>(stack.back()); }
+
+template<typename T>
+constexpr static inline T pop_as(std::vector<typed_slot>& stack)
+{
+    const auto top = top_as<T>(stack);
+    stack.pop_back();
+    return top;
+}
+
+constexpr static inline value_type type_of(const number& n)
+{
+    return n.is_int() ? value_type::integer : value_type::real;
+}
+
+constexpr inline std::vector<value_type> type_inference::binding_types(const program& p, const vm& vm)
+{
+    auto types = std::vector<value_type>(p.symbols.size(), value_type::mixed);
+    for(auto i = 0uz; i < p.symbols.size(); i++) {
+        const auto* bound = p.symbol_ids.empty() ? vm.symbol_node(p.symbols[i]) : vm.symbol_node(p.symbol_ids[i]);
+        if (const auto* constant = bound ? std::get_if<constant_node>(bound) : nullptr; constant)
+            types[i] = type_of(constant->value);
+    }
+
+    return types;
+}
+
+constexpr inline typed_program type_inference::specialize(program p, const vm& vm)
+{
+    const auto types = binding_types(p, vm);
+    return specialize(std::move(p), types);
+}
+
+constexpr inline typed_program type_inference::specialize(program p, const std::span<const value_type> symbol_types)
+{
+    assert(symbol_types.size() == p.symbols.size());
+
+    type_inference inference{};
+    auto& output = inference.output;
+    output.symbol_types.assign(symbol_types.begin(), symbol_types.end());
+    output.instructions.reserve(p.instructions.size());
+    inference.temporaries.assign(p.temporaries, value_type::mixed);
+
+    for(const auto& i : p.instructions) {
+        switch(i.code) {
+            case opcode::push_constant: {
+                const auto& constant = p.constants[i.operand];
+                const auto index = static_cast<std::uint32_t>(output.constants.size());
+                output.constants.emplace_back(encode(constant, type_of(constant)));
+                output.instructions.push_back({ typed_opcode::push_constant, 0, index });
+                inference.stack.push_back({ type_of(constant), index });
+                break;
+            }
+            case opcode::load_symbol: {
+                const auto type = symbol_types[i.operand];
+                const auto code = type == value_type::integer ? typed_opcode::load_integer :
+                                  type == value_type::real ? typed_opcode::load_real : typed_opcode::load_number;
+                output.instructions.push_back({ code, 0, i.operand });
+                inference.stack.push_back({ type });
+                break;
+            }
+            case opcode::add:
+            case opcode::sub:
+            case opcode::mul:
+            case opcode::div:
+            case opcode::exp:
+                inference.emit_operation(i.code);
+                break;
+            case opcode::call:
+                inference.emit_call(i, p.functions[i.operand]);
+                break;
+            case opcode::store_temp:
+                // A stored constant is no longer only the push's to re-encode.
+                inference.temporaries[i.operand] = inference.stack.back().type;
+                inference.stack.back().constant = no_constant;
+                output.instructions.push_back({ typed_opcode::store_temp, 0, i.operand });
+                break;
+            case opcode::load_temp:
+                inference.stack.push_back({ inference.temporaries[i.operand] });
+                output.instructions.push_back({ typed_opcode::load_temp, 0, i.operand });
+                break;
+        }
+    }
+
+    assert(inference.stack.size() == 1);
+    output.result = inference.stack.back().type;
+    output.generic = std::move(p);
+    return std::move(output);
+}
+
+constexpr inline void type_inference::convert(const std::size_t depth, const value_type to)
+{
+    auto& s = stack[stack.size() - 1 - depth];
+    if (s.type == to)
+        return;
+
+    assert(s.type != value_type::mixed && (s.type == value_type::integer || to == value_type::mixed));
+    if (s.constant != no_constant) {
+        auto& constant = output.constants[s.constant];
+        constant = encode(decode(constant, s.type), to);
+    } else {
+        const auto code = to == value_type::real ? typed_opcode::to_real :
+                          s.type == value_type::integer ? typed_opcode::box_integer : typed_opcode::box_real;
+        output.instructions.push_back({ code, 0, static_cast<std::uint32_t>(depth) });
+    }
+
+    s.type = to;
+}
+
+// Mirrors number's operators: integers stay integers but for /, any double makes both
+// doubles, and an operand of unknown kind leaves the operation to number.
+constexpr inline void type_inference::emit_operation(const opcode code)
+{
+    constexpr static auto specialized = [](const opcode c, const value_type type) {
+        // / never stays an integer
+        constexpr auto integer = std::array{ typed_opcode::add_integer, typed_opcode::sub_integer,
+                                             typed_opcode::mul_integer, typed_opcode::div_real,
+                                             typed_opcode::exp_integer };
+        constexpr auto real = std::array{ typed_opcode::add_real, typed_opcode::sub_real, typed_opcode::mul_real,
+                                          typed_opcode::div_real, typed_opcode::exp_real };
+        constexpr auto generic = std::array{ typed_opcode::add, typed_opcode::sub, typed_opcode::mul,
+                                             typed_opcode::div, typed_opcode::exp };
+
+        const auto at = static_cast<std::size_t>(c) - static_cast<std::size_t>(opcode::add);
+        switch(type) {
+            case value_type::integer: return integer[at];
+            case value_type::real:    return real[at];
+            case value_type::mixed:   return generic[at];
+        }
+
+        std::unreachable();
+    };
+
+    const auto left = stack[stack.size() - 2].type;
+    const auto right = stack.back().type;
+    const auto type = left == value_type::mixed || right == value_type::mixed ? value_type::mixed :
+                      left == value_type::integer && right == value_type::integer && code != opcode::div ?
+                          value_type::integer : value_type::real;
+
+    convert(1, type);
+    convert(0, type);
+    output.instructions.push_back({ specialized(code, type) });
+    output.generic_operations += type == value_type::mixed;
+
+    stack.pop_back();
+    stack.back() = { type };
+}
+
+// A single-argument function with a scalar kernel computes in doubles, as its func does;
+// any other call is given numbers and may return either kind.
+constexpr inline void type_inference::emit_call(const instruction& i, const function& callee)
+{
+    if (callee.scalar && i.argument_count == 1 && stack.back().type != value_type::mixed) {
+        convert(0, value_type::real);
+        output.instructions.push_back({ typed_opcode::call_real, 0, i.operand });
+        stack.back() = { value_type::real };
+        return;
+    }
+
+    for(auto depth = 0uz; depth < i.argument_count; depth++)
+        convert(depth, value_type::mixed);
+
+    output.instructions.push_back({ typed_opcode::call, i.argument_count, i.operand });
+    stack.resize(stack.size() - i.argument_count);
+    stack.push_back({ value_type::mixed });
+}
+
+constexpr inline evaluation_result typed_evaluator::execute(const typed_program& p, vm& vm)
+{
+    assert(!p.instructions.empty());
+
+    const auto deoptimize = [&] {
+        deoptimizations++;
+        return vm.execute(p.generic);
+    };
+
+    stack.clear();
+    temporaries.resize(p.generic.temporaries);
+
+    const auto set = [&](const auto value) { stack.back() = std::bit_cast<typed_slot>(value); };
+    const auto set_integer = [&](const std::optional<std::int64_t> value) {
+        if (!value.has_value() || value.value() < number::min_int || value.value() > number::max_int)
+            return false;
+
+        set(value.value());
+        return true;
+    };
+
+    for(const auto& i : p.instructions) {
+        switch(i.code) {
+            case typed_opcode::push_constant:
+                stack.emplace_back(p.constants[i.operand]);
+                break;
+
+            case typed_opcode::load_integer:
+            case typed_opcode::load_real:
+            case typed_opcode::load_number: {
+                const auto id = p.generic.symbol_ids.empty() ? null_symbol : p.generic.symbol_ids[i.operand];
+                const auto value = vm.resolve_symbol(id, p.generic.symbols[i.operand]);
+                if (!value.has_value()) [[unlikely]]
+                    return deoptimize();
+
+                const auto type = p.symbol_types[i.operand];
+                if (type != value_type::mixed && type_of(value.value()) != type) [[unlikely]]
+                    return deoptimize();
+
+                stack.emplace_back(encode(value.value(), type));
+                break;
+            }
+
+            // Operands are within number's integer range, so only * and ^ can overflow.
+            case typed_opcode::add_integer: {
+                const auto b = pop_as<std::int64_t>(stack);
+                if (!set_integer(top_as<std::int64_t>(stack) + b)) [[unlikely]]
+                    return deoptimize();
+                break;
+            }
+            case typed_opcode::sub_integer: {
+                const auto b = pop_as<std::int64_t>(stack);
+                if (!set_integer(top_as<std::int64_t>(stack) - b)) [[unlikely]]
+                    return deoptimize();
+                break;
+            }
+            case typed_opcode::mul_integer: {
+                const auto b = pop_as<std::int64_t>(stack);
+                if (!set_integer(math::checked_mul(top_as<std::int64_t>(stack), b))) [[unlikely]]
+                    return deoptimize();
+                break;
+            }
+            case typed_opcode::exp_integer: {
+                const auto b = pop_as<std::int64_t>(stack);
+                if (b < 0 || !set_integer(math::checked_pow(top_as<std::int64_t>(stack), b))) [[unlikely]]
+                    return deoptimize();
+                break;
+            }
+
+            case typed_opcode::add_real: { const auto b = pop_as<double>(stack); set(top_as<double>(stack) + b); break; }
+            case typed_opcode::sub_real: { const auto b = pop_as<double>(stack); set(top_as<double>(stack) - b); break; }
+            case typed_opcode::mul_real: { const auto b = pop_as<double>(stack); set(top_as<double>(stack) * b); break; }
+            case typed_opcode::div_real: { const auto b = pop_as<double>(stack); set(top_as<double>(stack) / b); break; }
+            case typed_opcode::exp_real: {
+                const auto b = pop_as<double>(stack);
+                set(math::pow(top_as<double>(stack), b).as_double());
+                break;
+            }
+
+            case typed_opcode::add: { const auto b = pop_as<number>(stack); set(top_as<number>(stack) + b); break; }
+            case typed_opcode::sub: { const auto b = pop_as<number>(stack); set(top_as<number>(stack) - b); break; }
+            case typed_opcode::mul: { const auto b = pop_as<number>(stack); set(top_as<number>(stack) * b); break; }
+            case typed_opcode::div: { const auto b = pop_as<number>(stack); set(top_as<number>(stack) / b); break; }
+            case typed_opcode::exp: { const auto b = pop_as<number>(stack); set(top_as<number>(stack) ^ b); break; }
+
+            case typed_opcode::to_real:
+            case typed_opcode::box_integer:
+            case typed_opcode::box_real: {
+                auto& s = stack[stack.size() - 1 - i.operand];
+                const auto from = i.code == typed_opcode::box_real ? value_type::real : value_type::integer;
+                const auto to = i.code == typed_opcode::to_real ? value_type::real : value_type::mixed;
+                s = encode(decode(s, from), to);
+                break;
+            }
+
+            case typed_opcode::call_real: {
+                const auto& function = p.generic.functions[i.operand];
+                count_stat(&pipeline_stats::function_calls);
+                stack.back() = std::bit_cast<typed_slot>(function.scalar(std::bit_cast<double>(stack.back())));
+                break;
+            }
+
+            case typed_opcode::call: {
+                const auto& function = p.generic.functions[i.operand];
+                arguments.clear();
+                for(const auto argument : std::span{ stack }.last(i.argument_count))
+                    arguments.emplace_back(std::bit_cast<number>(argument));
+
+                count_stat(&pipeline_stats::function_calls);
+                const auto result = function.func(arguments);
+                if (!result.has_value() || !std::holds_alternative<number>(result.value())) [[unlikely]]
+                    return deoptimize();
+
+                stack.resize(stack.size() - i.argument_count);
+                stack.emplace_back(std::bit_cast<typed_slot>(std::get<number>(result.value())));
+                break;
+            }
+
+            case typed_opcode::store_temp:
+                temporaries[i.operand] = stack.back();
+                break;
+
+            case typed_opcode::load_temp:
+                stack.emplace_back(temporaries[i.operand]);
+                break;
+        }
+    }
+
+    assert(stack.size() == 1);
+    return decode(stack.back(), p.result);
+}
+
+}
@@ -1,38 +1,254 @@
 #pragma once
 
+#include <cassert>
+#include <cstdint>
 #include <optional>
+#include <span>
 #include <string_view>
+#include <utility>
 #include <vector>
 
+#include <ast.hpp>
+#include <bytecode.hpp>
+#include <common.hpp>
+#include <functions.hpp>
 #include <node.hpp>
+#include <stats.hpp>
+#include <symbols.hpp>
 
 namespace mathc
 {
 
+// A node on interpreter::simplify's work stack and how many of its children are done.
+template<typename Index>
+struct simplify_task
+{
+    Index at;
+    std::uint32_t stage{ 0 };
+};
+
 struct vm
 {
-    constexpr void insert_symbol(const std::string_view symbol, const node& node)
+    constexpr symbol_id insert_symbol(const std::string_view symbol, const node& node)
     {
-        for(auto& [name, n] : symbols) {
-            if (symbol == name) {
-                n = copy_node(node);
-                return;
-            }
-        }
+        const auto id = symbols.intern(symbol);
+        insert_symbol(id, node);
+        return id;
+    }
+
+    constexpr void insert_symbol(const symbol_id id, const node& node)
+    {
+        if (id >= bindings.size())
+            bindings.resize(id + 1);
+        if (id >= binding_programs.size())
+            binding_programs.resize(id + 1);
 
-        symbols.emplace_back(symbol, copy_node(node));
+        bindings[id] = copy_node(node);
+        binding_programs[id].reset();
+    }
+
+    // Borrowed: valid until the symbol is rebound.
+    constexpr const node* symbol_node(const symbol_id id) const
+    {
+        assert(id != null_symbol);
+        count_stat(&pipeline_stats::symbol_lookups);
+        return id < bindings.size() && bindings[id].has_value() ? &bindings[id].value() : nullptr;
+    }
+
+    constexpr const node* symbol_node(const std::string_view symbol) const
+    {
+        const auto id = symbols.find(symbol);
+        return id.has_value() ? symbol_node(id.value()) : nullptr;
+    }
+
+    // Forgets every symbol and its binding: programs compiled against this vm's table before
+    // hold ids that may now name other symbols.
+    constexpr void clear_symbols()
+    {
+        symbols.clear();
+        bindings.clear();
+        binding_programs.clear();
     }
 
-    constexpr std::optional<node> symbol_node(const std::string_view symbol) const
+    // Registers a function for expressions parsed and compiled against this vm's table. Its
+    // calls resolve to the returned id once, when parsed.
+    // Programs compiled from bindings hold the functions they call, so they are compiled again.
+    constexpr function_id define_function(const function& f)
     {
-        for(auto& [name, n] : symbols)
-            if (name == symbol)
-                return std::make_optional<node>(copy_node(n));
+        for(auto& p : binding_programs)
+            p.reset();
 
-        return {};
+        return functions.define(f);
     }
 
-    std::vector<std::pair<std::string, node>> symbols{};
+    // Calls made without a function_table hold builtin ids, which are the same in every table.
+    constexpr const function* find_function(const function_id id, const std::string_view name) const
+    {
+        const auto resolved = id != null_function ? id : functions.find(name).value_or(null_function);
+        return resolved < functions.size() ? &functions[resolved] : nullptr;
+    }
+
+    constexpr evaluation_result execute(const program& p);
+    constexpr evaluation_result execute(const program_view& p);
+    // The symbol's value: a constant binding as it is, any other compiled on its first load
+    // and the program kept until the symbol is rebound. Without an id, looked up by name.
+    constexpr evaluation_result resolve_symbol(symbol_id id, const std::string_view symbol);
+
+    symbol_table symbols{};
+    function_table functions{};
+    std::vector<std::optional<node>> bindings{};
+    std::vector<number> stack{};
+    std::vector<number> temporaries{};
+
+    // interpreter::simplify's work and value stacks, kept so their capacity is reused.
+    std::vector<simplify_task<const node*>> simplify_tasks{};
+    std::vector<simplify_value> simplify_values{};
+    std::vector<simplify_task<node_index>> flat_simplify_tasks{};
+    std::vector<flat_simplify_result> flat_simplify_values{};
+
+private:
+    // Parallel to bindings, and never shorter wherever a binding is set.
+    std::vector<std::optional<program>> binding_programs{};
+
+    // Either kind of program: they have the same members.
+    constexpr evaluation_result run(const auto& p);
+
+    constexpr void unwind(const std::size_t base)
+    {
+        stack.erase(std::next(stack.begin(), static_cast<long>(base)), stack.end());
+    }
+
+    constexpr void leave(const std::size_t base, const std::size_t temporaries_base)
+    {
+        unwind(base);
+        temporaries.erase(std::next(temporaries.begin(), static_cast<long>(temporaries_base)), temporaries.end());
+    }
 };
 
+// Implementation
+
+constexpr inline evaluation_result vm::resolve_symbol(symbol_id id, const std::string_view symbol)
+{
+    if (id == null_symbol)
+        id = symbols.find(symbol).value_or(null_symbol);
+
+    const auto* bound = id != null_symbol ? symbol_node(id) : nullptr;
+    if (!bound)
+        return make_evaluation_error(std::format("Symbol {} is unbound.", symbol));
+
+    if (const auto* constant = std::get_if<constant_node>(bound); constant)
+        return constant->value;
+
+    // Sized by insert_symbol, so a nested load never moves the program running here.
+    assert(id < binding_programs.size());
+    auto& cached = binding_programs[id];
+    if (!cached.has_value()) {
+        auto bound_program = compiler::compile(*bound, symbols, functions);
+        if (!bound_program.has_value())
+            return make_evaluation_error(bound_program.error().error);
+
+        cached = std::move(bound_program.value());
+    }
+
+    return execute(cached.value());
+}
+
+constexpr inline evaluation_result vm::execute(const program& p)
+{
+    return run(p);
+}
+
+constexpr inline evaluation_result vm::execute(const program_view& p)
+{
+    return run(p);
+}
+
+constexpr inline evaluation_result vm::run(const auto& p)
+{
+    assert(!p.instructions.empty());
+
+    // Nested executions (symbols bound to expressions) run on top of the caller's frame.
+    const auto base = stack.size();
+    const auto temporaries_base = temporaries.size();
+    stack.reserve(base + p.max_stack_depth);
+    temporaries.resize(temporaries_base + p.temporaries, number::from_int(0));
+
+    for(const auto& i : p.instructions) {
+        switch(i.code) {
+            case opcode::push_constant: {
+                stack.emplace_back(p.constants[i.operand]);
+                break;
+            }
+            case opcode::load_symbol: {
+                const auto id = p.symbol_ids.empty() ? null_symbol : p.symbol_ids[i.operand];
+                const auto value = resolve_symbol(id, p.symbols[i.operand]);
+                if (!value.has_value()) [[unlikely]] {
+                    leave(base, temporaries_base);
+                    return value;
+                }
+
+                stack.emplace_back(value.value());
+                break;
+            }
+            case opcode::add:
+            case opcode::sub:
+            case opcode::mul:
+            case opcode::div:
+            case opcode::exp: {
+                const auto right = stack.back();
+                stack.pop_back();
+                auto& left = stack.back();
+
+                switch(i.code) {
+                    case opcode::add: left = left + right; break;
+                    case opcode::sub: left = left - right; break;
+                    case opcode::mul: left = left * right; break;
+                    case opcode::div: left = left / right; break;
+                    case opcode::exp: left = left ^ right; break;
+                    case opcode::push_constant:
+                    case opcode::load_symbol:
+                    case opcode::call:
+                    case opcode::store_temp:
+                    case opcode::load_temp:
+                        std::unreachable();
+                }
+                break;
+            }
+            case opcode::call: {
+                const auto& function = p.functions[i.operand];
+                const auto arguments = std::span<number>{ stack }.last(i.argument_count);
+
+                count_stat(&pipeline_stats::function_calls);
+                const auto result = function.func(arguments);
+                if (!result.has_value()) [[unlikely]] {
+                    leave(base, temporaries_base);
+                    return make_evaluation_error(result.error());
+                }
+
+                if (!std::holds_alternative<number>(result.value())) [[unlikely]] {
+                    leave(base, temporaries_base);
+                    return make_evaluation_error(std::format("Function {} did not return a number.", function.name));
+                }
+
+                unwind(stack.size() - i.argument_count);
+                stack.emplace_back(std::get<number>(result.value()));
+                break;
+            }
+            case opcode::store_temp: {
+                temporaries[temporaries_base + i.operand] = stack.back();
+                break;
+            }
+            case opcode::load_temp: {
+                stack.emplace_back(temporaries[temporaries_base + i.operand]);
+                break;
+            }
+        }
+    }
+
+    assert(stack.size() == base + 1);
+    const auto result = stack.back();
+    leave(base, temporaries_base);
+    return result;
+}
+
 }
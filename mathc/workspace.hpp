@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <ast.hpp>
+#include <bytecode.hpp>
+#include <number.hpp>
+#include <parser.hpp>
+#include <token.hpp>
+#include <vm.hpp>
+
+namespace mathc
+{
+
+// Everything lex -> parse -> compile -> execute needs, kept between evaluations so that, once
+// it has grown to fit the inputs, evaluating allocates nothing: the ast, the parser's and the
+// compiler's stacks and the program are cleared and refilled in place, tokens are views into
+// the source and the vm's stack keeps its capacity.
+//
+// Only numeric results are produced: an unbound symbol is reported rather than simplified
+// into a residual. Symbols bound to anything but a constant are compiled when read, which
+// allocates, and so does a symbol name longer than std::string's inline buffer for the
+// first compile of a program.
+//
+// Failures carry a code and views instead of a message, formatted only by message(). Parse
+// and unbound symbol failures allocate nothing; compile and function failures keep the
+// message their stage already formatted.
+
+enum class workspace_stage : std::uint8_t
+{
+    parse,
+    compile,
+    execute
+};
+
+enum class workspace_error_code : std::uint8_t
+{
+    parse,           // detail: the parser's message, token: where
+    compile,         // detail: the compiler's message
+    unbound_symbol,  // detail: the symbol
+    execution        // detail: the vm's or the function's message
+};
+
+struct workspace_error
+{
+    workspace_error_code code;
+    token token{};
+    std::string_view detail{};  // valid until the workspace evaluates again
+
+    constexpr std::string message() const;
+};
+
+using workspace_result = std::expected<number, workspace_error>;
+
+struct workspace
+{
+    constexpr workspace_result evaluate(std::string_view source, vm& vm);
+
+    // Called as each stage finishes, failed or not: reading an allocation counter here gives
+    // per-stage counts.
+    void(*on_stage)(workspace_stage stage, void* context){ nullptr };
+    void* context{ nullptr };
+
+    ast tree{};
+    parse_scratch<node_index> parser_scratch{};
+    compile_scratch compiler_scratch{};
+    program compiled{};
+
+private:
+    constexpr void finish(const workspace_stage stage) const
+    {
+        if (on_stage)
+            on_stage(stage, context);
+    }
+
+    std::string failure{};  // compile and execution messages, for workspace_error::detail
+};
+
+// Implementation
+
+constexpr inline std::string workspace_error::message() const
+{
+    switch(code) {
+        case workspace_error_code::parse:
+            return std::format("{} | token: {} {}", detail, token.value, token_type_str(token.type));
+        case workspace_error_code::unbound_symbol:
+            return std::format("Symbol {} is unbound.", detail);
+        case workspace_error_code::compile:
+        case workspace_error_code::execution:
+            return std::string{ detail };
+    }
+
+    std::unreachable();
+}
+
+constexpr inline workspace_result workspace::evaluate(const std::string_view source, vm& vm)
+{
+    const auto fail = [](const workspace_error_code code, const std::string_view detail, const token& where = {}) {
+        return workspace_result{ std::unexpect_t{}, workspace_error{ .code = code, .token = where, .detail = detail } };
+    };
+
+    tree.clear();
+    const auto root = arena_parser::parse(source, parser_scratch, tree, vm.symbols, vm.functions);
+    finish(workspace_stage::parse);
+    if (!root.has_value()) [[unlikely]]
+        return fail(workspace_error_code::parse, root.error().error, root.error().token);
+
+    auto emitted = compiler::compile(tree, root.value(), vm.symbols, vm.functions, compiled, compiler_scratch);
+    finish(workspace_stage::compile);
+    if (!emitted.has_value()) [[unlikely]] {
+        failure = std::move(emitted.error().error);
+        return fail(workspace_error_code::compile, failure);
+    }
+
+    // Checked up front, so the vm never formats its unbound symbol error.
+    for(auto i = 0uz; i < compiled.symbols.size(); i++) {
+        if (!vm.symbol_node(compiled.symbol_ids[i])) [[unlikely]] {
+            finish(workspace_stage::execute);
+            return fail(workspace_error_code::unbound_symbol, compiled.symbols[i]);
+        }
+    }
+
+    auto value = vm.execute(compiled);
+    finish(workspace_stage::execute);
+    if (!value.has_value()) [[unlikely]] {
+        failure = std::move(value.error().error);
+        return fail(workspace_error_code::execution, failure);
+    }
+
+    return value.value();
+}
+
+}